@@ -22,6 +22,7 @@ int main(){
 	server->addResource("/images/wine_glass.png","resources/images/wine_glass.png");
 	server->addResource("/images/red_wine.png","resources/images/red_wine.png");
 	server->addResource("/images/white_wine.png","resources/images/white_wine.png");
+	server->addResource("/images/black_wood_vertical.jpg","resources/images/black_wood_vertical(2560x1600).jpg",false);
 	server->addResource("/css/fonts.css","resources/css/fonts.css");
 	server->addResource("/fonts/avenir.woff","resources/fonts/avenir.woff");
 	server->addResource("/fonts/avenir.ttf","resources/fonts/avenir.ttf");
@@ -110,6 +110,33 @@ typedef SOCKET sock_t;
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#if defined(__linux__) && !defined(NS_DISABLE_EPOLL) && !defined(NS_ENABLE_EPOLL)
+#define NS_ENABLE_EPOLL         // Use epoll() instead of select() on Linux
+#endif
+#ifdef NS_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && !defined(NS_DISABLE_SENDFILE)
+#define NS_ENABLE_SENDFILE      // Send files with sendfile(), see ns_send_file
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) && defined(__has_include) && \
+    !defined(NS_DISABLE_IO_URING) && !defined(NS_ENABLE_SSL)
+#if __has_include(<linux/io_uring.h>) && !defined(NS_ENABLE_IO_URING)
+#define NS_ENABLE_IO_URING      // io_uring engine, see ns_server_enable_io_uring
+#endif
+#endif
+#ifdef NS_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef IORING_FEAT_EXT_ARG
+#undef NS_ENABLE_IO_URING       // Kernel headers are too old
+#endif
+#endif
 #define closesocket(x) close(x)
 #define __cdecl
 #define INVALID_SOCKET (-1)
@@ -126,6 +153,42 @@ typedef int sock_t;
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
+#ifndef NS_ACCEPT_BUDGET
+#define NS_ACCEPT_BUDGET 64   // Max connections accepted per poll iteration
+#endif
+
+#ifndef NS_RECV_MIN_SIZE
+#define NS_RECV_MIN_SIZE 2048     // Initial and minimal recv() size
+#endif
+#ifndef NS_RECV_MAX_SIZE
+#define NS_RECV_MAX_SIZE 65536    // Upper limit for adaptive recv() size
+#endif
+#ifndef NS_RECV_BUDGET
+#define NS_RECV_BUDGET 262144     // Max bytes read from a socket per poll
+#endif
+
+#ifndef NS_IOBUF_IDLE_SIZE
+#define NS_IOBUF_IDLE_SIZE 4096   // Larger empty buffers are released
+#endif
+
+#ifndef NS_MAX_IOV
+#define NS_MAX_IOV 64             // Max send chain pieces per writev()
+#endif
+
+#ifndef NS_SENDFILE_MAX
+#define NS_SENDFILE_MAX (1 << 30)  // Max bytes per sendfile() call
+#endif
+
+#ifndef NS_TIMER_TICK_MS
+#define NS_TIMER_TICK_MS 10   // Resolution of connection timers
+#endif
+#define NS_TIMER_LEVELS 4     // Timer wheel spans 64^4 ticks
+#define NS_TIMER_SLOTS 64
+
+#ifndef NS_POLL_INTERVAL_MS
+#define NS_POLL_INTERVAL_MS 1000  // Max wait while connections want NS_POLL
+#endif
+
 #ifdef NS_ENABLE_SSL
 #ifdef __APPLE__
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
@@ -150,25 +213,40 @@ union socket_address {
 
 // IO buffers interface
 struct iobuf {
-  char *buf;
-  size_t len;
-  size_t size;
+  char *buf;    // Start of data
+  size_t len;   // Length of data
+  size_t size;  // Capacity, counted from buf
+  size_t head;  // Consumed space in front of buf, reclaimed on demand
 };
 
 void iobuf_init(struct iobuf *, size_t initial_size);
 void iobuf_free(struct iobuf *);
 size_t iobuf_append(struct iobuf *, const void *data, size_t data_size);
+size_t iobuf_reserve(struct iobuf *, size_t data_size);
 void iobuf_remove(struct iobuf *, size_t data_size);
 
+// Send chain segment. Data is sent in place, then release(param) is called.
+struct ns_send_seg {
+  struct ns_send_seg *next;
+  const char *data;       // NULL if the segment is a file
+  size_t len;
+  int fd;                 // File and position to send from if data is NULL
+  int64_t offset;
+  void (*release)(void *param);
+  void *param;
+};
+
 // Net skeleton interface
 // Events. Meaning of event parameter (evp) is given in the comment.
 enum ns_event {
-  NS_POLL,     // Sent to each connection on each call to ns_server_poll()
+  NS_POLL,     // Sent to NSF_WANT_POLL connections on each ns_server_poll()
   NS_ACCEPT,   // New connection accept()-ed. union socket_address *remote_addr
   NS_CONNECT,  // connect() succeeded or failed. int *success_status
   NS_RECV,     // Data has benn received. int *num_bytes
   NS_SEND,     // Data has been written to a socket. int *num_bytes
-  NS_CLOSE     // Connection is closed. NULL
+  NS_CLOSE,    // Connection is closed. NULL
+  NS_FILE_READ, // Queued file read has been appended to send_iobuf. int *n
+  NS_TIMER     // Timer set by ns_set_timer() has expired. time_t *current_time
 };
 
 // Callback function (event handler) prototype, must be defined by user.
@@ -176,6 +254,13 @@ enum ns_event {
 struct ns_connection;
 typedef void (*ns_callback_t)(struct ns_connection *, enum ns_event, void *evp);
 
+// Hierarchical timing wheel, see ns_set_timer()
+struct ns_timer_wheel {
+  struct ns_connection *slots[NS_TIMER_LEVELS][NS_TIMER_SLOTS];
+  uint64_t occupied[NS_TIMER_LEVELS];   // Bitmaps of non-empty slots
+  uint64_t now;                         // Last processed tick
+};
+
 struct ns_server {
   void *server_data;
   sock_t listening_sock;
@@ -184,6 +269,18 @@ struct ns_server {
   SSL_CTX *ssl_ctx;
   SSL_CTX *client_ssl_ctx;
   sock_t ctl[2];
+  int accept_budget;          // Max connections accepted per poll iteration
+  int num_active_connections;
+  struct ns_connection *dirty_connections;  // See ns_mark_dirty()
+  struct ns_connection *poll_connections;   // Connections with NSF_WANT_POLL
+  struct ns_timer_wheel timers;
+#ifdef NS_ENABLE_EPOLL
+  int epoll_fd;               // epoll instance, or -1 to use select()
+  sock_t epoll_listening_sock;  // Listening socket registered with epoll
+#endif
+#ifdef NS_ENABLE_IO_URING
+  struct ns_uring *uring;     // io_uring engine, or NULL if not enabled
+#endif
   int server_id; // @author Thomas Lextrait
 };
 
@@ -194,10 +291,29 @@ struct ns_connection {
   union socket_address sa;
   struct iobuf recv_iobuf;
   struct iobuf send_iobuf;
+  struct ns_send_seg *send_chain;       // Sent before send_iobuf
+  struct ns_send_seg *send_chain_last;
+  size_t send_chain_len;                // Bytes left in send_chain
   SSL *ssl;
   void *connection_data;
   time_t last_io_time;
   unsigned int flags;
+  unsigned int recv_size;     // Adaptive recv() size, see ns_read_from_socket
+  struct ns_connection *dirty_prev, *dirty_next;
+  struct ns_connection *poll_prev, *poll_next;
+  struct ns_connection *timer_prev, *timer_next;
+  uint64_t timer_expires;     // Timer wheel tick at which the timer fires
+  int timer_slot;             // Timer wheel slot + 1, or 0 if not armed
+#ifdef NS_ENABLE_EPOLL
+  unsigned int epoll_events;  // Interest set currently registered with epoll
+#endif
+#ifdef NS_ENABLE_IO_URING
+  unsigned int uring_ops;     // io_uring operations in flight, bitmask
+  time_t uring_linger;        // Deadline for in-flight ops of closed conn
+  char *uring_recv_buf;       // Staging buffer for in-flight recv
+  char *uring_file_buf;       // Staging buffer for in-flight file read
+  struct iobuf uring_send_iobuf;  // Data owned by in-flight send
+#endif
 
   int server_id; // @author Thomas Lextrait
 
@@ -209,6 +325,7 @@ struct ns_connection {
 #define NSF_ACCEPTED                (1 << 5)
 #define NSF_WANT_READ               (1 << 6)
 #define NSF_WANT_WRITE              (1 << 7)
+#define NSF_WANT_POLL               (1 << 8)
 
 #define NSF_USER_1                  (1 << 26)
 #define NSF_USER_2                  (1 << 27)
@@ -221,10 +338,15 @@ struct ns_connection {
 void ns_server_init(struct ns_server *, void *server_data, ns_callback_t);
 void ns_server_free(struct ns_server *);
 int ns_server_poll(struct ns_server *, int milli);
+int ns_server_enable_io_uring(struct ns_server *);
+int ns_queue_file_read(struct ns_connection *, int fd, int len);
 void ns_server_wakeup(struct ns_server *);
 void ns_server_wakeup_ex(struct ns_server *, ns_callback_t, void *, size_t);
 void ns_iterate(struct ns_server *, ns_callback_t cb, void *param);
 struct ns_connection *ns_add_sock(struct ns_server *, sock_t sock, void *p);
+void ns_set_timer(struct ns_connection *, int milli);
+void ns_clear_timer(struct ns_connection *);
+void ns_mark_dirty(struct ns_connection *);
 
 int ns_bind(struct ns_server *, const char *addr);
 int ns_set_ssl_cert(struct ns_server *, const char *ssl_cert);
@@ -233,6 +355,11 @@ struct ns_connection *ns_connect(struct ns_server *, const char *host,
                                  int port, int ssl, void *connection_param);
 
 int ns_send(struct ns_connection *, const void *buf, int len);
+int ns_send_ref(struct ns_connection *, const void *buf, size_t len,
+                void (*release)(void *), void *param);
+int ns_send_file(struct ns_connection *, int fd, int64_t offset, size_t len,
+                 void (*release)(void *), void *param);
+size_t ns_send_pending(const struct ns_connection *);
 int ns_printf(struct ns_connection *, const char *fmt, ...);
 int ns_vprintf(struct ns_connection *, const char *fmt, va_list ap);
 
@@ -242,6 +369,8 @@ int ns_socketpair(sock_t [2]);
 int ns_socketpair2(sock_t [2], int sock_type);  // SOCK_STREAM or SOCK_DGRAM
 void ns_set_close_on_exec(sock_t);
 void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags);
+void ns_addr_to_str(const union socket_address *, char *buf, size_t len,
+                    int flags);
 int ns_hexdump(const void *buf, int len, char *dst, int dst_len);
 
 #ifdef __cplusplus
@@ -290,7 +419,7 @@ struct ctl_msg {
 };
 
 void iobuf_init(struct iobuf *iobuf, size_t size) {
-  iobuf->len = iobuf->size = 0;
+  iobuf->len = iobuf->size = iobuf->head = 0;
   iobuf->buf = NULL;
 
   if (size > 0 && (iobuf->buf = (char *) NS_MALLOC(size)) != NULL) {
@@ -300,26 +429,48 @@ void iobuf_init(struct iobuf *iobuf, size_t size) {
 
 void iobuf_free(struct iobuf *iobuf) {
   if (iobuf != NULL) {
-    if (iobuf->buf != NULL) NS_FREE(iobuf->buf);
+    if (iobuf->buf != NULL) NS_FREE(iobuf->buf - iobuf->head);
     iobuf_init(iobuf, 0);
   }
 }
 
-size_t iobuf_append(struct iobuf *io, const void *buf, size_t len) {
-  char *p = NULL;
+// Make room for at least n more bytes. Returns the number of bytes that
+// can be written at buf + len without reallocation.
+// Consumed space in front of the data is reclaimed only when the data is
+// not larger than it, so that memmove() cost is paid for by consumed bytes.
+// Otherwise the capacity is doubled, so appending in pieces is linear.
+size_t iobuf_reserve(struct iobuf *io, size_t n) {
+  char *base = io->buf - io->head, *p;
+  size_t alloc = io->head + io->size, new_size;
 
   assert(io != NULL);
   assert(io->len <= io->size);
 
-  if (len <= 0) {
-  } else if (io->len + len <= io->size) {
-    memcpy(io->buf + io->len, buf, len);
-    io->len += len;
-  } else if ((p = (char *) NS_REALLOC(io->buf, io->len + len)) != NULL) {
-    io->buf = p;
+  if (io->size - io->len >= n) {
+  } else if (io->head > 0 && io->len <= io->head && io->len + n <= alloc) {
+    memmove(base, io->buf, io->len);
+    io->buf = base;
+    io->size = alloc;
+    io->head = 0;
+  } else {
+    new_size = alloc * 2 > io->head + io->len + n ? alloc * 2 :
+      io->head + io->len + n;
+    if ((p = (char *) NS_REALLOC(base, new_size)) != NULL) {
+      io->buf = p + io->head;
+      io->size = new_size - io->head;
+    }
+  }
+
+  return io->size - io->len;
+}
+
+size_t iobuf_append(struct iobuf *io, const void *buf, size_t len) {
+  assert(io != NULL);
+  assert(io->len <= io->size);
+
+  if (len > 0 && iobuf_reserve(io, len) >= len) {
     memcpy(io->buf + io->len, buf, len);
     io->len += len;
-    io->size = io->len;
   } else {
     len = 0;
   }
@@ -327,10 +478,24 @@ size_t iobuf_append(struct iobuf *io, const void *buf, size_t len) {
   return len;
 }
 
+// O(1), data is not moved
 void iobuf_remove(struct iobuf *io, size_t n) {
-  if (n > 0 && n <= io->len) {
-    memmove(io->buf, io->buf + n, io->len - n);
+  if (n > 0 && n < io->len) {
+    io->buf += n;
     io->len -= n;
+    io->size -= n;
+    io->head += n;
+  } else if (n > 0 && n == io->len) {
+    io->buf -= io->head;
+    io->size += io->head;
+    io->len = io->head = 0;
+  }
+}
+
+// Buffers of idle connections are released, unless they are small
+static void ns_trim_iobuf(struct iobuf *io) {
+  if (io->len == 0 && io->head + io->size > NS_IOBUF_IDLE_SIZE) {
+    iobuf_free(io);
   }
 }
 
@@ -357,17 +522,172 @@ void *ns_start_thread(void *(*f)(void *), void *p) {
 }
 #endif  // NS_DISABLE_THREADS
 
+static int ns_wants_read(const struct ns_connection *conn) {
+  return !(conn->flags & NSF_WANT_WRITE);
+}
+
+static int ns_wants_write(const struct ns_connection *conn) {
+  return ((conn->flags & NSF_CONNECTING) && !(conn->flags & NSF_WANT_READ)) ||
+    (ns_send_pending(conn) > 0 && !(conn->flags & NSF_CONNECTING) &&
+     !(conn->flags & NSF_BUFFER_BUT_DONT_SEND));
+}
+
+#ifdef NS_ENABLE_EPOLL
+static void ns_epoll_ctl(struct ns_server *server, int op, sock_t sock,
+                         unsigned int events, void *ptr) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(server->epoll_fd, op, sock, &ev) != 0) {
+    DBG(("epoll_ctl(%d, %d): %s", op, sock, strerror(errno)));
+  }
+}
+
+static unsigned int ns_epoll_interest(const struct ns_connection *conn) {
+  return (ns_wants_read(conn) ? (unsigned int) EPOLLIN : 0) |
+    (ns_wants_write(conn) ? (unsigned int) EPOLLOUT : 0);
+}
+
+// Bring the registered interest set in sync with connection flags and
+// send buffer. epoll_ctl() is called only if the interest set has changed.
+static void ns_epoll_update(struct ns_connection *conn) {
+  unsigned int events = ns_epoll_interest(conn);
+  if (conn->server->epoll_fd >= 0 && events != conn->epoll_events) {
+    ns_epoll_ctl(conn->server, EPOLL_CTL_MOD, conn->sock, events, conn);
+    conn->epoll_events = events;
+  }
+}
+#endif
+
+// Doubly linked connection lists. A connection is on a list if it has
+// a predecessor, or if it is the list head.
+#define NS_LIST_CONTAINS(head, c, prev) ((c)->prev != NULL || (head) == (c))
+#define NS_LIST_INSERT(head, c, prev, next) do { \
+  (c)->prev = NULL; (c)->next = (head);           \
+  if ((head) != NULL) (head)->prev = (c);         \
+  (head) = (c);                                   \
+} while (0)
+#define NS_LIST_REMOVE(head, c, prev, next) do { \
+  if ((c)->prev != NULL) (c)->prev->next = (c)->next; else (head) = (c)->next; \
+  if ((c)->next != NULL) (c)->next->prev = (c)->prev;                       \
+  (c)->prev = (c)->next = NULL;                                             \
+} while (0)
+
+// Monotonic clock in milliseconds, used by connection timers
+static uint64_t ns_millis(void) {
+#ifdef _WIN32
+  return (uint64_t) GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+// Connection timers live in a hierarchical timing wheel. Slots of level N
+// hold timers that are due in 64^N .. 64^(N+1) ticks, so arming and
+// cancelling a timer is O(1). When a level wraps around, the next slot of
+// the level above is cascaded down. Bitmaps of non-empty slots tell how
+// long the poll loop may sleep.
+#define NS_TIMER_SHIFT(level) (6 * (level))
+#define NS_TIMER_BIT(slot) ((uint64_t) 1 << (slot))
+
+static void ns_timer_link(struct ns_timer_wheel *w, struct ns_connection *c) {
+  uint64_t delta;
+  int level = 0, slot;
+
+  if (c->timer_expires < w->now) c->timer_expires = w->now;
+  delta = c->timer_expires - w->now;
+  while (level < NS_TIMER_LEVELS - 1 &&
+         (delta >> NS_TIMER_SHIFT(level + 1)) != 0) {
+    level++;
+  }
+  slot = (int) ((c->timer_expires >> NS_TIMER_SHIFT(level)) &
+                (NS_TIMER_SLOTS - 1));
+  NS_LIST_INSERT(w->slots[level][slot], c, timer_prev, timer_next);
+  w->occupied[level] |= NS_TIMER_BIT(slot);
+  c->timer_slot = level * NS_TIMER_SLOTS + slot + 1;
+}
+
+static void ns_timer_unlink(struct ns_timer_wheel *w, struct ns_connection *c) {
+  int level = (c->timer_slot - 1) / NS_TIMER_SLOTS;
+  int slot = (c->timer_slot - 1) % NS_TIMER_SLOTS;
+
+  NS_LIST_REMOVE(w->slots[level][slot], c, timer_prev, timer_next);
+  if (w->slots[level][slot] == NULL) w->occupied[level] &= ~NS_TIMER_BIT(slot);
+  c->timer_slot = 0;
+}
+
+// Arm connection timer, NS_TIMER is sent after at least milli milliseconds.
+// Timer is one-shot, re-arming replaces the previous deadline.
+void ns_set_timer(struct ns_connection *conn, int milli) {
+  struct ns_timer_wheel *w = &conn->server->timers;
+  uint64_t ticks = milli > 0 ? (uint64_t) milli / NS_TIMER_TICK_MS + 1 : 1,
+           max_ticks = NS_TIMER_BIT(NS_TIMER_SHIFT(NS_TIMER_LEVELS)) - 1;
+
+  if (conn->timer_slot != 0) ns_timer_unlink(w, conn);
+  // Deadlines beyond the wheel span (days) fire early, that is harmless
+  // for timers that re-check their deadline
+  conn->timer_expires = ns_millis() / NS_TIMER_TICK_MS +
+    (ticks < max_ticks ? ticks : max_ticks);
+  ns_timer_link(w, conn);
+}
+
+void ns_clear_timer(struct ns_connection *conn) {
+  if (conn->timer_slot != 0) ns_timer_unlink(&conn->server->timers, conn);
+}
+
+// Queue connection for the end of the poll iteration, where it is closed
+// if it is done, or its I/O engine registration is updated. Data and
+// flags of a connection changed outside of its own event handler must be
+// followed by this call, ns_send() and ns_printf() do it implicitly.
+void ns_mark_dirty(struct ns_connection *conn) {
+  struct ns_server *s = conn->server;
+  if (!NS_LIST_CONTAINS(s->dirty_connections, conn, dirty_prev)) {
+    NS_LIST_INSERT(s->dirty_connections, conn, dirty_prev, dirty_next);
+  }
+}
+
 static void ns_add_conn(struct ns_server *server, struct ns_connection *c) {
   c->next = server->active_connections;
   server->active_connections = c;
   c->prev = NULL;
   if (c->next != NULL) c->next->prev = c;
+  server->num_active_connections++;
+#ifdef NS_ENABLE_EPOLL
+  if (server->epoll_fd >= 0) {
+    c->epoll_events = ns_epoll_interest(c);
+    ns_epoll_ctl(server, EPOLL_CTL_ADD, c->sock, c->epoll_events, c);
+  }
+#endif
+  ns_mark_dirty(c);
 }
 
 static void ns_remove_conn(struct ns_connection *conn) {
-  if (conn->prev == NULL) conn->server->active_connections = conn->next;
+  struct ns_server *s = conn->server;
+
+  if (conn->prev == NULL) s->active_connections = conn->next;
   if (conn->prev) conn->prev->next = conn->next;
   if (conn->next) conn->next->prev = conn->prev;
+  s->num_active_connections--;
+  if (NS_LIST_CONTAINS(s->dirty_connections, conn, dirty_prev)) {
+    NS_LIST_REMOVE(s->dirty_connections, conn, dirty_prev, dirty_next);
+  }
+  if (NS_LIST_CONTAINS(s->poll_connections, conn, poll_prev)) {
+    NS_LIST_REMOVE(s->poll_connections, conn, poll_prev, poll_next);
+  }
+  ns_clear_timer(conn);
+#ifdef NS_ENABLE_EPOLL
+  if (s->epoll_fd >= 0) {
+    ns_epoll_ctl(s, EPOLL_CTL_DEL, conn->sock, 0, NULL);
+  }
+#endif
 }
 
 // Print message to buffer. If buffer is large enough to hold the message,
@@ -414,6 +734,7 @@ int ns_vprintf(struct ns_connection *conn, const char *fmt, va_list ap) {
 
   if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
     iobuf_append(&conn->send_iobuf, buf, len);
+    ns_mark_dirty(conn);
   }
   if (buf != mem && buf != NULL) {
     free(buf);
@@ -435,13 +756,40 @@ static void ns_call(struct ns_connection *conn, enum ns_event ev, void *p) {
   if (conn->server->callback) conn->server->callback(conn, ev, p);
 }
 
-static void ns_close_conn(struct ns_connection *conn) {
-  DBG(("%p %d", conn, conn->flags));
-  ns_call(conn, NS_CLOSE, NULL);
-  ns_remove_conn(conn);
+// Drops n sent bytes from the front of the send chain, then send_iobuf
+static void ns_consume_sent(struct ns_connection *conn, size_t n) {
+  struct ns_send_seg *seg;
+
+  while (n > 0 && (seg = conn->send_chain) != NULL) {
+    if (n < seg->len) {
+      if (seg->data != NULL) {
+        seg->data += n;
+      } else {
+        seg->offset += n;
+      }
+      seg->len -= n;
+      conn->send_chain_len -= n;
+      return;
+    }
+    n -= seg->len;
+    conn->send_chain_len -= seg->len;
+    if ((conn->send_chain = seg->next) == NULL) conn->send_chain_last = NULL;
+    if (seg->release != NULL) seg->release(seg->param);
+    NS_FREE(seg);
+  }
+  iobuf_remove(&conn->send_iobuf, n);
+}
+
+static void ns_free_conn(struct ns_connection *conn) {
   closesocket(conn->sock);
   iobuf_free(&conn->recv_iobuf);
+  ns_consume_sent(conn, conn->send_chain_len);
   iobuf_free(&conn->send_iobuf);
+#ifdef NS_ENABLE_IO_URING
+  iobuf_free(&conn->uring_send_iobuf);
+  NS_FREE(conn->uring_recv_buf);
+  NS_FREE(conn->uring_file_buf);
+#endif
 #ifdef NS_ENABLE_SSL
   if (conn->ssl != NULL) {
     SSL_free(conn->ssl);
@@ -450,6 +798,148 @@ static void ns_close_conn(struct ns_connection *conn) {
   NS_FREE(conn);
 }
 
+#ifdef NS_ENABLE_IO_URING
+static void ns_uring_linger(struct ns_connection *conn);
+static void ns_uring_arm(struct ns_connection *conn);
+#endif
+
+static void ns_close_conn(struct ns_connection *conn) {
+  DBG(("%p %d", conn, conn->flags));
+  ns_call(conn, NS_CLOSE, NULL);
+  ns_remove_conn(conn);
+#ifdef NS_ENABLE_IO_URING
+  if (conn->uring_ops != 0) {
+    ns_uring_linger(conn);  // Freed when the kernel is done with it
+    return;
+  }
+#endif
+  ns_free_conn(conn);
+}
+
+static int ns_ctz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  while (!(x & 1)) { x >>= 1; n++; }
+  return n;
+#endif
+}
+
+// First tick after the current one at which a non-empty slot is due,
+// either to fire (level 0) or to be cascaded. Returns 0 if there are no
+// timers.
+static uint64_t ns_timer_next_tick(const struct ns_timer_wheel *w) {
+  uint64_t next = 0, bits, base, tick;
+  int level, s;
+
+  for (level = 0; level < NS_TIMER_LEVELS; level++) {
+    if ((bits = w->occupied[level]) == 0) continue;
+    // Rotate the bitmap so that bit 0 is the slot after the current one
+    base = w->now >> NS_TIMER_SHIFT(level);
+    s = (int) ((base + 1) & (NS_TIMER_SLOTS - 1));
+    bits = (bits >> s) | (bits << ((NS_TIMER_SLOTS - s) & (NS_TIMER_SLOTS - 1)));
+    tick = (base + 1 + ns_ctz64(bits)) << NS_TIMER_SHIFT(level);
+    if (next == 0 || tick < next) next = tick;
+  }
+
+  return next;
+}
+
+static void ns_timer_cascade(struct ns_timer_wheel *w, int level) {
+  int slot = (int) ((w->now >> NS_TIMER_SHIFT(level)) & (NS_TIMER_SLOTS - 1));
+  struct ns_connection *c = w->slots[level][slot], *next;
+
+  w->slots[level][slot] = NULL;
+  w->occupied[level] &= ~NS_TIMER_BIT(slot);
+  for (; c != NULL; c = next) {
+    next = c->timer_next;
+    ns_timer_link(w, c);
+  }
+}
+
+// Advance the wheel to the current time, send NS_TIMER to expired
+// connections. Ticks without due slots are skipped.
+static void ns_timer_expire(struct ns_server *server, time_t current_time) {
+  struct ns_timer_wheel *w = &server->timers;
+  uint64_t now = ns_millis() / NS_TIMER_TICK_MS, tick;
+  struct ns_connection *conn;
+  int level, slot;
+
+  while ((tick = ns_timer_next_tick(w)) != 0 && tick <= now) {
+    w->now = tick;
+    for (level = NS_TIMER_LEVELS - 1; level > 0; level--) {
+      if ((tick & (NS_TIMER_BIT(NS_TIMER_SHIFT(level)) - 1)) == 0) {
+        ns_timer_cascade(w, level);
+      }
+    }
+    slot = (int) (tick & (NS_TIMER_SLOTS - 1));
+    while ((conn = w->slots[0][slot]) != NULL) {
+      ns_timer_unlink(w, conn);
+      ns_mark_dirty(conn);
+      ns_call(conn, NS_TIMER, &current_time);
+    }
+  }
+  if (now > w->now) w->now = now;
+}
+
+// How long the I/O engine may wait: until the next timer is due, and
+// not longer than milli. Negative milli means no limit.
+static int ns_poll_timeout(struct ns_server *server, int milli) {
+  uint64_t tick = ns_timer_next_tick(&server->timers), now, wait;
+
+  if (server->poll_connections != NULL &&
+      (milli < 0 || milli > NS_POLL_INTERVAL_MS)) {
+    milli = NS_POLL_INTERVAL_MS;
+  }
+  if (tick != 0) {
+    now = ns_millis();
+    wait = tick * NS_TIMER_TICK_MS > now ? tick * NS_TIMER_TICK_MS - now : 0;
+    if (milli < 0 || wait < (uint64_t) milli) milli = (int) wait;
+  }
+
+  return milli;
+}
+
+static void ns_call_poll(struct ns_server *server, time_t current_time) {
+  struct ns_connection *conn, *tmp_conn;
+
+  for (conn = server->poll_connections; conn != NULL; conn = tmp_conn) {
+    tmp_conn = conn->poll_next;
+    ns_mark_dirty(conn);
+    ns_call(conn, NS_POLL, &current_time);
+  }
+}
+
+// Close connections that are done, and bring I/O engine registration of
+// the others in sync with their flags and send buffers.
+static void ns_process_dirty(struct ns_server *server) {
+  struct ns_connection *conn;
+
+  while ((conn = server->dirty_connections) != NULL) {
+    NS_LIST_REMOVE(server->dirty_connections, conn, dirty_prev, dirty_next);
+    if (conn->flags & NSF_CLOSE_IMMEDIATELY) {
+      ns_close_conn(conn);
+      continue;
+    }
+    if (NS_LIST_CONTAINS(server->poll_connections, conn, poll_prev)) {
+      if (!(conn->flags & NSF_WANT_POLL)) {
+        NS_LIST_REMOVE(server->poll_connections, conn, poll_prev, poll_next);
+      }
+    } else if (conn->flags & NSF_WANT_POLL) {
+      NS_LIST_INSERT(server->poll_connections, conn, poll_prev, poll_next);
+    }
+#ifdef NS_ENABLE_IO_URING
+    if (server->uring != NULL) ns_uring_arm(conn);
+#endif
+#ifdef NS_ENABLE_EPOLL
+    ns_epoll_update(conn);
+#endif
+    ns_trim_iobuf(&conn->recv_iobuf);
+    ns_trim_iobuf(&conn->send_iobuf);
+  }
+}
+
 void ns_set_close_on_exec(sock_t sock) {
 #ifdef _WIN32
   (void) SetHandleInformation((HANDLE) sock, HANDLE_FLAG_INHERIT, 0);
@@ -602,6 +1092,8 @@ int ns_set_ssl_cert(struct ns_server *server, const char *cert) {
   return server != NULL && cert == NULL ? 0 : -3;
 }
 
+static void ns_listening_sock_changed(struct ns_server *);
+
 int ns_bind(struct ns_server *server, const char *str) {
   union socket_address sa;
   ns_parse_port_string(str, &sa);
@@ -609,21 +1101,20 @@ int ns_bind(struct ns_server *server, const char *str) {
     closesocket(server->listening_sock);
   }
   server->listening_sock = ns_open_listening_socket(&sa);
+  ns_listening_sock_changed(server);
   return server->listening_sock == INVALID_SOCKET ? -1 :
   (int) ntohs(sa.sin.sin_port);
 }
 
 
-static struct ns_connection *accept_conn(struct ns_server *server) {
+static struct ns_connection *ns_add_accepted_sock(struct ns_server *server,
+                                                  sock_t sock,
+                                                  union socket_address *sa,
+                                                  time_t current_time) {
   struct ns_connection *c = NULL;
-  union socket_address sa;
-  socklen_t len = sizeof(sa);
-  sock_t sock = INVALID_SOCKET;
 
-  // NOTE(lsm): on Windows, sock is always > FD_SETSIZE
-  if ((sock = accept(server->listening_sock, &sa.sa, &len)) == INVALID_SOCKET) {
-  } else if ((c = (struct ns_connection *) NS_MALLOC(sizeof(*c))) == NULL ||
-             memset(c, 0, sizeof(*c)) == NULL) {
+  if ((c = (struct ns_connection *) NS_MALLOC(sizeof(*c))) == NULL ||
+      memset(c, 0, sizeof(*c)) == NULL) {
     closesocket(sock);
 #ifdef NS_ENABLE_SSL
   } else if (server->ssl_ctx != NULL &&
@@ -635,20 +1126,60 @@ static struct ns_connection *accept_conn(struct ns_server *server) {
     c = NULL;
 #endif
   } else {
-    ns_set_close_on_exec(sock);
-    ns_set_non_blocking_mode(sock);
     c->server = server;
     c->sock = sock;
+    c->sa = *sa;
     c->flags |= NSF_ACCEPTED;
+    c->last_io_time = current_time;
 
     ns_add_conn(server, c);
-    ns_call(c, NS_ACCEPT, &sa);
+    ns_call(c, NS_ACCEPT, sa);
     DBG(("%p %d %p %p", c, c->sock, c->ssl, server->ssl_ctx));
   }
 
   return c;
 }
 
+// Returns non-blocking, close-on-exec socket
+static sock_t ns_accept(sock_t listening_sock, union socket_address *sa) {
+  socklen_t len = sizeof(*sa);
+  sock_t sock;
+
+#if defined(__linux__) && defined(_GNU_SOURCE) && defined(SOCK_NONBLOCK)
+  sock = accept4(listening_sock, &sa->sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  if ((sock = accept(listening_sock, &sa->sa, &len)) != INVALID_SOCKET) {
+    ns_set_close_on_exec(sock);
+    ns_set_non_blocking_mode(sock);
+  }
+#endif
+
+  return sock;
+}
+
+// Drain the listen backlog, but accept at most accept_budget connections
+// so that a connection storm does not starve established connections.
+static int accept_conns(struct ns_server *server, time_t current_time) {
+  union socket_address sa;
+  sock_t sock;
+  int n = 0, budget = server->accept_budget;
+
+#ifdef __ECOS
+  // eCos does not respect non-blocking flag on a listening socket
+  // and hangs in a loop, so accept just one connection at a time.
+  budget = 1;
+#endif
+
+  // NOTE(lsm): on Windows, sock is always > FD_SETSIZE
+  while (n < budget &&
+         (sock = ns_accept(server->listening_sock, &sa)) != INVALID_SOCKET) {
+    n++;
+    ns_add_accepted_sock(server, sock, &sa, current_time);
+  }
+
+  return n;
+}
+
 static int ns_is_error(int n) {
   return n == 0 ||
     (n < 0 && errno != EINTR && errno != EINPROGRESS &&
@@ -659,34 +1190,41 @@ static int ns_is_error(int n) {
     );
 }
 
-void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags) {
-  union socket_address sa;
-  socklen_t slen = sizeof(sa);
-
+void ns_addr_to_str(const union socket_address *sa, char *buf, size_t len,
+                    int flags) {
   if (buf != NULL && len > 0) {
     buf[0] = '\0';
-    memset(&sa, 0, sizeof(sa));
-    if (flags & 4) {
-      getpeername(sock, &sa.sa, &slen);
-    } else {
-      getsockname(sock, &sa.sa, &slen);
-    }
     if (flags & 1) {
 #if defined(NS_ENABLE_IPV6)
-      inet_ntop(sa.sa.sa_family, sa.sa.sa_family == AF_INET ?
-                (void *) &sa.sin.sin_addr :
-                (void *) &sa.sin6.sin6_addr, buf, len);
+      inet_ntop(sa->sa.sa_family, sa->sa.sa_family == AF_INET ?
+                (void *) &sa->sin.sin_addr :
+                (void *) &sa->sin6.sin6_addr, buf, len);
 #elif defined(_WIN32)
       // Only Windoze Vista (and newer) have inet_ntop()
-      strncpy(buf, inet_ntoa(sa.sin.sin_addr), len);
+      strncpy(buf, inet_ntoa(sa->sin.sin_addr), len);
 #else
-      inet_ntop(sa.sa.sa_family, (void *) &sa.sin.sin_addr, buf, len);
+      inet_ntop(sa->sa.sa_family, (void *) &sa->sin.sin_addr, buf, len);
 #endif
     }
     if (flags & 2) {
       snprintf(buf + strlen(buf), len - (strlen(buf) + 1), ":%d",
-      (int) ntohs(sa.sin.sin_port));
+      (int) ntohs(sa->sin.sin_port));
+    }
+  }
+}
+
+void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags) {
+  union socket_address sa;
+  socklen_t slen = sizeof(sa);
+
+  if (buf != NULL && len > 0) {
+    memset(&sa, 0, sizeof(sa));
+    if (flags & 4) {
+      getpeername(sock, &sa.sa, &slen);
+    } else {
+      getsockname(sock, &sa.sa, &slen);
     }
+    ns_addr_to_str(&sa, buf, len, flags);
   }
 }
 
@@ -712,9 +1250,15 @@ int ns_hexdump(const void *buf, int len, char *dst, int dst_len) {
   return n;
 }
 
+// Receive straight into spare capacity of recv_iobuf, and keep reading
+// until the socket is drained or the per-poll budget is spent. The read
+// size grows while reads fill the buffer and shrinks when traffic is
+// light, so that bulk uploads need few wakeups and idle connections
+// stay small.
 static void ns_read_from_socket(struct ns_connection *conn) {
-  char buf[2048];
-  int n = 0;
+  struct iobuf *io = &conn->recv_iobuf;
+  size_t spare;
+  int n = 0, total = 0;
 
   if (conn->flags & NSF_CONNECTING) {
     int ok = 1, ret;
@@ -749,52 +1293,117 @@ static void ns_read_from_socket(struct ns_connection *conn) {
   }
 
 #ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
-    if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
-      n = SSL_read(conn->ssl, buf, sizeof(buf));
+  if (conn->ssl != NULL && !(conn->flags & NSF_SSL_HANDSHAKE_DONE)) {
+    int res = SSL_accept(conn->ssl);
+    int ssl_err = SSL_get_error(conn->ssl, res);
+    DBG(("%p %d rres %d %d", conn, conn->flags, res, ssl_err));
+    if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
+    if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
+    if (res == 1) {
+      conn->flags |= NSF_SSL_HANDSHAKE_DONE;
+    } else if (ssl_err == SSL_ERROR_WANT_READ ||
+               ssl_err == SSL_ERROR_WANT_WRITE) {
+      return; // Call us again
     } else {
-      int res = SSL_accept(conn->ssl);
-      int ssl_err = SSL_get_error(conn->ssl, res);
-      DBG(("%p %d rres %d %d", conn, conn->flags, res, ssl_err));
-      if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
-      if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
-      if (res == 1) {
-        conn->flags |= NSF_SSL_HANDSHAKE_DONE;
-      } else if (ssl_err == SSL_ERROR_WANT_READ ||
-                 ssl_err == SSL_ERROR_WANT_WRITE) {
-        return; // Call us again
-      } else {
-        conn->flags |= NSF_CLOSE_IMMEDIATELY;
-      }
-      return;
+      conn->flags |= NSF_CLOSE_IMMEDIATELY;
     }
-  } else
-#endif
-  {
-    n = recv(conn->sock, buf, sizeof(buf), 0);
+    return;
   }
+#endif
 
-  DBG(("%p %d <- %d bytes", conn, conn->flags, n));
-
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
-  } else if (n > 0) {
-    iobuf_append(&conn->recv_iobuf, buf, n);
-    ns_call(conn, NS_RECV, &n);
-  }
-}
+  if (conn->recv_size < NS_RECV_MIN_SIZE) conn->recv_size = NS_RECV_MIN_SIZE;
 
-static void ns_write_to_socket(struct ns_connection *conn) {
-  struct iobuf *io = &conn->send_iobuf;
-  int n = 0;
+  while (total < NS_RECV_BUDGET) {
+    if ((spare = iobuf_reserve(io, conn->recv_size)) == 0) {
+      conn->flags |= NSF_CLOSE_IMMEDIATELY;  // Out of memory
+      break;
+    }
 
 #ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
-    n = SSL_write(conn->ssl, io->buf, io->len);
-    if (n < 0) {
-      int ssl_err = SSL_get_error(conn->ssl, n);
-      DBG(("%p %d %d", conn, n, ssl_err));
-      if (ssl_err == 2 || ssl_err == 3) {
+    if (conn->ssl != NULL) {
+      n = SSL_read(conn->ssl, io->buf + io->len, (int) spare);
+    } else
+#endif
+    {
+      n = recv(conn->sock, io->buf + io->len, spare, 0);
+    }
+
+    DBG(("%p %d <- %d bytes", conn, conn->flags, n));
+
+    if (n <= 0) {
+      if (ns_is_error(n)) conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      break;
+    }
+
+    io->len += n;
+    total += n;
+
+    if ((size_t) n < spare) {
+      // Short read, socket is drained
+      if ((unsigned int) n < conn->recv_size / 4 &&
+          conn->recv_size > NS_RECV_MIN_SIZE) {
+        conn->recv_size /= 2;
+      }
+      break;
+    } else if (conn->recv_size < NS_RECV_MAX_SIZE) {
+      conn->recv_size *= 2;
+    }
+  }
+
+  if (total > 0) {
+    ns_call(conn, NS_RECV, &total);
+  }
+}
+
+// Writes as much of the send chain and send_iobuf as the socket accepts
+static int ns_send_chain(struct ns_connection *conn) {
+#ifdef NS_ENABLE_SENDFILE
+  if (conn->send_chain != NULL && conn->send_chain->data == NULL) {
+    off_t offset = (off_t) conn->send_chain->offset;
+    return (int) sendfile(conn->sock, conn->send_chain->fd, &offset,
+                          conn->send_chain->len > NS_SENDFILE_MAX ?
+                          NS_SENDFILE_MAX : conn->send_chain->len);
+  }
+#endif
+#ifdef _WIN32
+  if (conn->send_chain != NULL) {
+    return send(conn->sock, conn->send_chain->data,
+                (int) conn->send_chain->len, 0);
+  }
+  return send(conn->sock, conn->send_iobuf.buf, (int) conn->send_iobuf.len, 0);
+#else
+  struct iovec iov[NS_MAX_IOV];
+  struct ns_send_seg *seg;
+  int n = 0;
+
+  // Stop at a file segment, it is sent by the next call
+  for (seg = conn->send_chain; seg != NULL && seg->data != NULL &&
+       n < NS_MAX_IOV; seg = seg->next) {
+    iov[n].iov_base = (void *) seg->data;
+    iov[n++].iov_len = seg->len;
+  }
+  if (seg == NULL && conn->send_iobuf.len > 0 && n < NS_MAX_IOV) {
+    iov[n].iov_base = conn->send_iobuf.buf;
+    iov[n++].iov_len = conn->send_iobuf.len;
+  }
+
+  return writev(conn->sock, iov, n);
+#endif
+}
+
+static void ns_write_to_socket(struct ns_connection *conn) {
+  int n = 0;
+
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL) {
+    // SSL_write() takes one buffer, the chain is written piece by piece
+    n = conn->send_chain != NULL ?
+      SSL_write(conn->ssl, conn->send_chain->data, conn->send_chain->len) :
+      SSL_write(conn->ssl, conn->send_iobuf.buf, conn->send_iobuf.len);
+    if (n < 0) {
+      int ssl_err = SSL_get_error(conn->ssl, n);
+      DBG(("%p %d %d", conn, n, ssl_err));
+      if (ssl_err == 2 || ssl_err == 3) {
         return; // Call us again
       } else {
         conn->flags |= NSF_CLOSE_IMMEDIATELY;
@@ -802,122 +1411,908 @@ static void ns_write_to_socket(struct ns_connection *conn) {
     }
   } else
 #endif
-  { n = send(conn->sock, io->buf, io->len, 0); }
+  { n = ns_send_chain(conn); }
+
+  DBG(("%p %d -> %d bytes", conn, conn->flags, n));
+
+  ns_call(conn, NS_SEND, &n);
+  if (ns_is_error(n)) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    ns_consume_sent(conn, n);
+  }
+
+  if (ns_send_pending(conn) == 0 && conn->flags & NSF_FINISHED_SENDING_DATA) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+int ns_send(struct ns_connection *conn, const void *buf, int len) {
+  ns_mark_dirty(conn);
+  return iobuf_append(&conn->send_iobuf, buf, len);
+}
+
+static void ns_free_mem(void *p) {
+  NS_FREE(p);
+}
+
+static struct ns_send_seg *ns_append_seg(struct ns_connection *conn,
+                                         const char *data, size_t len,
+                                         void (*release)(void *),
+                                         void *param) {
+  struct ns_send_seg *seg = (struct ns_send_seg *) NS_MALLOC(sizeof(*seg));
+
+  if (seg == NULL) return NULL;
+  seg->next = NULL;
+  seg->data = data;
+  seg->len = len;
+  seg->fd = -1;
+  seg->offset = 0;
+  seg->release = release;
+  seg->param = param;
+  if (conn->send_chain_last != NULL) {
+    conn->send_chain_last->next = seg;
+  } else {
+    conn->send_chain = seg;
+  }
+  conn->send_chain_last = seg;
+  conn->send_chain_len += len;
+
+  return seg;
+}
+
+// Data that is already in send_iobuf becomes a segment of its own, so
+// that it is sent before segments queued after it. Returns 0 on failure.
+static int ns_seal_send_iobuf(struct ns_connection *conn) {
+  struct iobuf *io = &conn->send_iobuf;
+
+  if (io->len > 0 &&
+      ns_append_seg(conn, io->buf, io->len, ns_free_mem, io->buf - io->head)) {
+    iobuf_init(io, 0);
+  }
+
+  return io->len == 0;
+}
+
+// Queues len bytes at buf without copying them. The memory must stay
+// valid and unchanged until release(param) is called, which happens once
+// the data is sent or the connection is closed.
+int ns_send_ref(struct ns_connection *conn, const void *buf, size_t len,
+                void (*release)(void *), void *param) {
+  ns_mark_dirty(conn);
+  if (len > 0 && ns_seal_send_iobuf(conn) &&
+      ns_append_seg(conn, (const char *) buf, len, release, param)) {
+    return (int) len;
+  }
+
+  // Nothing to queue, or out of memory: copy the data instead
+  iobuf_append(&conn->send_iobuf, buf, len);
+  if (release != NULL) release(param);
+
+  return (int) len;
+}
+
+// Queues len bytes of file fd, starting at offset, to be copied to the
+// socket by the kernel. The file must not shrink until release(param) is
+// called. Returns 0, leaving fd to the caller, if the connection cannot
+// send files this way, e.g. because it uses SSL.
+int ns_send_file(struct ns_connection *conn, int fd, int64_t offset,
+                 size_t len, void (*release)(void *), void *param) {
+#ifdef NS_ENABLE_SENDFILE
+  struct ns_send_seg *seg;
+
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL) return 0;
+#endif
+  if (len == 0) {
+    if (release != NULL) release(param);
+    return 1;
+  }
+  if (!ns_seal_send_iobuf(conn) ||
+      (seg = ns_append_seg(conn, NULL, len, release, param)) == NULL) {
+    return 0;
+  }
+  seg->fd = fd;
+  seg->offset = offset;
+  ns_mark_dirty(conn);
+
+  return 1;
+#else
+  (void) conn; (void) fd; (void) offset; (void) len; (void) release;
+  (void) param;
+  return 0;
+#endif
+}
+
+// Returns the number of bytes queued but not yet written to the socket
+size_t ns_send_pending(const struct ns_connection *conn) {
+#ifdef NS_ENABLE_IO_URING
+  return conn->send_chain_len + conn->send_iobuf.len +
+    conn->uring_send_iobuf.len;
+#else
+  return conn->send_chain_len + conn->send_iobuf.len;
+#endif
+}
+
+static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
+  if (sock != INVALID_SOCKET) {
+    FD_SET(sock, set);
+    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
+      *max_fd = sock;
+    }
+  }
+}
+
+static void ns_read_ctl_msg(struct ns_server *server) {
+  struct ctl_msg ctl_msg;
+  int len = recv(server->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
+  send(server->ctl[1], ctl_msg.message, 1, 0);
+  if (len >= (int) sizeof(ctl_msg.callback) && ctl_msg.callback != NULL) {
+    ns_iterate(server, ctl_msg.callback, ctl_msg.message);
+  }
+}
+
+static void ns_handle_io(struct ns_connection *conn, int readable,
+                         int writable, time_t current_time) {
+  if (readable) {
+    conn->last_io_time = current_time;
+    ns_read_from_socket(conn);
+  }
+  if (writable) {
+    if (conn->flags & NSF_CONNECTING) {
+      ns_read_from_socket(conn);
+    } else if (!(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
+      conn->last_io_time = current_time;
+      ns_write_to_socket(conn);
+    }
+  }
+}
+
+#ifdef NS_ENABLE_EPOLL
+#ifndef NS_EPOLL_MAX_EVENTS
+#define NS_EPOLL_MAX_EVENTS 256
+#endif
+
+// Listening socket may be shared by several servers polled by different
+// threads. Wake up only one of them when a connection arrives.
+#ifdef EPOLLEXCLUSIVE
+#define NS_EPOLL_EXCLUSIVE EPOLLEXCLUSIVE
+#else
+#define NS_EPOLL_EXCLUSIVE 0
+#endif
+
+// Sockets stay registered with epoll for their whole lifetime, and the
+// interest set is only modified when it changes. Only connections that
+// are ready, dirty or have an expired timer are touched.
+static int ns_epoll_poll(struct ns_server *server, int milli) {
+  struct epoll_event events[NS_EPOLL_MAX_EVENTS];
+  struct ns_connection *conn;
+  int i, n;
+  time_t current_time = time(NULL);
+
+  // Listening socket can be replaced by ns_bind() or mg_set_listening_socket()
+  if (server->epoll_listening_sock != server->listening_sock) {
+    if (server->listening_sock != INVALID_SOCKET) {
+      ns_epoll_ctl(server, EPOLL_CTL_ADD, server->listening_sock,
+                   EPOLLIN | NS_EPOLL_EXCLUSIVE, server);
+    }
+    server->epoll_listening_sock = server->listening_sock;
+  }
+
+  ns_call_poll(server, current_time);
+  ns_process_dirty(server);
+
+  n = epoll_wait(server->epoll_fd, events, ARRAY_SIZE(events),
+                 ns_poll_timeout(server, milli));
+  current_time = time(NULL);
+
+  // Connections are not freed while the event list is being processed,
+  // because a connection might be referenced by a later event.
+  for (i = 0; i < n; i++) {
+    void *ptr = events[i].data.ptr;
+    unsigned int ev = events[i].events;
+
+    if (ptr == server) {
+      accept_conns(server, current_time);
+    } else if (ptr == server->ctl) {
+      ns_read_ctl_msg(server);
+    } else {
+      conn = (struct ns_connection *) ptr;
+      // Errors and hangups are reported to whoever waits on the socket
+      if (ev & (EPOLLERR | EPOLLHUP)) ev |= conn->epoll_events;
+      ns_mark_dirty(conn);
+      ns_handle_io(conn, ev & EPOLLIN, ev & EPOLLOUT, current_time);
+    }
+  }
+
+  ns_timer_expire(server, current_time);
+  ns_process_dirty(server);
+
+  return server->num_active_connections;
+}
+#endif
+
+static int ns_select_poll(struct ns_server *server, int milli) {
+  struct ns_connection *conn, *tmp_conn;
+  struct timeval tv;
+  fd_set read_set, write_set;
+  sock_t max_fd = INVALID_SOCKET;
+  time_t current_time = time(NULL);
+
+  ns_call_poll(server, current_time);
+  ns_process_dirty(server);
+
+  FD_ZERO(&read_set);
+  FD_ZERO(&write_set);
+  ns_add_to_set(server->listening_sock, &read_set, &max_fd);
+  ns_add_to_set(server->ctl[1], &read_set, &max_fd);
+
+  for (conn = server->active_connections; conn != NULL; conn = conn->next) {
+    if (ns_wants_read(conn)) {
+      //DBG(("%p read_set", conn));
+      ns_add_to_set(conn->sock, &read_set, &max_fd);
+    }
+    if (ns_wants_write(conn)) {
+      //DBG(("%p write_set", conn));
+      ns_add_to_set(conn->sock, &write_set, &max_fd);
+    }
+  }
+
+  milli = ns_poll_timeout(server, milli);
+  tv.tv_sec = milli / 1000;
+  tv.tv_usec = (milli % 1000) * 1000;
+
+  if (select((int) max_fd + 1, &read_set, &write_set, NULL,
+             milli < 0 ? NULL : &tv) > 0) {
+    current_time = time(NULL);
+
+    // Accept new connections
+    if (server->listening_sock != INVALID_SOCKET &&
+        FD_ISSET(server->listening_sock, &read_set)) {
+      accept_conns(server, current_time);
+    }
+
+    // Read wakeup messages
+    if (server->ctl[1] != INVALID_SOCKET &&
+        FD_ISSET(server->ctl[1], &read_set)) {
+      ns_read_ctl_msg(server);
+    }
+
+    for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
+      int readable = FD_ISSET(conn->sock, &read_set),
+          writable = FD_ISSET(conn->sock, &write_set);
+      tmp_conn = conn->next;
+      if (readable || writable) {
+        ns_mark_dirty(conn);
+        ns_handle_io(conn, readable, writable, current_time);
+      }
+    }
+  } else {
+    current_time = time(NULL);
+  }
+
+  ns_timer_expire(server, current_time);
+  ns_process_dirty(server);
+  //DBG(("%d active connections", server->num_active_connections));
+
+  return server->num_active_connections;
+}
+
+#ifdef NS_ENABLE_IO_URING
+#ifndef NS_URING_ENTRIES
+#define NS_URING_ENTRIES 256
+#endif
+#ifndef NS_URING_BUF_SIZE
+#define NS_URING_BUF_SIZE 16384
+#endif
+#ifndef NS_URING_LINGER_SECONDS
+#define NS_URING_LINGER_SECONDS 10
+#endif
+#ifndef NS_URING_MAX_ACCEPTS
+#define NS_URING_MAX_ACCEPTS 32   // Upper limit for accept_budget, max 32
+#endif
+
+// Operation is encoded in the lower 3 bits of SQE user_data, the rest is
+// a connection pointer or, for accept, accept slot (5 bits) and listening
+// socket generation.
+enum ns_uring_op {
+  NS_URING_CANCEL, NS_URING_RECV, NS_URING_SEND, NS_URING_POLL,
+  NS_URING_FILE, NS_URING_ACCEPT, NS_URING_CTL
+};
+#define NS_URING_OP_BIT(op) (1U << (op))
+#define NS_URING_ACCEPT_SLOT(user_data) ((int) (((user_data) >> 3) & 31))
+#define NS_URING_CANCELLED NS_URING_OP_BIT(NS_URING_CANCEL)
+
+struct ns_uring_accept {
+  union socket_address sa;    // Peer address of the accepted connection
+  socklen_t len;
+  int pending;                // Accept is in flight
+};
+
+struct ns_uring {
+  int fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_pending_tail;     // Tail including SQEs not yet published
+
+  sock_t listening_sock;        // Socket the current accepts were armed on
+  uint64_t accept_gen;          // Bumped when the listening socket changes
+  int ctl_pending;
+  struct ns_uring_accept accepts[NS_URING_MAX_ACCEPTS];  // accept_budget used
+
+  struct ns_connection *lingering;  // Closed conns with ops in flight
+};
+
+static int ns_uring_enter(struct ns_uring *u, unsigned min_complete,
+                          unsigned flags, void *arg, size_t arg_size) {
+  unsigned to_submit;
+
+  __atomic_store_n(u->sq_tail, u->sq_pending_tail, __ATOMIC_RELEASE);
+  to_submit = u->sq_pending_tail - __atomic_load_n(u->sq_head,
+                                                   __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && min_complete == 0) return 0;
+  return (int) syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+                       flags, arg, arg_size);
+}
+
+static struct io_uring_sqe *ns_uring_get_sqe(struct ns_uring *u) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  // Submission queue is full: hand queued entries to the kernel first
+  if (u->sq_pending_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+      *u->sq_entries) {
+    ns_uring_enter(u, 0, 0, NULL, 0);
+    if (u->sq_pending_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+        *u->sq_entries) {
+      return NULL;
+    }
+  }
+
+  idx = u->sq_pending_tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  u->sq_pending_tail++;
+
+  return sqe;
+}
+
+static struct io_uring_sqe *ns_uring_prep(struct ns_uring *u, int opcode,
+                                          int fd, const void *addr,
+                                          unsigned len, uint64_t user_data) {
+  struct io_uring_sqe *sqe = ns_uring_get_sqe(u);
+  if (sqe != NULL) {
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+  }
+  return sqe;
+}
+
+static uint64_t ns_uring_conn_data(struct ns_connection *conn,
+                                   enum ns_uring_op op) {
+  return (uint64_t) (uintptr_t) conn | op;
+}
+
+static struct io_uring_sqe *ns_uring_submit_conn(struct ns_connection *conn,
+                                                 enum ns_uring_op op,
+                                                 int opcode, int fd,
+                                                 const void *addr,
+                                                 unsigned len) {
+  struct io_uring_sqe *sqe = ns_uring_prep(conn->server->uring, opcode, fd,
+                                           addr, len,
+                                           ns_uring_conn_data(conn, op));
+  if (sqe != NULL) conn->uring_ops |= NS_URING_OP_BIT(op);
+  return sqe;
+}
+
+static void ns_uring_cancel(struct ns_uring *u, uint64_t user_data) {
+  struct io_uring_sqe *sqe = ns_uring_prep(u, IORING_OP_ASYNC_CANCEL, -1,
+                                           NULL, 0, NS_URING_CANCEL);
+  if (sqe != NULL) sqe->addr = user_data;
+}
+
+static void ns_uring_cancel_conn(struct ns_connection *conn, unsigned ops) {
+  int op;
+  for (op = NS_URING_RECV; op <= NS_URING_FILE; op++) {
+    if (conn->uring_ops & ops & NS_URING_OP_BIT(op)) {
+      ns_uring_cancel(conn->server->uring,
+                      ns_uring_conn_data(conn, (enum ns_uring_op) op));
+    }
+  }
+}
+
+// Connection has been closed, but the kernel still uses its buffers.
+// Pending send is allowed to finish, everything else is cancelled.
+static void ns_uring_linger(struct ns_connection *conn) {
+  struct ns_uring *u = conn->server->uring;
+
+  ns_uring_cancel_conn(conn, ~NS_URING_OP_BIT(NS_URING_SEND));
+  conn->uring_linger = time(NULL) + NS_URING_LINGER_SECONDS;
+  conn->prev = NULL;
+  conn->next = u->lingering;
+  if (u->lingering != NULL) u->lingering->prev = conn;
+  u->lingering = conn;
+}
+
+static void ns_uring_release(struct ns_connection *conn) {
+  struct ns_uring *u = conn->server->uring;
+
+  if (conn->uring_ops != 0 && conn->uring_ops != NS_URING_CANCELLED) return;
+  if (conn->prev == NULL) u->lingering = conn->next;
+  if (conn->prev) conn->prev->next = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  ns_free_conn(conn);
+}
+
+static void ns_uring_expire_lingering(struct ns_uring *u, time_t now) {
+  struct ns_connection *conn;
+  for (conn = u->lingering; conn != NULL; conn = conn->next) {
+    if (conn->uring_linger < now && !(conn->uring_ops & NS_URING_CANCELLED)) {
+      ns_uring_cancel_conn(conn, ~0U);
+      conn->uring_ops |= NS_URING_CANCELLED;
+    }
+  }
+}
+
+// True if the in-flight send waits for the socket to accept a file
+static int ns_uring_sends_file(const struct ns_connection *conn) {
+  return conn->uring_send_iobuf.len == 0 && conn->send_chain != NULL &&
+    conn->send_chain->data == NULL;
+}
+
+// Sends the oldest queued data: the detached send buffer, then the chain.
+// io_uring has no sendfile(), files are sent once the socket is writable.
+static void ns_uring_send_next(struct ns_connection *conn) {
+  struct io_uring_sqe *sqe = NULL;
+
+  if (ns_uring_sends_file(conn)) {
+    if ((sqe = ns_uring_submit_conn(conn, NS_URING_SEND, IORING_OP_POLL_ADD,
+                                    conn->sock, NULL, 0)) != NULL) {
+      sqe->poll_events = POLLOUT;
+    }
+    return;
+  } else if (conn->uring_send_iobuf.len > 0) {
+    sqe = ns_uring_submit_conn(conn, NS_URING_SEND, IORING_OP_SEND, conn->sock,
+                               conn->uring_send_iobuf.buf,
+                               (unsigned) conn->uring_send_iobuf.len);
+  } else if (conn->send_chain != NULL) {
+    sqe = ns_uring_submit_conn(conn, NS_URING_SEND, IORING_OP_SEND, conn->sock,
+                               conn->send_chain->data,
+                               (unsigned) conn->send_chain->len);
+  }
+  if (sqe != NULL) sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+// Drops sent bytes from whatever ns_uring_send_next() has sent
+static void ns_uring_consume_sent(struct ns_connection *conn, int n) {
+  if (conn->uring_send_iobuf.len > 0) {
+    iobuf_remove(&conn->uring_send_iobuf, n);
+  } else {
+    ns_consume_sent(conn, n);
+  }
+}
+
+// Queue operations the connection is ready for, at most one of each kind.
+static void ns_uring_arm(struct ns_connection *conn) {
+  unsigned int ops = conn->uring_ops;
+  struct io_uring_sqe *sqe;
+
+  if (conn->flags & NSF_CLOSE_IMMEDIATELY) return;
+
+  if (conn->flags & NSF_CONNECTING) {
+    // Connect completion is handled by ns_read_from_socket()
+    if (!(ops & NS_URING_OP_BIT(NS_URING_POLL)) &&
+        (sqe = ns_uring_submit_conn(conn, NS_URING_POLL, IORING_OP_POLL_ADD,
+                                    conn->sock, NULL, 0)) != NULL) {
+      sqe->poll_events = POLLOUT;
+    }
+    return;
+  }
+
+  if (!(ops & NS_URING_OP_BIT(NS_URING_RECV)) && ns_wants_read(conn) &&
+      (conn->uring_recv_buf != NULL ||
+       (conn->uring_recv_buf = (char *) NS_MALLOC(NS_URING_BUF_SIZE)) != NULL)) {
+    ns_uring_submit_conn(conn, NS_URING_RECV, IORING_OP_RECV, conn->sock,
+                         conn->uring_recv_buf, NS_URING_BUF_SIZE);
+  }
+
+  if (!(ops & NS_URING_OP_BIT(NS_URING_SEND)) &&
+      !(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
+    // Data of an in-flight send must not move, so the send buffer is
+    // handed over to the engine. New data is appended to a fresh one.
+    // Send chain segments never move and are sent in place.
+    if (conn->uring_send_iobuf.len == 0 && conn->send_chain == NULL &&
+        conn->send_iobuf.len > 0) {
+      iobuf_free(&conn->uring_send_iobuf);
+      conn->uring_send_iobuf = conn->send_iobuf;
+      iobuf_init(&conn->send_iobuf, 0);
+    }
+    ns_uring_send_next(conn);
+  }
+}
+
+static uint64_t ns_uring_accept_data(struct ns_uring *u, int slot) {
+  return (u->accept_gen << 8) | (slot << 3) | NS_URING_ACCEPT;
+}
+
+// Slot stays pending until the cancelled accept completes, because the
+// kernel may still write the peer address into it.
+static void ns_uring_cancel_accepts(struct ns_uring *u) {
+  int i;
+  for (i = 0; i < NS_URING_MAX_ACCEPTS; i++) {
+    if (u->accepts[i].pending) ns_uring_cancel(u, ns_uring_accept_data(u, i));
+  }
+  u->accept_gen++;
+}
+
+static int ns_uring_accepts_pending(const struct ns_uring *u) {
+  int i;
+  for (i = 0; i < NS_URING_MAX_ACCEPTS; i++) {
+    if (u->accepts[i].pending) return 1;
+  }
+  return 0;
+}
+
+static void ns_uring_arm_listener(struct ns_server *server) {
+  struct ns_uring *u = server->uring;
+  struct io_uring_sqe *sqe;
+  int i;
+
+  if (u->listening_sock != server->listening_sock) {
+    ns_uring_cancel_accepts(u);
+    u->listening_sock = server->listening_sock;
+  }
+  for (i = 0; i < server->accept_budget && i < NS_URING_MAX_ACCEPTS &&
+       u->listening_sock != INVALID_SOCKET; i++) {
+    struct ns_uring_accept *a = &u->accepts[i];
+    if (a->pending) continue;
+    a->len = sizeof(a->sa);
+    if ((sqe = ns_uring_prep(u, IORING_OP_ACCEPT, u->listening_sock, &a->sa,
+                             0, ns_uring_accept_data(u, i))) != NULL) {
+      sqe->addr2 = (uint64_t) (uintptr_t) &a->len;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      a->pending = 1;
+    }
+  }
+  if (!u->ctl_pending && server->ctl[1] != INVALID_SOCKET &&
+      (sqe = ns_uring_prep(u, IORING_OP_POLL_ADD, server->ctl[1], NULL, 0,
+                           NS_URING_CTL)) != NULL) {
+    sqe->poll_events = POLLIN;
+    u->ctl_pending = 1;
+  }
+}
+
+static int ns_uring_is_error(int res) {
+  return res == 0 || (res < 0 && res != -EAGAIN && res != -EINTR);
+}
+
+static void ns_uring_complete_accept(struct ns_server *server,
+                                     uint64_t user_data, int res, time_t now) {
+  struct ns_uring *u = server->uring;
+  struct ns_uring_accept *a = &u->accepts[NS_URING_ACCEPT_SLOT(user_data)];
+
+  a->pending = 0;
+  if (user_data >> 8 != u->accept_gen) {
+    if (res >= 0) closesocket(res);  // Accepted on a replaced socket
+  } else if (res >= 0) {
+    ns_add_accepted_sock(server, res, &a->sa, now);
+  }
+  ns_uring_arm_listener(server);
+}
+
+static void ns_uring_complete(struct ns_server *server, uint64_t user_data,
+                              int res, time_t now) {
+  enum ns_uring_op op = (enum ns_uring_op) (user_data & 7);
+  struct ns_connection *conn = (struct ns_connection *)
+    (uintptr_t) (user_data & ~(uint64_t) 7);
+
+  switch (op) {
+    case NS_URING_CANCEL:
+      return;
+    case NS_URING_ACCEPT:
+      ns_uring_complete_accept(server, user_data, res, now);
+      return;
+    case NS_URING_CTL:
+      server->uring->ctl_pending = 0;
+      if (res > 0) ns_read_ctl_msg(server);
+      ns_uring_arm_listener(server);
+      return;
+    default:
+      break;
+  }
+
+  conn->uring_ops &= ~NS_URING_OP_BIT(op);
+
+  if (conn->uring_linger != 0) {
+    // Let a lingering send finish writing the response
+    if (op == NS_URING_SEND && res > 0 && !ns_uring_sends_file(conn) &&
+        !(conn->uring_ops & NS_URING_CANCELLED)) {
+      ns_uring_consume_sent(conn, res);
+      if (conn->uring_send_iobuf.len > 0 || conn->send_chain != NULL) {
+        ns_uring_send_next(conn);
+        return;
+      }
+    }
+    ns_uring_release(conn);
+    return;
+  }
+
+  switch (op) {
+    case NS_URING_RECV:
+      DBG(("%p %d <- %d bytes", conn, conn->flags, res));
+      if (ns_uring_is_error(res)) {
+        conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      } else if (res > 0) {
+        conn->last_io_time = now;
+        iobuf_append(&conn->recv_iobuf, conn->uring_recv_buf, res);
+        ns_call(conn, NS_RECV, &res);
+      }
+      break;
+    case NS_URING_SEND:
+      if (ns_uring_sends_file(conn)) {
+        if (res > 0) {
+          conn->last_io_time = now;
+          ns_write_to_socket(conn);
+        } else {
+          conn->flags |= NSF_CLOSE_IMMEDIATELY;
+        }
+        break;
+      }
+      DBG(("%p %d -> %d bytes", conn, conn->flags, res));
+      if (res > 0) conn->last_io_time = now;
+      ns_call(conn, NS_SEND, &res);
+      if (ns_uring_is_error(res)) {
+        conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      } else if (res > 0) {
+        ns_uring_consume_sent(conn, res);
+      }
+      if (ns_send_pending(conn) == 0 &&
+          conn->flags & NSF_FINISHED_SENDING_DATA) {
+        conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      }
+      break;
+    case NS_URING_POLL:
+      if (res > 0) ns_read_from_socket(conn);
+      break;
+    case NS_URING_FILE:
+      if (res > 0) iobuf_append(&conn->send_iobuf, conn->uring_file_buf, res);
+      ns_call(conn, NS_FILE_READ, &res);
+      break;
+    default:
+      break;
+  }
+
+  ns_mark_dirty(conn);
+}
+
+static int ns_uring_poll(struct ns_server *server, int milli) {
+  struct ns_uring *u = server->uring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  time_t current_time = time(NULL);
+  unsigned head;
 
-  DBG(("%p %d -> %d bytes", conn, conn->flags, n));
+  ns_uring_arm_listener(server);
+  ns_uring_expire_lingering(u, current_time);
 
-  ns_call(conn, NS_SEND, &n);
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
-  } else if (n > 0) {
-    iobuf_remove(io, n);
+  ns_call_poll(server, current_time);
+  ns_process_dirty(server);
+
+  // Submit everything queued during this loop turn with a single syscall,
+  // and wait for completions
+  memset(&arg, 0, sizeof(arg));
+  if ((milli = ns_poll_timeout(server, milli)) >= 0) {
+    ts.tv_sec = milli / 1000;
+    ts.tv_nsec = (milli % 1000) * 1000000;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
   }
+  ns_uring_enter(u, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                 &arg, sizeof(arg));
+  current_time = time(NULL);
 
-  if (io->len == 0 && conn->flags & NSF_FINISHED_SENDING_DATA) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  head = *u->cq_head;
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+
+    __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+    ns_uring_complete(server, user_data, res, current_time);
   }
-}
 
-int ns_send(struct ns_connection *conn, const void *buf, int len) {
-  return iobuf_append(&conn->send_iobuf, buf, len);
+  ns_timer_expire(server, current_time);
+  ns_process_dirty(server);
+
+  return server->num_active_connections;
 }
 
-static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
-  if (sock != INVALID_SOCKET) {
-    FD_SET(sock, set);
-    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
-      *max_fd = sock;
-    }
+static void ns_uring_free(struct ns_uring *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+    munmap(u->sq_ring, u->sq_ring_size);
   }
+  if (u->fd >= 0) close(u->fd);
+  NS_FREE(u);
 }
 
-int ns_server_poll(struct ns_server *server, int milli) {
-  struct ns_connection *conn, *tmp_conn;
-  struct timeval tv;
-  fd_set read_set, write_set;
-  int num_active_connections = 0;
-  sock_t max_fd = INVALID_SOCKET;
-  time_t current_time = time(NULL);
-
-  if (server->listening_sock == INVALID_SOCKET &&
-      server->active_connections == NULL) return 0;
+// Returns NULL if the kernel does not support io_uring, or lacks
+// features the engine relies on.
+static struct ns_uring *ns_uring_create(void) {
+  struct io_uring_params p;
+  struct ns_uring *u;
+  char *sq, *cq;
 
-  FD_ZERO(&read_set);
-  FD_ZERO(&write_set);
-  ns_add_to_set(server->listening_sock, &read_set, &max_fd);
-  ns_add_to_set(server->ctl[1], &read_set, &max_fd);
+  if ((u = (struct ns_uring *) NS_MALLOC(sizeof(*u))) == NULL) return NULL;
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  u->listening_sock = INVALID_SOCKET;
 
-  for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
-    tmp_conn = conn->next;
-    ns_call(conn, NS_POLL, &current_time);
-    if (!(conn->flags & NSF_WANT_WRITE)) {
-      //DBG(("%p read_set", conn));
-      ns_add_to_set(conn->sock, &read_set, &max_fd);
-    }
-    if (((conn->flags & NSF_CONNECTING) && !(conn->flags & NSF_WANT_READ)) ||
-        (conn->send_iobuf.len > 0 && !(conn->flags & NSF_CONNECTING) &&
-         !(conn->flags & NSF_BUFFER_BUT_DONT_SEND))) {
-      //DBG(("%p write_set", conn));
-      ns_add_to_set(conn->sock, &write_set, &max_fd);
-    }
-    if (conn->flags & NSF_CLOSE_IMMEDIATELY) {
-      ns_close_conn(conn);
-    }
+  if ((u->fd = (int) syscall(__NR_io_uring_setup, NS_URING_ENTRIES, &p)) < 0 ||
+      !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_RW_CUR_POS)) {
+    DBG(("io_uring is not supported: %d", errno));
+    ns_uring_free(u);
+    return NULL;
+  }
+  ns_set_close_on_exec(u->fd);
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_size,
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd,
+                                         IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+      u->sqes == MAP_FAILED) {
+    ns_uring_free(u);
+    return NULL;
   }
 
-  tv.tv_sec = milli / 1000;
-  tv.tv_usec = (milli % 1000) * 1000;
+  sq = (char *) u->sq_ring;
+  cq = (char *) u->cq_ring;
+  u->sq_head = (unsigned *) (sq + p.sq_off.head);
+  u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  u->sq_entries = (unsigned *) (sq + p.sq_off.ring_entries);
+  u->sq_array = (unsigned *) (sq + p.sq_off.array);
+  u->cq_head = (unsigned *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  u->sq_pending_tail = *u->sq_tail;
 
-  if (select((int) max_fd + 1, &read_set, &write_set, NULL, &tv) > 0) {
-    // Accept new connections
-    if (server->listening_sock != INVALID_SOCKET &&
-        FD_ISSET(server->listening_sock, &read_set)) {
-      // We're not looping here, and accepting just one connection at
-      // a time. The reason is that eCos does not respect non-blocking
-      // flag on a listening socket and hangs in a loop.
-      if ((conn = accept_conn(server)) != NULL) {
-        conn->last_io_time = current_time;
-      }
-    }
+  return u;
+}
 
-    // Read wakeup messages
-    if (server->ctl[1] != INVALID_SOCKET &&
-        FD_ISSET(server->ctl[1], &read_set)) {
-      struct ctl_msg ctl_msg;
-      int len = recv(server->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
-      send(server->ctl[1], ctl_msg.message, 1, 0);
-      if (len >= (int) sizeof(ctl_msg.callback) && ctl_msg.callback != NULL) {
-        ns_iterate(server, ctl_msg.callback, ctl_msg.message);
-      }
-    }
+// Cancel everything in flight and wait until the kernel is done with
+// buffers of closed connections.
+static void ns_uring_destroy(struct ns_server *server) {
+  struct ns_uring *u = server->uring;
+  struct ns_connection *conn;
+  int i;
 
-    for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
-      tmp_conn = conn->next;
-      if (FD_ISSET(conn->sock, &read_set)) {
-        conn->last_io_time = current_time;
-        ns_read_from_socket(conn);
-      }
-      if (FD_ISSET(conn->sock, &write_set)) {
-        if (conn->flags & NSF_CONNECTING) {
-          ns_read_from_socket(conn);
-        } else if (!(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
-          conn->last_io_time = current_time;
-          ns_write_to_socket(conn);
-        }
+  for (conn = u->lingering; conn != NULL; conn = conn->next) {
+    ns_uring_cancel_conn(conn, ~0U);
+    conn->uring_ops |= NS_URING_CANCELLED;
+  }
+  ns_uring_cancel_accepts(u);
+  if (u->ctl_pending) ns_uring_cancel(u, NS_URING_CTL);
+  u->listening_sock = server->listening_sock = INVALID_SOCKET;
+
+  for (i = 0; i < 100 && (u->lingering != NULL || u->ctl_pending ||
+                          ns_uring_accepts_pending(u)); i++) {
+    unsigned head;
+    ns_uring_enter(u, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    head = *u->cq_head;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+      uint64_t user_data = cqe->user_data;
+      int res = cqe->res;
+
+      __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+      if ((user_data & 7) == NS_URING_ACCEPT) {
+        u->accepts[NS_URING_ACCEPT_SLOT(user_data)].pending = 0;
+        if (res >= 0) closesocket(res);
+      } else if ((user_data & 7) == NS_URING_CTL) {
+        u->ctl_pending = 0;
+      } else {
+        ns_uring_complete(server, user_data, res, 0);
       }
     }
   }
 
-  for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
-    tmp_conn = conn->next;
-    num_active_connections++;
-    if (conn->flags & NSF_CLOSE_IMMEDIATELY) {
-      ns_close_conn(conn);
+  ns_uring_free(u);
+  server->uring = NULL;
+}
+#endif
+
+// Listening socket has been replaced. New socket may reuse the descriptor
+// number of the closed one, so I/O engines must register it again.
+static void ns_listening_sock_changed(struct ns_server *server) {
+#ifdef NS_ENABLE_EPOLL
+  server->epoll_listening_sock = INVALID_SOCKET;
+#endif
+#ifdef NS_ENABLE_IO_URING
+  if (server->uring != NULL) server->uring->listening_sock = INVALID_SOCKET;
+#endif
+  (void) server;
+}
+
+int ns_server_enable_io_uring(struct ns_server *server) {
+#ifdef NS_ENABLE_IO_URING
+  if (server->uring == NULL && server->active_connections == NULL &&
+      (server->uring = ns_uring_create()) != NULL) {
+#ifdef NS_ENABLE_EPOLL
+    if (server->epoll_fd >= 0) close(server->epoll_fd);
+    server->epoll_fd = -1;
+#endif
+  }
+  return server->uring != NULL;
+#else
+  (void) server;
+  return 0;
+#endif
+}
+
+int ns_queue_file_read(struct ns_connection *conn, int fd, int len) {
+#ifdef NS_ENABLE_IO_URING
+  struct io_uring_sqe *sqe;
+
+  if (conn->server->uring != NULL) {
+    // Do not read ahead of the socket, wait until the data is sent
+    if ((conn->uring_ops & NS_URING_OP_BIT(NS_URING_FILE)) ||
+        ns_send_pending(conn) >= NS_URING_BUF_SIZE) {
+      return 1;
+    }
+    if (len > NS_URING_BUF_SIZE) len = NS_URING_BUF_SIZE;
+    if ((conn->uring_file_buf != NULL ||
+         (conn->uring_file_buf = (char *) NS_MALLOC(NS_URING_BUF_SIZE))) &&
+        (sqe = ns_uring_submit_conn(conn, NS_URING_FILE, IORING_OP_READ, fd,
+                                    conn->uring_file_buf, (unsigned) len))
+        != NULL) {
+      sqe->off = (uint64_t) -1;  // Read from the current file position
+      return 1;
     }
   }
-  //DBG(("%d active connections", num_active_connections));
+#else
+  (void) conn; (void) fd; (void) len;
+#endif
+  return 0;
+}
+
+int ns_server_poll(struct ns_server *server, int milli) {
+  if (server->listening_sock == INVALID_SOCKET &&
+      server->active_connections == NULL) return 0;
 
-  return num_active_connections;
+#ifdef NS_ENABLE_IO_URING
+  if (server->uring != NULL) {
+    return ns_uring_poll(server, milli);
+  }
+#endif
+#ifdef NS_ENABLE_EPOLL
+  if (server->epoll_fd >= 0) {
+    return ns_epoll_poll(server, milli);
+  }
+#endif
+  return ns_select_poll(server, milli);
 }
 
 struct ns_connection *ns_connect(struct ns_server *server, const char *host,
@@ -954,6 +2349,7 @@ struct ns_connection *ns_connect(struct ns_server *server, const char *host,
   memset(conn, 0, sizeof(*conn));
   conn->server = server;
   conn->sock = sock;
+  conn->sa.sin = sin;
   conn->connection_data = param;
   conn->flags = NSF_CONNECTING;
   conn->last_io_time = time(NULL);
@@ -991,6 +2387,7 @@ void ns_iterate(struct ns_server *server, ns_callback_t cb, void *param) {
 
   for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
     tmp_conn = conn->next;
+    ns_mark_dirty(conn);
     cb(conn, NS_POLL, param);
   }
 }
@@ -1015,6 +2412,8 @@ void ns_server_wakeup(struct ns_server *server) {
 void ns_server_init(struct ns_server *s, void *server_data, ns_callback_t cb) {
   memset(s, 0, sizeof(*s));
   s->listening_sock = s->ctl[0] = s->ctl[1] = INVALID_SOCKET;
+  s->accept_budget = NS_ACCEPT_BUDGET;
+  s->timers.now = ns_millis() / NS_TIMER_TICK_MS;
   s->server_data = server_data;
   s->callback = cb;
 
@@ -1032,6 +2431,15 @@ void ns_server_init(struct ns_server *s, void *server_data, ns_callback_t cb) {
   } while (s->ctl[0] == INVALID_SOCKET);
 #endif
 
+#ifdef NS_ENABLE_EPOLL
+  // If epoll is not available, fall back to select()
+  s->epoll_listening_sock = INVALID_SOCKET;
+  if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) >= 0 &&
+      s->ctl[1] != INVALID_SOCKET) {
+    ns_epoll_ctl(s, EPOLL_CTL_ADD, s->ctl[1], EPOLLIN, s->ctl);
+  }
+#endif
+
 #ifdef NS_ENABLE_SSL
   SSL_library_init();
   s->client_ssl_ctx = SSL_CTX_new(SSLv23_client_method());
@@ -1056,6 +2464,15 @@ void ns_server_free(struct ns_server *s) {
     ns_close_conn(conn);
   }
 
+#ifdef NS_ENABLE_EPOLL
+  if (s->epoll_fd >= 0) close(s->epoll_fd);
+  s->epoll_fd = -1;
+#endif
+
+#ifdef NS_ENABLE_IO_URING
+  if (s->uring != NULL) ns_uring_destroy(s);
+#endif
+
 #ifdef NS_ENABLE_SSL
   if (s->ssl_ctx != NULL) SSL_CTX_free(s->ssl_ctx);
   if (s->client_ssl_ctx != NULL) SSL_CTX_free(s->client_ssl_ctx);
@@ -1135,6 +2552,15 @@ typedef pid_t process_id_t;
 #define MONGOOSE_IDLE_TIMEOUT_SECONDS 30
 #endif
 
+#ifndef MONGOOSE_OFFLOAD_THREADS
+#define MONGOOSE_OFFLOAD_THREADS 4  // Shared by every server, see mg_offload
+#endif
+
+// Time a client has to send complete request headers
+#ifndef MONGOOSE_REQUEST_TIMEOUT_SECONDS
+#define MONGOOSE_REQUEST_TIMEOUT_SECONDS 10
+#endif
+
 #ifdef MONGOOSE_NO_SOCKETPAIR
 #define MONGOOSE_NO_CGI
 #endif
@@ -1163,6 +2589,7 @@ struct dir_entry {
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options.
 enum {
+  ACCEPT_BUDGET,
   ACCESS_CONTROL_LIST,
 #ifndef MONGOOSE_NO_FILESYSTEM
   ACCESS_LOG_FILE,
@@ -1180,6 +2607,10 @@ enum {
 #endif
 #endif
   EXTRA_MIME_TYPES,
+#ifndef MONGOOSE_NO_FILESYSTEM
+  FILE_CACHE_SIZE,
+  FILE_CACHE_TTL,
+#endif
 #if !defined(MONGOOSE_NO_FILESYSTEM) && !defined(MONGOOSE_NO_AUTH)
   GLOBAL_AUTH_FILE,
 #endif
@@ -1189,6 +2620,8 @@ enum {
   INDEX_FILES,
 #endif
   LISTENING_PORT,
+  MAX_REQUEST_HEADERS,
+  PIPELINE_BUDGET,
 #ifndef _WIN32
   RUN_AS_USER,
 #endif
@@ -1205,6 +2638,7 @@ enum {
 };
 
 static const char *static_config_options[] = {
+  "accept_budget", NULL,
   "access_control_list", NULL,
 #ifndef MONGOOSE_NO_FILESYSTEM
   "access_log_file", NULL,
@@ -1222,6 +2656,10 @@ static const char *static_config_options[] = {
 #endif
 #endif
   "extra_mime_types", NULL,
+#ifndef MONGOOSE_NO_FILESYSTEM
+  "file_cache_size", "256",
+  "file_cache_ttl", "1",
+#endif
 #if !defined(MONGOOSE_NO_FILESYSTEM) && !defined(MONGOOSE_NO_AUTH)
   "global_auth_file", NULL,
 #endif
@@ -1231,6 +2669,8 @@ static const char *static_config_options[] = {
   "index_files","index.html,index.htm,index.shtml,index.cgi,index.php,index.lp",
 #endif
   "listening_port", NULL,
+  "max_request_headers", "64",
+  "pipeline_budget", "16",
 #ifndef _WIN32
   "run_as_user", NULL,
 #endif
@@ -1246,12 +2686,41 @@ static const char *static_config_options[] = {
   NULL
 };
 
+#ifndef MONGOOSE_NO_FILESYSTEM
+// Descriptor of a cached file, shared by the sends in flight
+struct file_cache_ref {
+  int fd;
+  int refs;                     // Cache entry plus sends in flight
+};
+
+// Cached stat() and open() of a document_root path. Missing paths are
+// cached as well, so repeated misses don't reach the filesystem either.
+struct file_cache_entry {
+  char *path;                   // NULL if the slot is empty
+  file_stat_t st;
+  int exists;
+  struct file_cache_ref *ref;   // Opened on first send, or NULL
+  time_t expires;
+};
+#endif
+
 struct mg_server {
   struct ns_server ns_server;
   union socket_address lsa;   // Listening socket address
   mg_handler_t event_handler;
   char *config_options[NUM_OPTIONS];
   int server_id; // @author Thomas Lextrait
+#ifndef MONGOOSE_NO_FILESYSTEM
+  struct file_cache_entry *file_cache;  // Allocated on first use
+  int file_cache_size;
+#endif
+#ifndef MONGOOSE_NO_LOGGING
+  FILE *access_log;           // Opened on first request
+#endif
+  struct mg_offload_job *offloaded;  // Work done, waiting for the reactor
+#ifndef _WIN32
+  pthread_mutex_t offload_lock;
+#endif
 };
 
 // Local endpoint representation
@@ -1261,7 +2730,7 @@ union endpoint {
 };
 
 enum endpoint_type {
- EP_NONE, EP_FILE, EP_CGI, EP_USER, EP_PUT, EP_CLIENT, EP_PROXY
+ EP_NONE, EP_FILE, EP_CGI, EP_USER, EP_PUT, EP_CLIENT, EP_PROXY, EP_ASYNC
 };
 
 #define MG_HEADERS_SENT NSF_USER_1
@@ -1276,10 +2745,17 @@ struct connection {
   union endpoint endpoint;
   enum endpoint_type endpoint_type;
   char *path_info;
-  char *request;
+  char *request;              // Parsed in place, at the start of request_buf
+  struct iobuf request_buf;   // Receive buffer the request came in
+  struct iobuf spare;         // Next receive buffer, see detach_request()
   int64_t num_bytes_sent; // Total number of bytes sent
   int64_t cl;             // Reply content length, for Range support
   int request_len;  // Request length, including last \r\n after last header
+  time_t request_deadline;  // Headers must be received by then, or 0
+  struct mg_offload_job *job;  // Offloaded work of the request, or NULL
+  int max_headers;        // Capacity of mg_conn.http_headers
+  int in_recv;            // on_recv_data() is running for this connection
+  int request_done;       // A keep-alive request ended, see on_recv_data()
 
   int server_id;
 };
@@ -1469,59 +2945,244 @@ static int mg_snprintf(char *buf, size_t buflen, const char *fmt, ...) {
   return n;
 }
 
+// HTTP parser scanners: they return the first byte of [p, end) that is a
+// control character (< 0x20 or 0x7f), or one of two delimiters, or end.
+// Headers are scanned a vector at a time where the CPU allows it, the
+// variant is chosen by init_http_scanners().
+static const char *find_ctl_scalar(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if ((unsigned char) *p < 0x20 || *p == 0x7f) break;
+  }
+  return p;
+}
+
+static const char *find_delim_scalar(const char *p, const char *end,
+                                     char a, char b) {
+  for (; p < end; p++) {
+    if (*p == a || *p == b) break;
+  }
+  return p;
+}
+
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(MONGOOSE_NO_SIMD)
+#define MONGOOSE_USE_SIMD
+#include <immintrin.h>
+
+static const char *find_ctl_sse2(const char *p, const char *end) {
+  const __m128i ctl = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+  __m128i v;
+  int mask;
+
+  for (; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *) p);
+    mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v), _mm_cmpeq_epi8(v, del)));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  return find_ctl_scalar(p, end);
+}
+
+static const char *find_delim_sse2(const char *p, const char *end,
+                                   char a, char b) {
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  __m128i v;
+  int mask;
+
+  for (; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *) p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                          _mm_cmpeq_epi8(v, vb)));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  return find_delim_scalar(p, end, a, b);
+}
+
+// AVX2 parses typical requests no faster than SSE2, their lines are short.
+// Define MONGOOSE_ENABLE_AVX2 to use it on CPUs that support it anyway,
+// 'make bench' compares both.
+#ifdef MONGOOSE_ENABLE_AVX2
+__attribute__((target("avx2")))
+static const char *find_ctl_avx2(const char *p, const char *end) {
+  const __m256i ctl = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+  __m256i v;
+  unsigned int mask;
+
+  for (; end - p >= 32; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *) p);
+    mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+        _mm256_cmpeq_epi8(v, del)));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();  // No AVX to SSE transition penalty for the tail
+  return find_ctl_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_delim_avx2(const char *p, const char *end,
+                                   char a, char b) {
+  const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+  __m256i v;
+  unsigned int mask;
+
+  for (; end - p >= 32; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *) p);
+    mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return find_delim_sse2(p, end, a, b);
+}
+#endif
+
+static const char *(*find_ctl)(const char *, const char *) = find_ctl_sse2;
+static const char *(*find_delim)(const char *, const char *, char, char) =
+  find_delim_sse2;
+#else
+static const char *(*find_ctl)(const char *, const char *) = find_ctl_scalar;
+static const char *(*find_delim)(const char *, const char *, char, char) =
+  find_delim_scalar;
+#endif
+
+// Called before any server polls, the scanners are shared by all threads
+static void init_http_scanners(void) {
+#if defined(MONGOOSE_USE_SIMD) && defined(MONGOOSE_ENABLE_AVX2)
+  if (__builtin_cpu_supports("avx2")) {
+    find_ctl = find_ctl_avx2;
+    find_delim = find_delim_avx2;
+  }
+#endif
+}
+
 // Check whether full request is buffered. Return:
 //   -1  if request is malformed
 //    0  if request is not yet fully buffered
 //   >0  actual request length, including last \r\n\r\n
 static int get_request_len(const char *s, int buf_len) {
-  const unsigned char *buf = (unsigned char *) s;
-  int i;
+  const char *p = s, *end = s + buf_len;
 
-  for (i = 0; i < buf_len; i++) {
-    // Control characters are not allowed but >=128 are.
-    // Abort scan as soon as one malformed character is found.
-    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
+  // Only control characters need a closer look: line breaks, or a
+  // malformed character that aborts the scan. Bytes >= 128 are allowed.
+  while ((p = find_ctl(p, end)) < end) {
+    if (*p != '\r' && *p != '\n') {
       return -1;
-    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
-      return i + 2;
-    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
-               buf[i + 2] == '\n') {
-      return i + 3;
+    } else if (*p == '\n' && p + 1 < end && p[1] == '\n') {
+      return (int) (p - s) + 2;
+    } else if (*p == '\n' && p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+      return (int) (p - s) + 3;
     }
+    p++;
   }
 
   return 0;
 }
 
-// Skip the characters until one of the delimiters characters found.
+// Skip the characters until one of the delimiters a or b is found, or end.
 // 0-terminate resulting word. Skip the rest of the delimiters if any.
 // Advance pointer to buffer to the next word. Return found 0-terminated word.
-static char *skip(char **buf, const char *delimiters) {
-  char *p, *begin_word, *end_word, *end_delimiters;
+static char *skip(char **buf, const char *end, char a, char b) {
+  char *begin_word = *buf, *p;
+
+  p = (char *) find_delim(begin_word, end, a, b);
+  while (p < end && (*p == a || *p == b)) {
+    *p++ = '\0';
+  }
+  *buf = p;
+
+  return begin_word;
+}
+
+static int lowercase(const char *s) {
+  return tolower(* (const unsigned char *) s);
+}
+
+static int mg_strcasecmp(const char *s1, const char *s2) {
+  int diff;
+
+  do {
+    diff = lowercase(s1++) - lowercase(s2++);
+  } while (diff == 0 && s1[-1] != '\0');
 
-  begin_word = *buf;
-  end_word = begin_word + strcspn(begin_word, delimiters);
-  end_delimiters = end_word + strspn(end_word, delimiters);
+  return diff;
+}
 
-  for (p = end_word; p < end_delimiters; p++) {
-    *p = '\0';
+// Names of the well-known headers, in mg_header_id order, their hashes and
+// an open-addressing table of their ids + 1, filled by init_header_ids()
+static const char *known_header_names[MG_NUM_KNOWN_HEADERS] = {
+  "Accept", "Accept-Encoding", "Authorization", "Connection",
+  "Content-Length", "Content-Range", "Content-Type", "Cookie", "Expect",
+  "Host", "If-Modified-Since", "If-None-Match", "If-Range", "Range",
+  "Referer", "Sec-WebSocket-Key", "Sec-WebSocket-Version", "Upgrade",
+  "User-Agent"
+};
+static unsigned int known_header_hashes[MG_NUM_KNOWN_HEADERS];
+static unsigned char known_header_ids[64];
+
+// FNV-1a of a header name. Setting bit 5 folds letters to lower case, and
+// only makes other characters collide, which name comparisons sort out.
+static unsigned int header_hash(const char *name) {
+  unsigned int hash = 2166136261U;
+  while (*name != '\0') {
+    hash = (hash ^ (unsigned char) (*name++ | 0x20)) * 16777619U;
+  }
+  return hash;
+}
+
+// Called before any server polls, the table is shared by all threads
+static void init_header_ids(void) {
+  static int initialized;
+  unsigned int i, slot;
+
+  if (initialized) return;
+  initialized = 1;
+  for (i = 0; i < MG_NUM_KNOWN_HEADERS; i++) {
+    known_header_hashes[i] = header_hash(known_header_names[i]);
+    slot = known_header_hashes[i] % ARRAY_SIZE(known_header_ids);
+    while (known_header_ids[slot] != 0) {
+      slot = (slot + 1) % ARRAY_SIZE(known_header_ids);
+    }
+    known_header_ids[slot] = (unsigned char) (i + 1);
   }
+}
 
-  *buf = end_delimiters;
+// Return the mg_header_id of a header name, or -1 if it isn't well-known
+static int known_header_id(const char *name, unsigned int hash) {
+  unsigned int slot = hash % ARRAY_SIZE(known_header_ids);
+  int id;
 
-  return begin_word;
+  while ((id = known_header_ids[slot] - 1) >= 0) {
+    if (known_header_hashes[id] == hash &&
+        !mg_strcasecmp(known_header_names[id], name)) {
+      return id;
+    }
+    slot = (slot + 1) % ARRAY_SIZE(known_header_ids);
+  }
+
+  return -1;
 }
 
 // Parse HTTP headers from the given buffer, advance buffer to the point
-// where parsing stopped.
-static void parse_http_headers(char **buf, struct mg_connection *ri) {
-  size_t i;
-
-  for (i = 0; i < ARRAY_SIZE(ri->http_headers); i++) {
-    ri->http_headers[i].name = skip(buf, ": ");
-    ri->http_headers[i].value = skip(buf, "\r\n");
-    if (ri->http_headers[i].name[0] == '\0')
+// where parsing stopped. Headers after the first max_headers are ignored.
+static void parse_http_headers(char **buf, const char *end,
+                               struct mg_connection *ri, int max_headers) {
+  struct mg_header *h;
+  int i, id;
+
+  memset(ri->header_index, 0, sizeof(ri->header_index));
+  for (i = 0; i < max_headers; i++) {
+    h = &ri->http_headers[i];
+    h->name = skip(buf, end, ':', ' ');
+    h->value = skip(buf, end, '\r', '\n');
+    if (h->name[0] == '\0')
       break;
+    h->hash = header_hash(h->name);
+
+    // Only the first of repeated headers is indexed, as mg_get_header() finds
+    if ((id = known_header_id(h->name, h->hash)) >= 0 &&
+        ri->header_index[id] == 0) {
+      ri->header_index[id] = (unsigned short) (i + 1);
+    }
     ri->num_headers = i + 1;
   }
 }
@@ -1538,6 +3199,7 @@ static const char *status_code_to_str(int status_code) {
     case 403: return "Forbidden";
     case 404: return "Not Found";
     case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
     case 409: return "Conflict";
     case 411: return "Length Required";
     case 413: return "Request Entity Too Large";
@@ -1555,6 +3217,32 @@ static int call_user(struct connection *conn, enum mg_event ev) {
     conn->server->event_handler(&conn->mg_conn, ev) : MG_FALSE;
 }
 
+// Arm connection timer for the nearest deadline: idle timeout, websocket
+// ping or request headers. Deadlines are checked when the timer fires, so
+// the timer is not re-armed on every I/O.
+static void schedule_timer(struct ns_connection *nc, time_t now) {
+  struct connection *conn = (struct connection *) nc->connection_data;
+  time_t deadline = nc->last_io_time + MONGOOSE_IDLE_TIMEOUT_SECONDS + 1;
+
+  // CGI and proxy sockets point to the client connection
+  if (conn != NULL && conn->ns_conn == nc) {
+#ifndef MONGOOSE_NO_WEBSOCKET
+    if (conn->mg_conn.is_websocket) {
+      time_t ping = nc->last_io_time + MONGOOSE_USE_WEBSOCKET_PING_INTERVAL + 1;
+      if (ping <= now) {
+        ping = now + MONGOOSE_USE_WEBSOCKET_PING_INTERVAL + 1;  // Just pinged
+      }
+      if (ping < deadline) deadline = ping;
+    }
+#endif
+    if (conn->request_deadline != 0 && conn->request_deadline < deadline) {
+      deadline = conn->request_deadline;
+    }
+  }
+
+  ns_set_timer(nc, deadline > now ? (int) (deadline - now) * 1000 : 0);
+}
+
 static void send_http_error(struct connection *conn, int code,
                             const char *fmt, ...) {
   const char *message = status_code_to_str(code);
@@ -1870,7 +3558,7 @@ static void prepare_cgi_environment(struct connection *conn,
   if ((s = getenv("SERVER_NAME")) != NULL) {
     addenv(blk, "SERVER_NAME=%s", s);
   } else {
-    addenv(blk, "SERVER_NAME=%s", ri->local_ip);
+    addenv(blk, "SERVER_NAME=%s", mg_local_ip(ri));
   }
   addenv(blk, "SERVER_ROOT=%s", opts[DOCUMENT_ROOT]);
   addenv(blk, "DOCUMENT_ROOT=%s", opts[DOCUMENT_ROOT]);
@@ -1885,7 +3573,7 @@ static void prepare_cgi_environment(struct connection *conn,
   //addenv(blk, "SERVER_PORT=%d", ri->remote_port);
 
   addenv(blk, "REQUEST_METHOD=%s", ri->request_method);
-  addenv(blk, "REMOTE_ADDR=%s", ri->remote_ip);
+  addenv(blk, "REMOTE_ADDR=%s", mg_remote_ip(ri));
   addenv(blk, "REMOTE_PORT=%d", ri->remote_port);
   addenv(blk, "REQUEST_URI=%s%s%s", ri->uri,
          ri->query_string == NULL ? "" : "?",
@@ -1908,13 +3596,13 @@ static void prepare_cgi_environment(struct connection *conn,
   addenv(blk, "PATH_TRANSLATED=%s", prog);
   addenv(blk, "HTTPS=%s", conn->ns_conn->ssl != NULL ? "on" : "off");
 
-  if ((s = mg_get_header(ri, "Content-Type")) != NULL)
+  if ((s = mg_get_known_header(ri, MG_HEADER_CONTENT_TYPE)) != NULL)
     addenv(blk, "CONTENT_TYPE=%s", s);
 
   if (ri->query_string != NULL)
     addenv(blk, "QUERY_STRING=%s", ri->query_string);
 
-  if ((s = mg_get_header(ri, "Content-Length")) != NULL)
+  if ((s = mg_get_known_header(ri, MG_HEADER_CONTENT_LENGTH)) != NULL)
     addenv(blk, "CONTENT_LENGTH=%s", s);
 
   addenv2(blk, "PATH");
@@ -1987,6 +3675,7 @@ static void open_cgi_endpoint(struct connection *conn, const char *prog) {
     conn->endpoint.nc = ns_add_sock(&conn->server->ns_server,
                                           fds[0], conn);
     conn->endpoint.nc->flags |= MG_CGI_CONN;
+    schedule_timer(conn->endpoint.nc, conn->endpoint.nc->last_io_time);
     ns_send(conn->ns_conn, cgi_status, sizeof(cgi_status) - 1);
     conn->mg_conn.status_code = 200;
     conn->ns_conn->flags |= NSF_BUFFER_BUT_DONT_SEND;
@@ -2007,6 +3696,7 @@ static void on_cgi_data(struct ns_connection *nc) {
   struct connection *conn = (struct connection *) nc->connection_data;
   const char *status = "500";
   struct mg_connection c;
+  struct mg_header headers[64];
 
   if (!conn) return;
 
@@ -2031,7 +3721,8 @@ static void on_cgi_data(struct ns_connection *nc) {
       memset(&c, 0, sizeof(c));
       memcpy(buf, io->buf + s_len, len);
       buf[len - 1] = '\0';
-      parse_http_headers(&s, &c);
+      c.http_headers = headers;
+      parse_http_headers(&s, buf + len - 1, &c, (int) ARRAY_SIZE(headers));
       if (mg_get_header(&c, "Location") != NULL) {
         status = "302";
       } else if ((status = (char *) mg_get_header(&c, "Status")) == NULL) {
@@ -2151,7 +3842,9 @@ static int is_valid_http_method(const char *s) {
 // This function modifies the buffer by NUL-terminating
 // HTTP request components, header names and header values.
 // Note that len must point to the last \n of HTTP headers.
-static int parse_http_message(char *buf, int len, struct mg_connection *ri) {
+static int parse_http_message(char *buf, int len, struct mg_connection *ri,
+                              int max_headers) {
+  const char *end = buf + len - 1;
   int is_request, n;
 
   // Reset the connection. Make sure that we don't touch fields that are
@@ -2165,9 +3858,9 @@ static int parse_http_message(char *buf, int len, struct mg_connection *ri) {
   while (*buf != '\0' && isspace(* (unsigned char *) buf)) {
     buf++;
   }
-  ri->request_method = skip(&buf, " ");
-  ri->uri = skip(&buf, " ");
-  ri->http_version = skip(&buf, "\r\n");
+  ri->request_method = skip(&buf, end, ' ', ' ');
+  ri->uri = skip(&buf, end, ' ', ' ');
+  ri->http_version = skip(&buf, end, '\r', '\n');
 
   // HTTP message could be either HTTP request or HTTP response, e.g.
   // "GET / HTTP/1.0 ...." or  "HTTP/1.0 200 OK ..."
@@ -2179,7 +3872,7 @@ static int parse_http_message(char *buf, int len, struct mg_connection *ri) {
     if (is_request) {
       ri->http_version += 5;
     }
-    parse_http_headers(&buf, ri);
+    parse_http_headers(&buf, end, ri, max_headers);
 
     if ((ri->query_string = strchr(ri->uri, '?')) != NULL) {
       *(char *) ri->query_string++ = '\0';
@@ -2194,20 +3887,6 @@ static int parse_http_message(char *buf, int len, struct mg_connection *ri) {
   return len;
 }
 
-static int lowercase(const char *s) {
-  return tolower(* (const unsigned char *) s);
-}
-
-static int mg_strcasecmp(const char *s1, const char *s2) {
-  int diff;
-
-  do {
-    diff = lowercase(s1++) - lowercase(s2++);
-  } while (diff == 0 && s1[-1] != '\0');
-
-  return diff;
-}
-
 static int mg_strncasecmp(const char *s1, const char *s2, size_t len) {
   int diff = 0;
 
@@ -2220,11 +3899,25 @@ static int mg_strncasecmp(const char *s1, const char *s2, size_t len) {
 }
 
 // Return HTTP header value, or NULL if not found.
+// O(1), the parser indexes well-known headers
+const char *mg_get_known_header(const struct mg_connection *ri,
+                                enum mg_header_id id) {
+  int i = ri->header_index[id];
+  return i > 0 && i <= ri->num_headers ? ri->http_headers[i - 1].value : NULL;
+}
+
 const char *mg_get_header(const struct mg_connection *ri, const char *s) {
+  unsigned int hash = header_hash(s);
   int i;
 
+  if ((i = known_header_id(s, hash)) >= 0) {
+    return mg_get_known_header(ri, (enum mg_header_id) i);
+  }
+
+  // Names are only compared when their hashes match
   for (i = 0; i < ri->num_headers; i++)
-    if (!mg_strcasecmp(s, ri->http_headers[i].name))
+    if (ri->http_headers[i].hash == hash &&
+        !mg_strcasecmp(s, ri->http_headers[i].name))
       return ri->http_headers[i].value;
 
   return NULL;
@@ -2300,14 +3993,108 @@ void mg_template(struct mg_connection *conn, const char *s,
   if (i > pos) {
     mg_send_data(conn, &s[pos], i - pos);
   }
-}
+}
+
+#ifndef MONGOOSE_NO_FILESYSTEM
+static int must_hide_file(struct connection *conn, const char *path) {
+  const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
+  const char *pattern = conn->server->config_options[HIDE_FILES_PATTERN];
+  return mg_match_prefix(pw_pattern, strlen(pw_pattern), path) > 0 ||
+    (pattern != NULL && mg_match_prefix(pattern, strlen(pattern), path) > 0);
+}
+
+static void file_cache_unref(void *param) {
+  struct file_cache_ref *ref = (struct file_cache_ref *) param;
+  if (--ref->refs == 0) {
+    close(ref->fd);
+    free(ref);
+  }
+}
+
+static void file_cache_free(struct mg_server *server) {
+  int i;
+
+  for (i = 0; i < server->file_cache_size; i++) {
+    free(server->file_cache[i].path);
+    if (server->file_cache[i].ref != NULL) {
+      file_cache_unref(server->file_cache[i].ref);
+    }
+  }
+  free(server->file_cache);
+  server->file_cache = NULL;
+  server->file_cache_size = 0;
+}
+
+// Return the cache slot of a path, or NULL if the file cache is disabled.
+// Each server is polled by a single thread, the cache needs no locking.
+static struct file_cache_entry *file_cache_slot(struct mg_server *server,
+                                                const char *path) {
+  const char *size = server->config_options[FILE_CACHE_SIZE];
+  unsigned long hash = 5381;
+
+  if (server->file_cache == NULL) {
+    int n = size == NULL ? 0 : atoi(size);
+    if (n <= 0 || (server->file_cache = (struct file_cache_entry *)
+                   calloc(n, sizeof(struct file_cache_entry))) == NULL) {
+      return NULL;
+    }
+    server->file_cache_size = n;
+  }
+
+  while (*path != '\0') hash = hash * 33 + (unsigned char) *path++;
+  return &server->file_cache[hash % server->file_cache_size];
+}
+
+// stat() through the file cache. Entries are trusted for file_cache_ttl
+// seconds, a colliding path takes over the slot.
+static int cached_stat(struct mg_server *server, const char *path,
+                       file_stat_t *st) {
+  struct file_cache_entry *e = file_cache_slot(server, path);
+  const char *ttl = server->config_options[FILE_CACHE_TTL];
+  time_t now;
+
+  if (e == NULL) return stat(path, st);
+
+  now = time(NULL);
+  if (e->path == NULL || now >= e->expires || strcmp(e->path, path) != 0) {
+    free(e->path);
+    if (e->ref != NULL) file_cache_unref(e->ref);
+    e->ref = NULL;
+    e->exists = stat(path, &e->st) == 0;
+    e->path = mg_strdup(path);
+    e->expires = now + (ttl == NULL ? 0 : atoi(ttl));
+  }
+
+  if (!e->exists) return -1;
+  *st = e->st;
+  return 0;
+}
+
+// Return the cached descriptor of a path that cached_stat() found, or NULL.
+// The caller owns a reference, to release with file_cache_unref().
+static struct file_cache_ref *cached_open(struct mg_server *server,
+                                          const char *path) {
+  struct file_cache_entry *e = file_cache_slot(server, path);
+  int fd;
+
+  if (e == NULL || e->path == NULL || !e->exists ||
+      strcmp(e->path, path) != 0) {
+    return NULL;
+  }
+
+  if (e->ref == NULL) {
+    if ((fd = open(path, O_RDONLY | O_BINARY)) == -1) return NULL;
+    if ((e->ref = (struct file_cache_ref *) malloc(sizeof(*e->ref))) == NULL) {
+      close(fd);
+      return NULL;
+    }
+    ns_set_close_on_exec(fd);
+    e->ref->fd = fd;
+    e->ref->refs = 1;
+  }
 
-#ifndef MONGOOSE_NO_FILESYSTEM
-static int must_hide_file(struct connection *conn, const char *path) {
-  const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-  const char *pattern = conn->server->config_options[HIDE_FILES_PATTERN];
-  return mg_match_prefix(pw_pattern, strlen(pw_pattern), path) > 0 ||
-    (pattern != NULL && mg_match_prefix(pattern, strlen(pattern), path) > 0);
+  e->ref->refs++;
+  return e->ref;
 }
 
 // Return 1 if real file has been found, 0 otherwise
@@ -2321,7 +4108,7 @@ static int convert_uri_to_file_name(struct connection *conn, char *buf,
   char *p;
 #endif
   const char *uri = conn->mg_conn.uri;
-  const char *domain = mg_get_header(&conn->mg_conn, "Host");
+  const char *domain = mg_get_known_header(&conn->mg_conn, MG_HEADER_HOST);
   int match_len, root_len = root == NULL ? 0 : strlen(root);
 
   // Perform virtual hosting rewrites
@@ -2352,7 +4139,7 @@ static int convert_uri_to_file_name(struct connection *conn, char *buf,
     }
   }
 
-  if (stat(buf, st) == 0) return 1;
+  if (cached_stat(conn->server, buf, st) == 0) return 1;
 
 #ifndef MONGOOSE_NO_CGI
   // Support PATH_INFO for CGI scripts.
@@ -2380,18 +4167,141 @@ static int should_keep_alive(const struct mg_connection *conn) {
   struct connection *c = MG_CONN_2_CONN(conn);
   const char *method = conn->request_method;
   const char *http_version = conn->http_version;
-  const char *header = mg_get_header(conn, "Connection");
+  const char *header = mg_get_known_header(conn, MG_HEADER_CONNECTION);
   return method != NULL &&
     (!strcmp(method, "GET") || c->endpoint_type == EP_USER) &&
     ((header != NULL && !mg_strcasecmp(header, "keep-alive")) ||
      (header == NULL && http_version && !strcmp(http_version, "1.1")));
 }
 
+int mg_should_keep_alive(const struct mg_connection *conn) {
+  return should_keep_alive(conn);
+}
+
 int mg_write(struct mg_connection *c, const void *buf, int len) {
   struct connection *conn = MG_CONN_2_CONN(c);
   return ns_send(conn->ns_conn, buf, len);
 }
 
+struct mg_shared_buf {
+  const void *data;
+  size_t len;
+  void (*free_fn)(void *);
+  int mapped;           // data is a file mapping, unmapped on release
+  volatile long refs;   // Shared by connections of all server threads
+};
+
+struct mg_shared_buf *mg_shared_buf_new(const void *data, size_t len,
+                                        void (*free_fn)(void *)) {
+  struct mg_shared_buf *b;
+
+  if ((b = (struct mg_shared_buf *) malloc(sizeof(*b))) != NULL) {
+    b->data = data;
+    b->len = len;
+    b->free_fn = free_fn;
+    b->mapped = 0;
+    b->refs = 1;
+  }
+
+  return b;
+}
+
+struct mg_shared_buf *mg_shared_buf_map(int fd, size_t len, int flags) {
+#ifdef _WIN32
+  (void) fd; (void) len; (void) flags;
+  return NULL;
+#else
+  struct mg_shared_buf *b;
+  void *p;
+
+  if (len == 0) return NULL;
+  if ((p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    return NULL;
+  }
+  if ((b = mg_shared_buf_new(p, len, NULL)) == NULL) {
+    munmap(p, len);
+    return NULL;
+  }
+  b->mapped = 1;
+
+  // Hints only, the mapping works the same if the kernel ignores them
+  if (flags & MG_MAP_WILLNEED) madvise(p, len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+  if (flags & MG_MAP_HUGEPAGE) madvise(p, len, MADV_HUGEPAGE);
+#endif
+
+  return b;
+#endif
+}
+
+const void *mg_shared_buf_data(const struct mg_shared_buf *b) {
+  return b->data;
+}
+
+void mg_shared_buf_ref(struct mg_shared_buf *b) {
+#ifdef _WIN32
+  InterlockedIncrement(&b->refs);
+#else
+  __sync_add_and_fetch(&b->refs, 1);
+#endif
+}
+
+void mg_shared_buf_unref(struct mg_shared_buf *b) {
+#ifdef _WIN32
+  if (InterlockedDecrement(&b->refs) != 0) return;
+#else
+  if (__sync_sub_and_fetch(&b->refs, 1) != 0) return;
+#endif
+#ifndef _WIN32
+  if (b->mapped) munmap((void *) b->data, b->len);
+#endif
+  if (b->free_fn != NULL) b->free_fn((void *) b->data);
+  free(b);
+}
+
+static void release_shared_buf(void *param) {
+  mg_shared_buf_unref((struct mg_shared_buf *) param);
+}
+
+int mg_write_shared(struct mg_connection *c, struct mg_shared_buf *b,
+                    size_t offset, size_t len) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+
+  if (offset > b->len) offset = b->len;
+  if (len > b->len - offset) len = b->len - offset;
+  mg_shared_buf_ref(b);
+
+  return ns_send_ref(conn->ns_conn, (const char *) b->data + offset, len,
+                     release_shared_buf, b);
+}
+
+static void close_file(void *param) {
+  close((int) (intptr_t) param);
+}
+
+int mg_write_file(struct mg_connection *c, int fd, size_t offset, size_t len) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+  char buf[IOBUF_SIZE];
+  size_t sent = 0;
+  int n;
+
+  if (ns_send_file(conn->ns_conn, fd, offset, len, close_file,
+                   (void *) (intptr_t) fd)) {
+    return (int) len;
+  }
+
+  // Connection cannot send files directly, copy through user space
+  lseek(fd, offset, SEEK_SET);
+  while (sent < len && (n = read(fd, buf, len - sent < sizeof(buf) ?
+                                 len - sent : sizeof(buf))) > 0) {
+    ns_send(conn->ns_conn, buf, n);
+    sent += n;
+  }
+  close(fd);
+
+  return (int) sent;
+}
+
 void mg_send_status(struct mg_connection *c, int status) {
   if (c->status_code == 0) {
     c->status_code = status;
@@ -2736,8 +4646,9 @@ int mg_websocket_printf(struct mg_connection* conn, int opcode,
 }
 
 static void send_websocket_handshake_if_requested(struct mg_connection *conn) {
-  const char *ver = mg_get_header(conn, "Sec-WebSocket-Version"),
-        *key = mg_get_header(conn, "Sec-WebSocket-Key");
+  const char *ver = mg_get_known_header(conn,
+                                        MG_HEADER_SEC_WEBSOCKET_VERSION),
+        *key = mg_get_known_header(conn, MG_HEADER_SEC_WEBSOCKET_KEY);
   if (ver != NULL && key != NULL) {
     conn->is_websocket = 1;
     if (call_user(MG_CONN_2_CONN(conn), MG_WS_HANDSHAKE) == MG_FALSE) {
@@ -2767,6 +4678,8 @@ static int call_request_handler(struct connection *conn) {
       write_terminating_chunk(conn);
     }
     close_local_endpoint(conn);
+  } else if (result == MG_MORE && conn->endpoint_type != EP_ASYNC) {
+    conn->ns_conn->flags |= NSF_WANT_POLL;  // Long-running, send MG_POLL
   }
   return result;
 }
@@ -2871,15 +4784,46 @@ static void construct_etag(char *buf, size_t buf_len, const file_stat_t *st) {
               (unsigned long) st->st_mtime, (int64_t) st->st_size);
 }
 
+// Return True if etag is in the If-None-Match list. Weak comparison is
+// used, as for any GET or HEAD: a W/ prefix is ignored on both sides.
+static int etag_matches(const char *list, const char *etag) {
+  const char *end;
+  size_t len;
+
+  if (etag[0] == 'W' && etag[1] == '/') etag += 2;
+  len = strlen(etag);
+
+  while (*list != '\0') {
+    while (*list == ' ' || *list == '\t' || *list == ',') list++;
+    if (*list == '*') return 1;
+    if (list[0] == 'W' && list[1] == '/') list += 2;
+    for (end = list; *end != '\0' && *end != ','; end++) ;
+    while (end > list && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if ((size_t) (end - list) == len && !memcmp(list, etag, len)) return 1;
+    list = end;
+    while (*list != '\0' && *list != ',') list++;
+  }
+
+  return 0;
+}
+
+int mg_is_not_modified(const struct mg_connection *conn, const char *etag,
+                       time_t last_modified) {
+  const char *inm = mg_get_known_header(conn, MG_HEADER_IF_NONE_MATCH);
+  const char *ims = mg_get_known_header(conn, MG_HEADER_IF_MODIFIED_SINCE);
+
+  // If-Modified-Since only counts when there is no If-None-Match
+  if (inm != NULL) return etag != NULL && etag_matches(inm, etag);
+  return ims != NULL && last_modified != 0 &&
+    last_modified <= parse_date_string(ims);
+}
+
 // Return True if we should reply 304 Not Modified.
 static int is_not_modified(const struct connection *conn,
                            const file_stat_t *stp) {
   char etag[64];
-  const char *ims = mg_get_header(&conn->mg_conn, "If-Modified-Since");
-  const char *inm = mg_get_header(&conn->mg_conn, "If-None-Match");
   construct_etag(etag, sizeof(etag), stp);
-  return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
-    (ims != NULL && stp->st_mtime <= parse_date_string(ims));
+  return mg_is_not_modified(&conn->mg_conn, etag, stp->st_mtime);
 }
 
 // For given directory path, substitute it to valid index file.
@@ -2915,7 +4859,7 @@ static int find_index_file(struct connection *conn, char *path,
     //DBG(("[%s]", path));
 
     // Does it exist?
-    if (!stat(path, &st)) {
+    if (!cached_stat(conn->server, path, &st)) {
       // Yes it does, break the loop
       *stp = st;
       found = 1;
@@ -2939,8 +4883,10 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
   strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
 }
 
+// Send a file. A cached descriptor is shared with other connections, it is
+// only sent with sendfile(), which leaves its offset alone.
 static void open_file_endpoint(struct connection *conn, const char *path,
-                               file_stat_t *st) {
+                               file_stat_t *st, struct file_cache_ref *ref) {
   char date[64], lm[64], etag[64], range[64], headers[500];
   const char *msg = "OK", *hdr;
   time_t curtime = time(NULL);
@@ -2949,7 +4895,11 @@ static void open_file_endpoint(struct connection *conn, const char *path,
   int n;
 
   conn->endpoint_type = EP_FILE;
-  ns_set_close_on_exec(conn->endpoint.fd);
+  if (ref != NULL) {
+    conn->endpoint.fd = -1;
+  } else {
+    ns_set_close_on_exec(conn->endpoint.fd);
+  }
   conn->mg_conn.status_code = 200;
 
   get_mime_type(conn->server, path, &mime_vec);
@@ -2958,7 +4908,7 @@ static void open_file_endpoint(struct connection *conn, const char *path,
 
   // If Range: header specified, act accordingly
   r1 = r2 = 0;
-  hdr = mg_get_header(&conn->mg_conn, "Range");
+  hdr = mg_get_known_header(&conn->mg_conn, MG_HEADER_RANGE);
   if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0 &&
       r1 >= 0 && r2 >= 0) {
     conn->mg_conn.status_code = 206;
@@ -2967,7 +4917,7 @@ static void open_file_endpoint(struct connection *conn, const char *path,
                 "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT "\r\n",
                 r1, r1 + conn->cl - 1, (int64_t) st->st_size);
     msg = "Partial Content";
-    lseek(conn->endpoint.fd, r1, SEEK_SET);
+    if (ref == NULL) lseek(conn->endpoint.fd, r1, SEEK_SET);
   }
 
   // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
@@ -2994,8 +4944,36 @@ static void open_file_endpoint(struct connection *conn, const char *path,
 
   if (!strcmp(conn->mg_conn.request_method, "HEAD")) {
     conn->ns_conn->flags |= NSF_FINISHED_SENDING_DATA;
-    close(conn->endpoint.fd);
+    if (ref != NULL) {
+      file_cache_unref(ref);
+    } else {
+      close(conn->endpoint.fd);
+    }
     conn->endpoint_type = EP_NONE;
+  } else if (ref != NULL && conn->cl >= 0 &&
+             ns_send_file(conn->ns_conn, ref->fd, r1, (size_t) conn->cl,
+                          file_cache_unref, ref)) {
+    close_local_endpoint(conn);
+  } else if (ref != NULL) {
+    // Connection cannot send files directly, it reads from its own descriptor
+    file_cache_unref(ref);
+    if ((conn->endpoint.fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+      conn->endpoint_type = EP_NONE;
+      conn->ns_conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      return;
+    }
+    ns_set_close_on_exec(conn->endpoint.fd);
+    lseek(conn->endpoint.fd, r1, SEEK_SET);
+    conn->ns_conn->flags |= NSF_WANT_POLL;
+  } else if (conn->cl >= 0 &&
+             ns_send_file(conn->ns_conn, conn->endpoint.fd, r1,
+                          (size_t) conn->cl, close_file,
+                          (void *) (intptr_t) conn->endpoint.fd)) {
+    // Kernel sends the file from the page cache, the endpoint is done
+    conn->endpoint.fd = -1;
+    close_local_endpoint(conn);
+  } else {
+    conn->ns_conn->flags |= NSF_WANT_POLL;  // File is sent on NS_POLL
   }
 }
 #endif  // MONGOOSE_NO_FILESYSTEM
@@ -3398,7 +5376,8 @@ static int put_dir(const char *path) {
 
 static void handle_put(struct connection *conn, const char *path) {
   file_stat_t st;
-  const char *range, *cl_hdr = mg_get_header(&conn->mg_conn, "Content-Length");
+  const char *range, *cl_hdr = mg_get_known_header(&conn->mg_conn,
+                                                   MG_HEADER_CONTENT_LENGTH);
   int64_t r1, r2;
   int rc;
 
@@ -3424,7 +5403,7 @@ static void handle_put(struct connection *conn, const char *path) {
     DBG(("PUT [%s] %zu", path, conn->ns_conn->recv_iobuf.len));
     conn->endpoint_type = EP_PUT;
     ns_set_close_on_exec(conn->endpoint.fd);
-    range = mg_get_header(&conn->mg_conn, "Content-Range");
+    range = mg_get_known_header(&conn->mg_conn, MG_HEADER_CONTENT_RANGE);
     conn->cl = to64(cl_hdr);
     r1 = r2 = 0;
     if (range != NULL && parse_range_header(range, &r1, &r2) > 0) {
@@ -3753,7 +5732,7 @@ int mg_authorize_digest(struct mg_connection *c, FILE *fp) {
        uri[MAX_REQUEST_SIZE], cnonce[100], resp[100], qop[100], nc[100];
 
   if (c == NULL || fp == NULL) return 0;
-  if ((hdr = mg_get_header(c, "Authorization")) == NULL ||
+  if ((hdr = mg_get_known_header(c, MG_HEADER_AUTHORIZATION)) == NULL ||
       mg_strncasecmp(hdr, "Digest ", 7) != 0) return 0;
   if (!mg_parse_header(hdr, "username", user, sizeof(user))) return 0;
   if (!mg_parse_header(hdr, "cnonce", cnonce, sizeof(cnonce))) return 0;
@@ -4061,6 +6040,7 @@ static void proxify_connection(struct connection *conn) {
       (pc = ns_connect(server, host, port, cert[0] != '\0', conn)) != NULL) {
     // Interlink two connections
     pc->flags |= MG_PROXY_CONN;
+    schedule_timer(pc, pc->last_io_time);
     conn->endpoint_type = EP_PROXY;
     conn->endpoint.nc = pc;
     DBG(("%p [%s] -> %p", conn, c->uri, pc));
@@ -4122,6 +6102,7 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
   file_stat_t st;
   char path[MAX_PATH_SIZE];
   int exists = 0, is_directory = 0;
+  struct file_cache_ref *ref;
 #ifndef MONGOOSE_NO_CGI
   const char *cgi_pat = conn->server->config_options[CGI_PATTERN];
 #else
@@ -4149,7 +6130,8 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
     conn->endpoint_type = EP_USER;
 #if MONGOOSE_POST_SIZE_LIMIT > 1
     {
-      const char *cl = mg_get_header(&conn->mg_conn, "Content-Length");
+      const char *cl = mg_get_known_header(&conn->mg_conn,
+                                           MG_HEADER_CONTENT_LENGTH);
       if ((strcmp(conn->mg_conn.request_method, "POST") == 0 ||
            strcmp(conn->mg_conn.request_method, "PUT") == 0) &&
           (cl == NULL || to64(cl) > MONGOOSE_POST_SIZE_LIMIT)) {
@@ -4174,6 +6156,13 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
     send_http_error(conn, 404, NULL);
   }
 #else
+  // Requests that change files must not see cached results
+  if (!strcmp(conn->mg_conn.request_method, "PUT") ||
+      !strcmp(conn->mg_conn.request_method, "DELETE") ||
+      !strcmp(conn->mg_conn.request_method, "MKCOL")) {
+    file_cache_free(conn->server);
+  }
+
   exists = convert_uri_to_file_name(conn, path, sizeof(path), &st);
   is_directory = S_ISDIR(st.st_mode);
 
@@ -4229,10 +6218,12 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
 #endif
   } else if (is_not_modified(conn, &st)) {
     send_http_error(conn, 304, NULL);
+  } else if ((ref = cached_open(conn->server, path)) != NULL) {
+    open_file_endpoint(conn, path, &st, ref);
   } else if ((conn->endpoint.fd = open(path, O_RDONLY | O_BINARY)) != -1) {
     // O_BINARY is required for Windows, otherwise in default text mode
     // two bytes \r\n will be read as one.
-    open_file_endpoint(conn, path, &st);
+    open_file_endpoint(conn, path, &st, NULL);
   } else {
     send_http_error(conn, 404, NULL);
   }
@@ -4241,7 +6232,8 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
 
 static void send_continue_if_expected(struct connection *conn) {
   static const char expect_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
-  const char *expect_hdr = mg_get_header(&conn->mg_conn, "Expect");
+  const char *expect_hdr = mg_get_known_header(&conn->mg_conn,
+                                               MG_HEADER_EXPECT);
 
   if (expect_hdr != NULL && !mg_strcasecmp(expect_hdr, "100-continue")) {
     ns_send(conn->ns_conn, expect_response, sizeof(expect_response) - 1);
@@ -4257,22 +6249,88 @@ static int is_valid_uri(const char *uri) {
     sscanf(uri, "%*[^ :]:%hu", &n) > 0; // CONNECT method can use host:port
 }
 
+// Parsed request pointers must survive reallocations of recv_iobuf. Rather
+// than copying the request out, recv_iobuf's buffer is handed over to it,
+// and data is received into the connection's spare buffer instead. The two
+// buffers take turns: keep-alive requests are parsed in place with no
+// allocation, and no copy unless a body or pipelined request follows.
+// When more follows than the request itself, the request is copied into
+// the spare buffer instead, so that a pipeline is only copied once.
+static int detach_request(struct connection *conn) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  size_t rest = io->len - conn->request_len;
+
+  if (rest > (size_t) conn->request_len) {
+    if (iobuf_append(&conn->spare, io->buf, conn->request_len) <
+        (size_t) conn->request_len) {
+      return 0;
+    }
+    conn->request_buf = conn->spare;
+    conn->request = conn->request_buf.buf;
+    iobuf_init(&conn->spare, 0);
+    iobuf_remove(io, conn->request_len);
+    return 1;
+  }
+
+  if (rest > 0 &&
+      iobuf_append(&conn->spare, io->buf + conn->request_len, rest) < rest) {
+    return 0;
+  }
+
+  io->len = conn->request_len;
+  conn->request_buf = *io;
+  conn->request = io->buf;
+  *io = conn->spare;
+  iobuf_init(&conn->spare, 0);
+
+  return 1;
+}
+
+// The request's buffer is kept as the spare one, unless it grew large
+static void release_request(struct connection *conn) {
+  iobuf_remove(&conn->request_buf, conn->request_buf.len);
+  if (conn->spare.buf == NULL &&
+      conn->request_buf.size <= NS_IOBUF_IDLE_SIZE) {
+    conn->spare = conn->request_buf;
+    iobuf_init(&conn->request_buf, 0);
+  } else {
+    iobuf_free(&conn->request_buf);
+  }
+  conn->request = NULL;
+}
+
+// Headers are parsed into an array of the connection, reused by its requests
+static int alloc_headers(struct connection *conn) {
+  const char *max = conn->server->config_options[MAX_REQUEST_HEADERS];
+  int n = max == NULL ? 0 : atoi(max);
+
+  if (n < 1) n = 1;
+  if (n > 65535) n = 65535;  // See mg_connection.header_index
+  if (conn->mg_conn.http_headers == NULL || conn->max_headers != n) {
+    free(conn->mg_conn.http_headers);
+    conn->mg_conn.http_headers = (struct mg_header *)
+      malloc(n * sizeof(struct mg_header));
+    conn->max_headers = conn->mg_conn.http_headers == NULL ? 0 : n;
+  }
+
+  return conn->max_headers;
+}
+
 static void try_parse(struct connection *conn) {
   struct iobuf *io = &conn->ns_conn->recv_iobuf;
 
   if (conn->request_len == 0 &&
       (conn->request_len = get_request_len(io->buf, io->len)) > 0) {
-    // If request is buffered in, remove it from the iobuf. This is because
-    // iobuf could be reallocated, and pointers in parsed request could
-    // become invalid.
-    conn->request = (char *) malloc(conn->request_len);
-    memcpy(conn->request, io->buf, conn->request_len);
+    if (!detach_request(conn) || !alloc_headers(conn)) {
+      conn->request_len = -1;  // Out of memory
+      return;
+    }
     //DBG(("%p [%.*s]", conn, conn->request_len, conn->request));
-    iobuf_remove(io, conn->request_len);
     conn->request_len = parse_http_message(conn->request, conn->request_len,
-                                           &conn->mg_conn);
+                                           &conn->mg_conn, conn->max_headers);
     if (conn->request_len > 0) {
-      const char *cl_hdr = mg_get_header(&conn->mg_conn, "Content-Length");
+      const char *cl_hdr = mg_get_known_header(&conn->mg_conn,
+                                               MG_HEADER_CONTENT_LENGTH);
       conn->cl = cl_hdr == NULL ? 0 : to64(cl_hdr);
       conn->mg_conn.content_len = (size_t) conn->cl;
     }
@@ -4283,7 +6341,7 @@ static void proxy_from_client_to_target_host(struct connection *conn) {
   ns_forward(conn->ns_conn, conn->endpoint.nc);
 }
 
-static void on_recv_data(struct connection *conn) {
+static void serve_buffered_request(struct connection *conn) {
   struct iobuf *io = &conn->ns_conn->recv_iobuf;
 
   try_parse(conn);
@@ -4321,6 +6379,39 @@ static void on_recv_data(struct connection *conn) {
     forward_put_data(conn);
   }
 #endif
+
+  // Start the clock when the first bytes of request headers arrive
+  if (conn->request_len != 0 || io->len == 0) {
+    conn->request_deadline = 0;
+  } else if (conn->request_deadline == 0) {
+    time_t now = time(NULL);
+    conn->request_deadline = now + MONGOOSE_REQUEST_TIMEOUT_SECONDS;
+    schedule_timer(conn->ns_conn, now);
+  }
+}
+
+// Serves the requests buffered in recv_iobuf one after the other, rather
+// than recursively from close_local_endpoint(), so that a pipelining client
+// uses no stack. At most "pipeline_budget" requests are served per call,
+// the rest on NS_POLL, to share the thread with other connections. Their
+// responses queue up in the send chain and leave in a single writev().
+static void on_recv_data(struct connection *conn) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  const char *budget_opt = conn->server->config_options[PIPELINE_BUDGET];
+  int budget = budget_opt == NULL ? 1 : atoi(budget_opt);
+
+  if (conn->in_recv) return;  // Called back by close_local_endpoint()
+  conn->in_recv = 1;
+  do {
+    conn->request_done = 0;
+    serve_buffered_request(conn);
+  } while (conn->request_done && io->len > 0 && --budget > 0);
+  conn->in_recv = 0;
+
+  if (conn->request_done && io->len > 0) {
+    conn->ns_conn->flags |= NSF_WANT_POLL;
+    ns_mark_dirty(conn->ns_conn);
+  }
 }
 
 static void call_http_client_handler(struct connection *conn) {
@@ -4336,8 +6427,7 @@ static void call_http_client_handler(struct connection *conn) {
   iobuf_remove(&conn->ns_conn->recv_iobuf, conn->mg_conn.content_len);
   conn->mg_conn.status_code = 0;
   conn->cl = conn->num_bytes_sent = conn->request_len = 0;
-  free(conn->request);
-  conn->request = NULL;
+  release_request(conn);
 }
 
 static void process_response(struct connection *conn) {
@@ -4375,6 +6465,7 @@ struct mg_connection *mg_connect(struct mg_server *server, const char *host,
   //conn->handler = handler;
   conn->mg_conn.server_param = server->ns_server.server_data;
   conn->ns_conn->flags = NSF_CONNECTING;
+  schedule_timer(nsconn, nsconn->last_io_time);
 
   // Copy server id
   conn->server_id = server->server_id;
@@ -4396,21 +6487,26 @@ static void log_header(const struct mg_connection *conn, const char *header,
   }
 }
 
+// The log stays open, requests don't pay for opening it
 static void log_access(const struct connection *conn, const char *path) {
   const struct mg_connection *c = &conn->mg_conn;
-  FILE *fp = (path == NULL) ?  NULL : fopen(path, "a+");
+  FILE *fp = conn->server->access_log;
   char date[64], user[100];
   time_t now;
 
+  if (fp == NULL && path != NULL) {
+    fp = conn->server->access_log = fopen(path, "a+");
+  }
   if (fp == NULL) return;
   now = time(NULL);
   strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", localtime(&now));
 
   flockfile(fp);
-  mg_parse_header(mg_get_header(&conn->mg_conn, "Authorization"), "username",
-                  user, sizeof(user));
+  mg_parse_header(mg_get_known_header(&conn->mg_conn, MG_HEADER_AUTHORIZATION),
+                  "username", user, sizeof(user));
   fprintf(fp, "%s - %s [%s] \"%s %s%s%s HTTP/%s\" %d %" INT64_FMT,
-          c->remote_ip, user[0] == '\0' ? "-" : user, date,
+          mg_remote_ip((struct mg_connection *) c),
+          user[0] == '\0' ? "-" : user, date,
           c->request_method ? c->request_method : "-",
           c->uri ? c->uri : "-", c->query_string ? "?" : "",
           c->query_string ? c->query_string : "",
@@ -4421,7 +6517,6 @@ static void log_access(const struct connection *conn, const char *path) {
   fflush(fp);
 
   funlockfile(fp);
-  fclose(fp);
 }
 #endif
 
@@ -4436,7 +6531,7 @@ static void close_local_endpoint(struct connection *conn) {
   switch (conn->endpoint_type) {
     case EP_PUT:
     case EP_FILE:
-      close(conn->endpoint.fd);
+      if (conn->endpoint.fd >= 0) close(conn->endpoint.fd);
       break;
     case EP_CGI:
     case EP_PROXY:
@@ -4444,6 +6539,7 @@ static void close_local_endpoint(struct connection *conn) {
         DBG(("%p %p %p :-)", conn, conn->ns_conn, conn->endpoint.nc));
         conn->endpoint.nc->flags |= NSF_CLOSE_IMMEDIATELY;
         conn->endpoint.nc->connection_data = NULL;
+        ns_mark_dirty(conn->endpoint.nc);
       }
       break;
     default: break;
@@ -4456,47 +6552,190 @@ static void close_local_endpoint(struct connection *conn) {
   }
 #endif
 
-  // Gobble possible POST data sent to the URI handler
-  iobuf_free(&conn->ns_conn->recv_iobuf);
-  free(conn->request);
+  // Gobble possible POST data sent to the URI handler, the buffer is kept.
+  // What follows it on a keep-alive connection are pipelined requests.
+  iobuf_remove(&conn->ns_conn->recv_iobuf,
+               keep_alive && c->content_len < conn->ns_conn->recv_iobuf.len ?
+               c->content_len : conn->ns_conn->recv_iobuf.len);
+  release_request(conn);
   free(conn->path_info);
 
   conn->endpoint_type = EP_NONE;
   conn->cl = conn->num_bytes_sent = conn->request_len = 0;
   conn->ns_conn->flags &= ~(NSF_FINISHED_SENDING_DATA |
                             NSF_BUFFER_BUT_DONT_SEND | NSF_CLOSE_IMMEDIATELY |
-                            MG_HEADERS_SENT | MG_LONG_RUNNING);
+                            NSF_WANT_POLL | MG_HEADERS_SENT | MG_LONG_RUNNING);
   c->num_headers = c->status_code = c->is_websocket = c->content_len = 0;
   conn->endpoint.nc = NULL;
   c->request_method = c->uri = c->http_version = c->query_string = NULL;
-  conn->request = conn->path_info = NULL;
+  conn->path_info = NULL;
 
   if (keep_alive) {
-    on_recv_data(conn);  // Can call us recursively if pipelining is used
+    conn->request_done = 1;
+    on_recv_data(conn);  // Returns at once if it called us
   } else {
-    conn->ns_conn->flags |= conn->ns_conn->send_iobuf.len == 0 ?
+    conn->ns_conn->flags |= ns_send_pending(conn->ns_conn) == 0 ?
       NSF_CLOSE_IMMEDIATELY : NSF_FINISHED_SENDING_DATA;
   }
 }
 
-static void transfer_file_data(struct connection *conn) {
-  char buf[IOBUF_SIZE];
-  int n = read(conn->endpoint.fd, buf, conn->cl < (int64_t) sizeof(buf) ?
-               (int) conn->cl : (int) sizeof(buf));
-
+static void on_file_data(struct connection *conn, int n) {
   if (n <= 0) {
     close_local_endpoint(conn);
   } else if (n > 0) {
     conn->cl -= n;
-    ns_send(conn->ns_conn, buf, n);
     if (conn->cl <= 0) {
       close_local_endpoint(conn);
     }
   }
 }
 
+static void transfer_file_data(struct connection *conn) {
+  char buf[IOBUF_SIZE];
+  int n, len = conn->cl < (int64_t) sizeof(buf) ?
+    (int) conn->cl : (int) sizeof(buf);
+
+  // I/O engine appends the data itself and sends NS_FILE_READ
+  if (ns_queue_file_read(conn->ns_conn, conn->endpoint.fd, len)) return;
+
+  if ((n = read(conn->endpoint.fd, buf, len)) > 0) {
+    ns_send(conn->ns_conn, buf, n);
+  }
+  on_file_data(conn, n);
+}
+
+// Work run by the offload threads, so that blocking file I/O doesn't
+// stall the other connections of the event loop
+struct mg_offload_job {
+  void (*work)(void *);
+  void (*done)(struct mg_connection *, void *);
+  void *param;
+  struct mg_server *server;
+  struct connection *conn;      // NULL once the connection is closed
+  struct mg_offload_job *next;
+};
+
+#ifndef _WIN32
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+static struct mg_offload_job *offload_head, *offload_tail;
+static int offload_threads;
+
+static void *offload_thread(void *param) {
+  struct mg_offload_job *job;
+  struct mg_server *server;
+  (void) param;
+
+  for (;;) {
+    pthread_mutex_lock(&offload_lock);
+    while (offload_head == NULL) {
+      pthread_cond_wait(&offload_cond, &offload_lock);
+    }
+    job = offload_head;
+    if ((offload_head = job->next) == NULL) offload_tail = NULL;
+    pthread_mutex_unlock(&offload_lock);
+
+    job->work(job->param);
+
+    // The reactor may free the job as soon as it's queued
+    server = job->server;
+    pthread_mutex_lock(&server->offload_lock);
+    job->next = server->offloaded;
+    server->offloaded = job;
+    pthread_mutex_unlock(&server->offload_lock);
+    ns_server_wakeup(&server->ns_server);
+  }
+  return NULL;
+}
+#endif
+
+int mg_offload(struct mg_connection *c, void (*work)(void *),
+               void (*done)(struct mg_connection *, void *), void *param) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+  struct mg_offload_job *job;
+
+  if (conn->job != NULL ||
+      (job = (struct mg_offload_job *) calloc(1, sizeof(*job))) == NULL) {
+    return 0;
+  }
+  job->work = work;
+  job->done = done;
+  job->param = param;
+  job->server = conn->server;
+  job->conn = conn;
+  conn->job = job;
+  conn->endpoint_type = EP_ASYNC;
+
+#ifdef _WIN32
+  // No offload threads, the work is done right away
+  work(param);
+  job->next = conn->server->offloaded;
+  conn->server->offloaded = job;
+#else
+  pthread_mutex_lock(&offload_lock);
+  while (offload_threads < MONGOOSE_OFFLOAD_THREADS) {
+    mg_start_thread(offload_thread, NULL);
+    offload_threads++;
+  }
+  if (offload_tail != NULL) {
+    offload_tail->next = job;
+  } else {
+    offload_head = job;
+  }
+  offload_tail = job;
+  pthread_cond_signal(&offload_cond);
+  pthread_mutex_unlock(&offload_lock);
+#endif
+
+  return 1;
+}
+
+// Completes the requests whose offloaded work is done, on the reactor thread
+static void finish_offloaded_jobs(struct mg_server *server) {
+  struct mg_offload_job *jobs = NULL, *job, *next;
+  struct connection *conn;
+
+#ifndef _WIN32
+  pthread_mutex_lock(&server->offload_lock);
+#endif
+  // Last finished comes first, reverse to complete them in order
+  for (job = server->offloaded; job != NULL; job = next) {
+    next = job->next;
+    job->next = jobs;
+    jobs = job;
+  }
+  server->offloaded = NULL;
+#ifndef _WIN32
+  pthread_mutex_unlock(&server->offload_lock);
+#endif
+
+  for (job = jobs; job != NULL; job = next) {
+    next = job->next;
+    if ((conn = job->conn) == NULL) {
+      job->done(NULL, job->param);
+    } else {
+      // The request ends like one answered by the handler right away
+      conn->job = NULL;
+      conn->endpoint_type = EP_USER;
+      job->done(&conn->mg_conn, job->param);
+      if (conn->ns_conn->flags & MG_HEADERS_SENT) {
+        write_terminating_chunk(conn);
+      }
+      close_local_endpoint(conn);
+      ns_mark_dirty(conn->ns_conn);
+    }
+    free(job);
+  }
+}
+
 int mg_poll_server(struct mg_server *server, int milliseconds) {
-  return ns_server_poll(&server->ns_server, milliseconds);
+  int n = ns_server_poll(&server->ns_server, milliseconds);
+  finish_offloaded_jobs(server);
+  return n;
+}
+
+int mg_enable_io_uring(struct mg_server *server) {
+  return ns_server_enable_io_uring(&server->ns_server);
 }
 
 void mg_destroy_server(struct mg_server **server) {
@@ -4505,6 +6744,15 @@ void mg_destroy_server(struct mg_server **server) {
     int i;
 
     ns_server_free(&s->ns_server);
+#ifndef MONGOOSE_NO_FILESYSTEM
+    file_cache_free(s);
+#endif
+#ifndef MONGOOSE_NO_LOGGING
+    if (s->access_log != NULL) fclose(s->access_log);
+#endif
+#ifndef _WIN32
+    pthread_mutex_destroy(&s->offload_lock);
+#endif
     for (i = 0; i < (int) ARRAY_SIZE(s->config_options); i++) {
       free(s->config_options[i]);  // It is OK to free(NULL)
     }
@@ -4683,12 +6931,30 @@ const char *mg_set_option(struct mg_server *server, const char *name,
     *v = NULL;
   }
 
+#ifndef MONGOOSE_NO_FILESYSTEM
+  // Reallocated with the new size on next use
+  if (ind == FILE_CACHE_SIZE) file_cache_free(server);
+#endif
+#if !defined(MONGOOSE_NO_FILESYSTEM) && !defined(MONGOOSE_NO_LOGGING)
+  // Reopened with the new path on next request
+  if (ind == ACCESS_LOG_FILE && server->access_log != NULL) {
+    fclose(server->access_log);
+    server->access_log = NULL;
+  }
+#endif
+
   if (value == NULL || value[0] == '\0') return NULL;
 
   *v = mg_strdup(value);
   DBG(("%s [%s]", name, *v));
 
-  if (ind == LISTENING_PORT) {
+  if (ind == ACCEPT_BUDGET) {
+    if (atoi(value) > 0) {
+      server->ns_server.accept_budget = atoi(value);
+    } else {
+      error_msg = "Invalid accept budget";
+    }
+  } else if (ind == LISTENING_PORT) {
     int port = ns_bind(&server->ns_server, value);
     if (port < 0) {
       error_msg = "Cannot bind to port";
@@ -4731,16 +6997,29 @@ const char *mg_set_option(struct mg_server *server, const char *name,
   return error_msg;
 }
 
-static void set_ips(struct ns_connection *nc, int is_rem) {
-  struct connection *conn = (struct connection *) nc->connection_data;
-  struct mg_connection *c = &conn->mg_conn;
-  char buf[100];
+// Peer address is kept in binary form in ns_connection, and is converted
+// to a string only when asked for.
+const char *mg_remote_ip(struct mg_connection *c) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+  if (c->remote_ip[0] == '\0' && conn->ns_conn != NULL) {
+    ns_addr_to_str(&conn->ns_conn->sa, c->remote_ip, sizeof(c->remote_ip), 1);
+  }
+  return c->remote_ip;
+}
+
+const char *mg_local_ip(struct mg_connection *c) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+  union socket_address sa;
+  socklen_t len = sizeof(sa);
 
-  ns_sock_to_str(nc->sock, buf, sizeof(buf), is_rem ? 7 : 3);
-  sscanf(buf, "%47[^:]:%hu",
-         is_rem ? c->remote_ip : c->local_ip,
-         is_rem ? &c->remote_port : &c->local_port);
-  //DBG(("%p %s %s", conn, is_rem ? "rem" : "loc", buf));
+  if (c->local_ip[0] == '\0' && conn->ns_conn != NULL) {
+    memset(&sa, 0, sizeof(sa));
+    if (getsockname(conn->ns_conn->sock, &sa.sa, &len) == 0) {
+      ns_addr_to_str(&sa, c->local_ip, sizeof(c->local_ip), 1);
+      c->local_port = ntohs(sa.sin.sin_port);
+    }
+  }
+  return c->local_ip;
 }
 
 static void on_accept(struct ns_connection *nc, union socket_address *sa) {
@@ -4759,9 +7038,42 @@ static void on_accept(struct ns_connection *nc, union socket_address *sa) {
     // Initialize the rest of connection attributes
     conn->server = server;
     conn->mg_conn.server_param = nc->server->server_data;
-    set_ips(nc, 1);
-    set_ips(nc, 0);
+    conn->mg_conn.remote_port = ntohs(sa->sin.sin_port);
+
+    // Copy server id
+    conn->server_id = server->server_id;
+    nc->server_id = server->server_id;
+    conn->mg_conn.server_id = server->server_id;
+
+    schedule_timer(nc, nc->last_io_time);
+  }
+}
+
+static void on_timer(struct ns_connection *nc, time_t now) {
+  struct connection *conn = (struct connection *) nc->connection_data;
+
+  if (conn != NULL && conn->ns_conn != nc) conn = NULL;  // CGI or proxy
+
+  if (nc->last_io_time + MONGOOSE_IDLE_TIMEOUT_SECONDS < now) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return;
+  }
+
+  if (conn != NULL && conn->request_deadline != 0 &&
+      conn->request_deadline <= now) {
+    // Client is too slow to send the headers, do not hold the connection
+    conn->request_deadline = 0;
+    iobuf_remove(&nc->recv_iobuf, nc->recv_iobuf.len);
+    ns_printf(nc, "HTTP/1.1 408 %s\r\nContent-Length: 0\r\n"
+              "Connection: close\r\n\r\n", status_code_to_str(408));
+    nc->flags |= NSF_FINISHED_SENDING_DATA;
+  }
+
+  if (conn != NULL && conn->mg_conn.is_websocket) {
+    ping_idle_websocket_connection(conn, now);
   }
+
+  schedule_timer(nc, now);
 }
 
 #ifndef MONGOOSE_NO_FILESYSTEM
@@ -4769,19 +7081,34 @@ static void hexdump(struct ns_connection *nc, const char *path,
                     int num_bytes, int is_sent) {
   struct connection *mc = (struct connection *) nc->connection_data;
   const struct iobuf *io = is_sent ? &nc->send_iobuf : &nc->recv_iobuf;
+  const char *data = io->buf + (is_sent ? 0 : io->len) -
+    (is_sent ? 0 : num_bytes);
+  int data_len = num_bytes;
   FILE *fp;
   char *buf;
   int buf_size = num_bytes * 5 + 100;
 
+  // Only the first piece of sent data is dumped
+  if (is_sent && nc->send_chain != NULL) {
+    data = nc->send_chain->data;
+    if (data == NULL) {
+      data_len = 0;  // File sent by the kernel
+    } else if ((size_t) data_len > nc->send_chain->len) {
+      data_len = (int) nc->send_chain->len;
+    }
+  } else if (is_sent && (size_t) data_len > io->len) {
+    data_len = (int) io->len;
+  }
+
   if (path != NULL && (fp = fopen(path, "a")) != NULL) {
+    mg_local_ip(&mc->mg_conn);  // Fills in local_port, too
     fprintf(fp, "%lu %p %s:%d %s %s:%d %d\n", (unsigned long) time(NULL),
             mc, mc->mg_conn.local_ip, mc->mg_conn.local_port,
             is_sent == 0 ? "<-" : is_sent == 1 ? "->" :
             is_sent == 2 ? "<A" : "C>",
-            mc->mg_conn.remote_ip, mc->mg_conn.remote_port, num_bytes);
-    if (num_bytes > 0 && (buf = (char *) malloc(buf_size)) != NULL) {
-      ns_hexdump(io->buf + (is_sent ? 0 : io->len) - (is_sent ? 0 : num_bytes),
-                 num_bytes, buf, buf_size);
+            mg_remote_ip(&mc->mg_conn), mc->mg_conn.remote_port, num_bytes);
+    if (data_len > 0 && (buf = (char *) malloc(buf_size)) != NULL) {
+      ns_hexdump(data, data_len, buf, buf_size);
       fprintf(fp, "%s", buf);
       free(buf);
     }
@@ -4820,8 +7147,7 @@ static void mg_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
       break;
 
     case NS_CONNECT:
-      set_ips(nc, 1);
-      set_ips(nc, 0);
+      conn->mg_conn.remote_port = ntohs(nc->sa.sin.sin_port);
 #ifndef MONGOOSE_NO_FILESYSTEM
       hexdump(nc, server->config_options[HEXDUMP_FILE], 0, 3);
 #endif
@@ -4858,7 +7184,7 @@ static void mg_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
 #endif
       if (conn != NULL && conn->mg_conn.connection_param != NULL &&
           conn->endpoint_type == EP_PROXY &&
-          nc->send_iobuf.len <= (size_t)  * (int * ) p) {
+          ns_send_pending(nc) <= (size_t)  * (int * ) p) {
         // All clear-text data has been sent to the client, switch to SSL
 #ifdef NS_ENABLE_SSL
         DBG(("%p %p: setting ssl", conn, conn->ns_conn));
@@ -4874,9 +7200,10 @@ static void mg_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
         DBG(("%p %p closing cgi/proxy conn", conn, nc));
         if (conn && conn->ns_conn) {
           conn->ns_conn->flags &= ~NSF_BUFFER_BUT_DONT_SEND;
-          conn->ns_conn->flags |= conn->ns_conn->send_iobuf.len > 0 ?
+          conn->ns_conn->flags |= ns_send_pending(conn->ns_conn) > 0 ?
             NSF_FINISHED_SENDING_DATA : NSF_CLOSE_IMMEDIATELY;
           conn->endpoint.nc = NULL;
+          ns_mark_dirty(conn->ns_conn);
         }
       } else if (conn != NULL) {
         DBG(("%p %p %d closing", conn, nc, conn->endpoint_type));
@@ -4886,13 +7213,31 @@ static void mg_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
         }
 
         call_user(conn, MG_CLOSE);
+        iobuf_remove(&nc->recv_iobuf, nc->recv_iobuf.len);  // Not served
         close_local_endpoint(conn);
+        if (conn->job != NULL) conn->job->conn = NULL;  // done() gets NULL
+        iobuf_free(&conn->spare);
+        free(conn->mg_conn.http_headers);
         conn->ns_conn = NULL;
         free(conn);
       }
       break;
 
+    case NS_FILE_READ:
+      if (conn != NULL && conn->endpoint_type == EP_FILE) {
+        on_file_data(conn, * (int *) p);
+      }
+      break;
+
     case NS_POLL:
+      // Requests left over by the pipeline budget
+      if (conn != NULL && conn->endpoint_type == EP_NONE &&
+          (nc->flags & NSF_ACCEPTED)) {
+        nc->flags &= ~NSF_WANT_POLL;
+        on_recv_data(conn);
+        break;
+      }
+
       if (call_user(conn, MG_POLL) == MG_TRUE) {
         nc->flags |= NSF_FINISHED_SENDING_DATA;
       }
@@ -4900,20 +7245,10 @@ static void mg_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
       if (conn != NULL && conn->endpoint_type == EP_FILE) {
         transfer_file_data(conn);
       }
+      break;
 
-      // Expire idle connections
-      {
-        time_t current_time = * (time_t *) p;
-
-        if (conn != NULL && conn->mg_conn.is_websocket) {
-          ping_idle_websocket_connection(conn, current_time);
-        }
-
-        if (nc->last_io_time + MONGOOSE_IDLE_TIMEOUT_SECONDS < current_time) {
-          mg_ev_handler(nc, NS_CLOSE, NULL);
-          nc->flags |= NSF_CLOSE_IMMEDIATELY;
-        }
-      }
+    case NS_TIMER:
+      on_timer(nc, * (time_t *) p);
       break;
 
     default:
@@ -4960,6 +7295,7 @@ void mg_set_listening_socket(struct mg_server *server, int sock) {
     closesocket(server->ns_server.listening_sock);
   }
   server->ns_server.listening_sock = (sock_t) sock;
+  ns_listening_sock_changed(&server->ns_server);
 }
 
 int mg_get_listening_socket(struct mg_server *server) {
@@ -4974,9 +7310,14 @@ const char *mg_get_option(const struct mg_server *server, const char *name) {
 
 struct mg_server *mg_create_server(void *server_data, mg_handler_t handler, int* server_id) {
   struct mg_server *server = (struct mg_server *) calloc(1, sizeof(*server));
+  init_http_scanners();
+  init_header_ids();
   ns_server_init(&server->ns_server, server_data, mg_ev_handler);
   set_default_option_values(server->config_options);
   server->event_handler = handler;
+#ifndef _WIN32
+  pthread_mutex_init(&server->offload_lock, NULL);
+#endif
 
   // Record server id
   // @author Thomas Lextrait
@@ -24,11 +24,30 @@
 
 #include <stdio.h>      // required for FILE
 #include <stddef.h>     // required for size_t
+#include <time.h>       // required for time_t
 
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
+// Well-known headers, indexed when a request is parsed, see
+// mg_get_known_header()
+enum mg_header_id {
+  MG_HEADER_ACCEPT, MG_HEADER_ACCEPT_ENCODING, MG_HEADER_AUTHORIZATION,
+  MG_HEADER_CONNECTION, MG_HEADER_CONTENT_LENGTH, MG_HEADER_CONTENT_RANGE,
+  MG_HEADER_CONTENT_TYPE, MG_HEADER_COOKIE, MG_HEADER_EXPECT, MG_HEADER_HOST,
+  MG_HEADER_IF_MODIFIED_SINCE, MG_HEADER_IF_NONE_MATCH, MG_HEADER_IF_RANGE,
+  MG_HEADER_RANGE, MG_HEADER_REFERER, MG_HEADER_SEC_WEBSOCKET_KEY,
+  MG_HEADER_SEC_WEBSOCKET_VERSION, MG_HEADER_UPGRADE, MG_HEADER_USER_AGENT,
+  MG_NUM_KNOWN_HEADERS
+};
+
+struct mg_header {
+  const char *name;           // HTTP header name
+  const char *value;          // HTTP header value
+  unsigned int hash;          // Of the case-folded name
+};
+
 // This structure contains information about HTTP request.
 struct mg_connection {
   const char *request_method; // "GET", "POST", etc
@@ -36,16 +55,14 @@ struct mg_connection {
   const char *http_version;   // E.g. "1.0", "1.1"
   const char *query_string;   // URL part after '?', not including '?', or NULL
 
-  char remote_ip[48];         // Max IPv6 string length is 45 characters
-  char local_ip[48];          // Local IP address
+  char remote_ip[48];         // Filled in by mg_remote_ip()
+  char local_ip[48];          // Filled in by mg_local_ip()
   unsigned short remote_port; // Client's port
-  unsigned short local_port;  // Local port number
+  unsigned short local_port;  // Local port number, set by mg_local_ip()
 
   int num_headers;            // Number of HTTP headers
-  struct mg_header {
-    const char *name;         // HTTP header name
-    const char *value;        // HTTP header value
-  } http_headers[30];
+  struct mg_header *http_headers;  // Up to "max_request_headers" of them
+  unsigned short header_index[MG_NUM_KNOWN_HEADERS];  // Position + 1, or 0
 
   char *content;              // POST (or websocket message) data, or NULL
   size_t content_len;         // Data length
@@ -61,6 +78,7 @@ struct mg_connection {
 };
 
 struct mg_server; // Opaque structure describing server instance
+struct mg_shared_buf; // Opaque data shared by connections, see mg_write_shared
 enum mg_result { MG_FALSE, MG_TRUE, MG_MORE };
 enum mg_event {
   MG_POLL = 100,  // Callback return value is ignored
@@ -89,6 +107,7 @@ struct mg_server *mg_create_server(void *server_param, mg_handler_t handler, int
 void mg_destroy_server(struct mg_server **);
 const char *mg_set_option(struct mg_server *, const char *opt, const char *val);
 int mg_poll_server(struct mg_server *, int milliseconds);
+int mg_enable_io_uring(struct mg_server *);
 const char **mg_get_valid_option_names(void);
 const char *mg_get_option(const struct mg_server *server, const char *name);
 void mg_set_listening_socket(struct mg_server *, int sock);
@@ -96,9 +115,19 @@ int mg_get_listening_socket(struct mg_server *);
 void mg_iterate_over_connections(struct mg_server *, mg_handler_t, void *);
 void mg_wakeup_server(struct mg_server *);
 void mg_wakeup_server_ex(struct mg_server *, mg_handler_t, const char *, ...);
+
+// Runs work(param) on an offload thread, then done(conn, param) on the
+// connection's event loop, where the request ends once done() returns.
+// The request handler returns MG_MORE meanwhile. done() gets a NULL
+// connection if it was closed, to free param. Returns 0 on failure.
+int mg_offload(struct mg_connection *, void (*work)(void *),
+               void (*done)(struct mg_connection *, void *), void *param);
 struct mg_connection *mg_connect(struct mg_server *, const char *, int, int);
 
 // Connection management functions
+const char *mg_remote_ip(struct mg_connection *);
+const char *mg_local_ip(struct mg_connection *);
+int mg_should_keep_alive(const struct mg_connection *);
 void mg_send_status(struct mg_connection *, int status_code);
 void mg_send_header(struct mg_connection *, const char *name, const char *val);
 void mg_send_data(struct mg_connection *, const void *data, int data_len);
@@ -113,7 +142,32 @@ int mg_websocket_printf(struct mg_connection* conn, int opcode,
 int mg_write(struct mg_connection *, const void *buf, int len);
 int mg_printf(struct mg_connection *conn, const char *fmt, ...);
 
+// Reference-counted data sent by many connections without being copied.
+// free_fn(data) is called, if not NULL, when the last reference is gone.
+struct mg_shared_buf *mg_shared_buf_new(const void *data, size_t len,
+                                        void (*free_fn)(void *));
+// Maps len bytes of file fd read-only. The pages stay in the page cache,
+// shared with every process mapping the file. Returns NULL if unsupported.
+enum { MG_MAP_WILLNEED = 1, MG_MAP_HUGEPAGE = 2 };
+struct mg_shared_buf *mg_shared_buf_map(int fd, size_t len, int flags);
+const void *mg_shared_buf_data(const struct mg_shared_buf *);
+void mg_shared_buf_ref(struct mg_shared_buf *);
+void mg_shared_buf_unref(struct mg_shared_buf *);
+int mg_write_shared(struct mg_connection *, struct mg_shared_buf *,
+                    size_t offset, size_t len);
+
+// Sends len bytes of file fd from offset, then closes fd. On plain
+// connections the kernel copies the file to the socket with sendfile().
+int mg_write_file(struct mg_connection *, int fd, size_t offset, size_t len);
+
 const char *mg_get_header(const struct mg_connection *, const char *name);
+const char *mg_get_known_header(const struct mg_connection *,
+                                enum mg_header_id);
+
+// Returns true if the request's If-None-Match or If-Modified-Since header
+// allows a 304 Not Modified reply. last_modified is 0 if unknown.
+int mg_is_not_modified(const struct mg_connection *, const char *etag,
+                       time_t last_modified);
 const char *mg_get_mime_type(const char *name, const char *default_mime_type);
 int mg_get_var(const struct mg_connection *conn, const char *var_name,
                char *buf, size_t buf_len);
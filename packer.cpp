@@ -0,0 +1,290 @@
+/**
+* SWIFT
+* Copyright (c) 2014 Thomas Lextrait <thomas.lextrait@gmail.com>
+* All rights reserved
+*/
+
+/**
+* Asset packer: bundles a directory of resources into a single pack that
+* Server::mountPack() serves from one mapping. Each entry holds its MIME
+* type, an ETag hashed from its body and, when it compresses well, a gzip
+* variant. Bodies start on page boundaries.
+*
+* With --embed, writes a header of constexpr arrays instead, to compile the
+* resources into a binary and serve them with Server::addEmbeddedResources().
+*
+* Usage: packer <resource directory> <pack file>
+*        packer --embed <resource directory> <header file>
+*/
+
+#include <dirent.h>
+#include <zlib.h>
+
+#include "swift.h"
+
+using namespace swift;
+
+// Packed file, read in memory
+struct PackFile {
+	std::string path;			// Inside the packed directory
+	std::string mime;
+	std::string etag;
+	time_t mtime;
+	std::string body;
+	std::string gzip_body;		// Empty if it doesn't compress well
+};
+
+/**
+* Lists the regular files of a directory tree, hidden files excepted
+* @param directory path
+* @param path inside the packed directory
+* @param file paths found
+*/
+void listFiles(std::string dir, std::string sub_path, std::vector<std::string>& paths){
+	DIR* d = opendir((dir + "/" + sub_path).c_str());
+	if(d == NULL) return;
+
+	struct dirent* entry;
+	while((entry = readdir(d)) != NULL){
+		if(entry->d_name[0] == '.') continue;
+
+		std::string path = sub_path.empty() ? entry->d_name : sub_path + "/" + entry->d_name;
+		struct stat results;
+		if(stat((dir + "/" + path).c_str(), &results) != 0) continue;
+
+		if(S_ISDIR(results.st_mode)){
+			listFiles(dir, path, paths);
+		}else if(S_ISREG(results.st_mode)){
+			paths.push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+/**
+* Compresses a body in gzip format
+* @param body
+* @return compressed body, empty on failure
+*/
+std::string gzipBody(std::string& body){
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK){
+		return "";
+	}
+
+	std::string out(deflateBound(&zs, body.size()), '\0');
+	zs.next_in = (Bytef*) body.data();
+	zs.avail_in = body.size();
+	zs.next_out = (Bytef*) &out[0];
+	zs.avail_out = out.size();
+
+	int ret = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	return ret == Z_STREAM_END ? out : "";
+}
+
+/**
+* Pads the pack with zeros up to the next page boundary
+* @param pack stream
+* @return aligned offset
+*/
+uint64_t align(std::ofstream& pack){
+	uint64_t offset = pack.tellp();
+	uint64_t aligned = (offset + _SWIFT_PACK_ALIGN - 1) / _SWIFT_PACK_ALIGN * _SWIFT_PACK_ALIGN;
+	std::string padding(aligned - offset, '\0');
+	pack.write(padding.data(), padding.size());
+	return aligned;
+}
+
+/**
+* Reads every file of a directory tree, hashes it and compresses it
+* @param directory path
+* @param compress the files
+* @param files read
+*/
+void readFiles(std::string dir, bool compress, std::vector<PackFile>& files){
+	std::vector<std::string> paths;
+	listFiles(dir, "", paths);
+	std::sort(paths.begin(), paths.end());
+
+	for(size_t i = 0; i < paths.size(); i++){
+		PackFile file;
+		file.path = paths[i];
+
+		std::ifstream in((dir + "/" + file.path).c_str(), std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		file.body = ss.str();
+
+		struct stat results;
+		stat((dir + "/" + file.path).c_str(), &results);
+		file.mtime = results.st_mtime;
+
+		try{
+			file.mime = getMIMEByFilename(file.path);
+		}catch(std::exception& e){
+			file.mime = "";
+		}
+		file.etag = contentETag(file.body.data(), file.body.size());
+
+		// Only kept if it saves at least a tenth of the body
+		if(compress){
+			file.gzip_body = gzipBody(file.body);
+			if(file.gzip_body.size() * 10 > file.body.size() * 9){
+				file.gzip_body.clear();
+			}
+		}
+
+		files.push_back(file);
+	}
+}
+
+/**
+* Escapes a string for a C++ string literal
+* @param string
+* @return quoted literal
+*/
+std::string literal(std::string str){
+	std::string out = "\"";
+	for(size_t i = 0; i < str.size(); i++){
+		if(str[i] == '"' || str[i] == '\\') out += '\\';
+		out += str[i];
+	}
+	return out + "\"";
+}
+
+/**
+* Writes the files as constexpr byte arrays and an EmbeddedResource table
+* @param files
+* @param header file path
+* @return false if the header couldn't be written
+*/
+bool writeEmbedded(std::vector<PackFile>& files, std::string header_path){
+	std::ofstream out(header_path.c_str(), std::ios::trunc);
+	if(!out) return false;
+
+	out << "// Generated by packer --embed, do not edit" << std::endl;
+	out << "// server->addEmbeddedResources(\"/\", swift_embedded::resources, swift_embedded::count);" << std::endl;
+	out << std::endl;
+	out << "#include \"swift.h\"" << std::endl;
+	out << std::endl;
+	out << "namespace swift_embedded {" << std::endl;
+
+	char hex[8];
+	for(size_t i = 0; i < files.size(); i++){
+		out << std::endl << "\t// " << files[i].path << std::endl;
+		out << "\tconstexpr unsigned char data_" << i << "[] = {";
+		for(size_t j = 0; j < files[i].body.size(); j++){
+			if(j % 16 == 0) out << std::endl << "\t\t";
+			snprintf(hex, sizeof(hex), "0x%02x,", (unsigned char) files[i].body[j]);
+			out << hex;
+		}
+		// Empty files still need an element
+		if(files[i].body.empty()) out << "0";
+		out << std::endl << "\t};" << std::endl;
+	}
+
+	out << std::endl << "\tconstexpr swift::EmbeddedResource resources[] = {" << std::endl;
+	for(size_t i = 0; i < files.size(); i++){
+		out << "\t\t{" << literal(files[i].path) << ", " << literal(files[i].mime) << ", " << literal(files[i].etag) << ", "
+			<< (long long) files[i].mtime << ", data_" << i << ", " << files[i].body.size() << "}," << std::endl;
+	}
+	if(files.empty()) out << "\t\t{\"\", \"\", \"\", 0, nullptr, 0}" << std::endl;
+	out << "\t};" << std::endl;
+	out << std::endl << "\tconstexpr size_t count = " << files.size() << ";" << std::endl;
+	out << std::endl << "}" << std::endl;
+
+	out.close();
+	return !out.fail();
+}
+
+int main(int argc, char** argv){
+	bool embed = argc == 4 && strcmp(argv[1], "--embed") == 0;
+	if(argc != 3 && !embed){
+		std::cout << "Usage: " << argv[0] << " <resource directory> <pack file>" << std::endl;
+		std::cout << "       " << argv[0] << " --embed <resource directory> <header file>" << std::endl;
+		return 1;
+	}
+
+	std::string dir = argv[embed ? 2 : 1];
+	std::string out_path = argv[embed ? 3 : 2];
+	loadMIME("mime.types");
+
+	std::vector<PackFile> files;
+	readFiles(dir, !embed, files);
+
+	if(embed){
+		if(!writeEmbedded(files, out_path)){
+			std::cout << "Couldn't write '" << out_path << "'" << std::endl;
+			return 1;
+		}
+		std::cout << "Embedded " << files.size() << " files into '" << out_path << "'" << std::endl;
+		return 0;
+	}
+
+	// String table
+	std::string strings;
+	std::vector<PackEntry> entries(files.size());
+	for(size_t i = 0; i < files.size(); i++){
+		memset(&entries[i], 0, sizeof(PackEntry));
+		entries[i].path_offset = strings.size();
+		entries[i].path_len = files[i].path.size();
+		strings += files[i].path;
+		entries[i].mime_offset = strings.size();
+		entries[i].mime_len = files[i].mime.size();
+		strings += files[i].mime;
+		entries[i].etag_offset = strings.size();
+		entries[i].etag_len = files[i].etag.size();
+		strings += files[i].etag;
+		entries[i].mtime = files[i].mtime;
+	}
+
+	PackHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, _SWIFT_PACK_MAGIC, sizeof(header.magic));
+	header.count = files.size();
+	header.strings_size = strings.size();
+
+	std::ofstream pack(out_path.c_str(), std::ios::binary | std::ios::trunc);
+	if(!pack){
+		std::cout << "Couldn't write '" << out_path << "'" << std::endl;
+		return 1;
+	}
+
+	// Bodies first, the index is written over the reserved space afterwards
+	size_t index_size = sizeof(header) + entries.size() * sizeof(PackEntry) + strings.size();
+	std::string reserved(index_size, '\0');
+	pack.write(reserved.data(), reserved.size());
+
+	uint64_t total = 0, gzip_total = 0;
+	for(size_t i = 0; i < files.size(); i++){
+		entries[i].body.offset = align(pack);
+		entries[i].body.size = files[i].body.size();
+		pack.write(files[i].body.data(), files[i].body.size());
+		total += files[i].body.size();
+
+		if(!files[i].gzip_body.empty()){
+			entries[i].gzip_body.offset = align(pack);
+			entries[i].gzip_body.size = files[i].gzip_body.size();
+			pack.write(files[i].gzip_body.data(), files[i].gzip_body.size());
+			gzip_total += files[i].gzip_body.size();
+		}
+	}
+
+	pack.seekp(0);
+	pack.write((const char*) &header, sizeof(header));
+	if(!entries.empty()) pack.write((const char*) &entries[0], entries.size() * sizeof(PackEntry));
+	pack.write(strings.data(), strings.size());
+	pack.close();
+
+	if(!pack){
+		std::cout << "Couldn't write '" << out_path << "'" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Packed " << files.size() << " files (" << total << " bytes, " << gzip_total << " bytes gzip) into '" << out_path << "'" << std::endl;
+	return 0;
+}
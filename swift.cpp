@@ -40,17 +40,42 @@ namespace swift{
 	* Swift constructor
 	*/
 	Server::Server(){
+		mgserver = NULL;
+		accept_budget = 0;
+		pipeline_budget = 0;
+		file_cache_size = -1;
+		file_cache_ttl = -1;
+		max_request_headers = 0;
+
 		// Settings
 		max_cache_size = _SWIFT_DEFAULT_CACHE_SIZE;
+		cache.setMaxSize(max_cache_size);
 		verbose = true;
+		io_uring = false;
+		huge_pages = false;
+		watch_resources = true;
+		fingerprint_resources = false;
+		inotify_fd = -1;
 	}
 
 	/**
 	* Swift destructor
 	*/
 	Server::~Server(){
-		// destroy the mongoose server
+		// destroy the mongoose servers
 		mg_destroy_server(&mgserver);
+		for(size_t i = 0; i < reactors.size(); i++){
+			mg_destroy_server(&reactors[i]);
+		}
+
+		// Responses still sending packed resources hold their own references
+		for(std::map<std::string, PackedResource>::iterator it = packed.begin(); it != packed.end(); ++it){
+			ResourceCache::release(it->second.identity);
+			if(it->second.gzip.content != NULL) ResourceCache::release(it->second.gzip);
+		}
+		for(size_t i = 0; i < packs.size(); i++){
+			mg_shared_buf_unref(packs[i]);
+		}
 	}
 
 	/**
@@ -74,32 +99,232 @@ namespace swift{
 	* @param port
 	*/
 	void Server::Start(int port){
+		Start(port, 1);
+	}
+
+	/**
+	* Starts the server on given port with one event loop per thread. The
+	* event loops share the listening socket and the API hooks, so hooks
+	* must not be added once the server is started.
+	* @param port
+	* @param num_threads number of event loops
+	*/
+	void Server::Start(int port, int num_threads){
 
 		// Load MIME types
 		if(mimetypes.size() == 0){
 			loadMIME("mime.types");
 		}
 
+		// Preloaded resources are in memory before the first request
+		for(std::map<std::string,Hook*>::iterator it = endpoints.begin(); it != endpoints.end(); ++it){
+			Hook* hook = it->second;
+			if(hook->isResource() && hook->isPreloadResource()){
+				preloadResource(hook);
+			}
+			if(hook->isResource() && fingerprint_resources){
+				fingerprintResource(hook);
+			}
+		}
+
+		// Resources changed on disk are dropped from the cache as they change
+		if(watch_resources && startWatching()){
+			mg_start_thread(watchResources, this);
+		}
+
+		if(num_threads < 1) num_threads = 1;
+		if(num_threads > _SWIFT_MAX_SERVER_THREADS) num_threads = _SWIFT_MAX_SERVER_THREADS;
+
 		// Convert the port to string (for mongoose)
 		char str_port[10];
 		sprintf(str_port, "%d", port);
 
 		// Create a Mongoose server
-		int server_id = -1;
-		mgserver = mg_create_server(NULL, this->requestHandler, &server_id);
-		
-		// Keep track of server globally
-		addServer(this, server_id);
+		mgserver = createReactor();
 
 		// Set the port
 		mg_set_option(mgserver, "listening_port", str_port);
 
+		// Other event loops accept from their own copy of the listening socket
+		for(int i = 1; i < num_threads; i++){
+			struct mg_server* reactor = createReactor();
+			mg_set_listening_socket(reactor, dup(mg_get_listening_socket(mgserver)));
+			reactors.push_back(reactor);
+		}
+
+		// Use io_uring if enabled and the kernel supports it, otherwise poll
+		bool uring_enabled = io_uring && mg_enable_io_uring(mgserver);
+		for(size_t i = 0; i < reactors.size(); i++){
+			if(io_uring) mg_enable_io_uring(reactors[i]);
+		}
+
 		// Display info
 		printWelcome();
 		std::cout << "Listening on port " << mg_get_option(mgserver, "listening_port") << "..." << std::endl;
+		if(verbose) std::cout << "I/O engine: " << (uring_enabled ? "io_uring" : "poll") << ", " << num_threads << " thread(s)" << std::endl;
+		if(verbose && inotify_fd >= 0) std::cout << "Watching " << watched_dirs.size() << " resource directories for changes" << std::endl;
+
+		// All servers are registered, it is now safe to start polling
+		for(size_t i = 0; i < reactors.size(); i++){
+			mg_start_thread(pollReactor, reactors[i]);
+		}
+		pollReactor(mgserver);
+	}
+
+	/**
+	* Creates a Mongoose server and keeps track of it globally
+	* @return mongoose server
+	*/
+	struct mg_server* Server::createReactor(){
+		int server_id = -1;
+		struct mg_server* reactor = mg_create_server(NULL, this->requestHandler, &server_id);
+		addServer(this, server_id);
+
+		if(accept_budget > 0){
+			char str_budget[12];
+			sprintf(str_budget, "%d", accept_budget);
+			mg_set_option(reactor, "accept_budget", str_budget);
+		}
+
+		if(pipeline_budget > 0){
+			char str_budget[12];
+			sprintf(str_budget, "%d", pipeline_budget);
+			mg_set_option(reactor, "pipeline_budget", str_budget);
+		}
+
+		if(!document_root.empty()){
+			mg_set_option(reactor, "document_root", document_root.c_str());
+		}
+
+		// Each event loop caches the stat results and descriptors of its files
+		char str_value[12];
+		if(file_cache_size >= 0){
+			sprintf(str_value, "%d", file_cache_size);
+			mg_set_option(reactor, "file_cache_size", str_value);
+		}
+		if(file_cache_ttl >= 0){
+			sprintf(str_value, "%d", file_cache_ttl);
+			mg_set_option(reactor, "file_cache_ttl", str_value);
+		}
+
+		if(max_request_headers > 0){
+			sprintf(str_value, "%d", max_request_headers);
+			mg_set_option(reactor, "max_request_headers", str_value);
+		}
+		return reactor;
+	}
+
+	/**
+	* Event loop of a single Mongoose server
+	* @param mongoose server
+	*/
+	void* Server::pollReactor(void* reactor){
+		for(;;){
+			// Sleep until there is I/O or a connection timer expires
+		    mg_poll_server((struct mg_server*) reactor, -1);
+		}
+		return NULL;
+	}
+
+	/**
+	* Watches the directories of the server's resources with inotify
+	* @return false if changes can't be watched
+	*/
+	bool Server::startWatching(){
+#ifdef __linux__
+		if((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) return false;
+
+		std::map<std::string, int> dirs;
+		for(std::map<std::string,Hook*>::iterator it = endpoints.begin(); it != endpoints.end(); ++it){
+			if(!it->second->isResource()) continue;
+
+			// Directories are watched rather than files, to see files replaced by rename
+			std::string file_path = it->second->getResourcePath();
+			size_t slash = file_path.rfind('/');
+			std::string prefix = slash == std::string::npos ? "" : file_path.substr(0, slash + 1);
+			if(dirs.count(prefix) > 0) continue;
+
+			int wd = inotify_add_watch(inotify_fd, prefix.empty() ? "." : prefix.c_str(),
+				IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+			if(wd < 0){
+				std::cout << "Couldn't watch resource directory '" << prefix << "'" << std::endl;
+				continue;
+			}
+			dirs[prefix] = wd;
+			watched_dirs[wd] = prefix;
+		}
+
+		if(watched_dirs.empty()){
+			close(inotify_fd);
+			inotify_fd = -1;
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	* Reads resource change notifications until the process exits
+	* @param swift server
+	*/
+	void* Server::watchResources(void* server){
+#ifdef __linux__
+		Server* self = (Server*) server;
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
 		for(;;){
-		    mg_poll_server(mgserver, 1000);
+			ssize_t len = read(self->inotify_fd, buf, sizeof(buf));
+			if(len <= 0){
+				if(len < 0 && errno == EINTR) continue;
+				break;
+			}
+
+			for(char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len){
+				struct inotify_event* event = (struct inotify_event*) p;
+				std::map<int, std::string>::iterator it = self->watched_dirs.find(event->wd);
+				if(it == self->watched_dirs.end() || event->len == 0) continue;
+
+				// Files being written are dropped, and preloaded again once complete
+				bool reload = (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)) != 0;
+				self->resourceChanged(it->second + event->name, reload);
+			}
+		}
+#endif
+		return NULL;
+	}
+
+	/**
+	* Drops a changed resource from the cache, and preloads it again
+	* @param file path, as given to the resource hooks
+	* @param preload the resource again if its hook preloads it
+	*/
+	void Server::resourceChanged(std::string file_path, bool reload){
+		Hook* hook = nullptr;
+		for(std::map<std::string,Hook*>::iterator it = endpoints.begin(); it != endpoints.end(); ++it){
+			if(it->second->isResource() && it->second->getResourcePath() == file_path){
+				hook = it->second;
+				if(hook->isPreloadResource()) break;
+			}
+		}
+		if(hook == nullptr) return;
+
+		if(verbose) std::cout << "Resource changed: '" << file_path << "'" << std::endl;
+		cache.invalidate(file_path);
+
+		if(!reload || access(file_path.c_str(), R_OK) != 0) return;
+		if(hook->isPreloadResource()){
+			preloadResource(hook);
+		}
+
+		// New content gets a new alias, the previous one keeps the previous content
+		if(fingerprint_resources){
+			for(std::map<std::string,Hook*>::iterator it = endpoints.begin(); it != endpoints.end(); ++it){
+				if(it->second->isResource() && it->second->getResourcePath() == file_path){
+					fingerprintResource(it->second);
+				}
+			}
 		}
 	}
 
@@ -156,16 +381,19 @@ namespace swift{
 
 		if(ev == MG_REQUEST){
 
-			// Build Swift Request
-			Request* req = new Request(conn);
-
-			// Show we received a request
-			std::cout << _SWIFT_SYMB_REQ << " " << req->getURI() << " from " << req->getRemoteIP() << std::endl;
+			// Static resources are sent without building any objects
+			Server* server = Server::getServer(conn->server_id);
+			if(server != nullptr && (result = server->serveStatic(conn)) != MG_FALSE){
+				return result;
+			}
 
-			// Process it
-			Server::processRequest(req, conn);
+			// Build Swift Request, a view of the connection
+			Request req(conn);
 
-			result = MG_MORE;
+			// Process it, Mongoose completes the response once it's sent
+			if(Server::processRequest(&req, conn)){
+				result = MG_TRUE;
+			}
 
 		}else if(ev == MG_AUTH){
 			result = MG_TRUE;
@@ -178,17 +406,24 @@ namespace swift{
 	* Processes given request
 	* @param request object
 	* @param mongoose connection object
+	* @return true if a response was sent
 	*/
-	void Server::processRequest(Request* req, struct mg_connection *conn){
+	bool Server::processRequest(Request* req, struct mg_connection *conn){
 		// Static
 
+		bool sent = false;
+
 		// Check that we're tracking this server
 		int server_id = conn->server_id;
 
 		if(Server::hasServer(server_id)){
 			Server* server = Server::getServer(server_id);
 
-			if(server->verbose) std::cout << "Got request from server #" << conn->server_id << std::endl;
+			// Show we received a request
+			if(server->verbose){
+				std::cout << _SWIFT_SYMB_REQ << " " << req->getURI() << " from " << req->getRemoteIP() << std::endl;
+				std::cout << "Got request from server #" << conn->server_id << std::endl;
+			}
 
 			if(server->hasEndpointWithPath(req->getURI())){
 
@@ -197,20 +432,26 @@ namespace swift{
 				// Check rules
 				if(hook->isMethodAllowed(req->getMethod())){
 
-					Response* resp;
+					// Process the attached callback, static resources were served already
+					if(server->verbose) std::cout << "Serving dynamic callback" << std::endl;
+					Response* resp = hook->getCallbackResponse(req);
 
-					if(hook->isResource()){
-						// Just serve the static resource to the client
-						if(server->verbose) std::cout << "Serving static resource" << std::endl;
-						resp = server->serveResource(hook->getResourcePath());
-					}else{
-						// Process the attached callback
-						if(server->verbose) std::cout << "Serving dynamic callback" << std::endl;
-						resp = hook->getCallbackResponse(req);
+					if(!resp->hasHeader("Cache-Control")){
+						resp->addHeader("Cache-Control", hook->getCacheControl());
+					}
+
+					// Identical bodies get the same ETag, so repeat visitors only get a 304
+					bool not_modified = false;
+					if(hook->isAutoETag() && !resp->hasHeader("ETag") && resp->getContentFile() < 0){
+						std::string etag = contentETag(resp->getContent(), resp->getContentLen());
+						resp->addHeader("ETag", etag);
+						not_modified = mg_is_not_modified(conn, etag.c_str(), 0);
 					}
 
 					// Send response to client
-					server->sendResponse(resp, conn);
+					server->sendResponse(resp, conn, not_modified);
+					delete resp;
+					sent = true;
 
 				}else{
 					if(server->verbose) std::cout << "(403) Forbidden" << std::endl;
@@ -229,6 +470,7 @@ namespace swift{
 			std::cout << "Server not found #" << server_id << std::endl;
 		}
 
+		return sent;
 	}
 
 	/* ======================================================== */
@@ -251,9 +493,21 @@ namespace swift{
 	* @param preload the resource
 	*/
 	void Server::addResource(std::string request_path, std::string file_path, bool preload){
+		addResource(request_path, file_path, preload, false);
+	}
+
+	/**
+	* Adds a file resource to the server
+	* @param request path
+	* @param file path
+	* @param preload the resource
+	* @param serve the resource from a file mapping instead of a heap copy
+	*/
+	void Server::addResource(std::string request_path, std::string file_path, bool preload, bool map){
 		// Create the API Hook
 		Hook* hook = new Hook(request_path, file_path);
 		hook->setPreloadResource(preload);
+		hook->setMapResource(map);
 		hook->allowMethod(Method::GET);
 
 		// Add the endpoint
@@ -268,6 +522,72 @@ namespace swift{
 		addEndpoint(hook->getRequestPath(), hook);
 	}
 
+	/**
+	* Serves the entries of an asset pack built by the packer under a request
+	* path prefix. The pack is mapped once, its entries are sent from the
+	* mapping without any per-file I/O. Hooks take precedence over packed
+	* resources with the same path.
+	* @param request path prefix, e.g. "/" or "/static"
+	* @param pack file path
+	* @return false if the pack couldn't be read
+	*/
+	bool Server::mountPack(std::string prefix, std::string pack_path){
+		int fd = open(pack_path.c_str(), O_RDONLY);
+		struct stat results;
+		PackHeader header;
+
+		if(fd < 0 || fstat(fd, &results) != 0 ||
+			pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+			memcmp(header.magic, _SWIFT_PACK_MAGIC, sizeof(header.magic)) != 0){
+			std::cout << "Couldn't read asset pack '" << pack_path << "'" << std::endl;
+			if(fd >= 0) close(fd);
+			return false;
+		}
+
+		// The index is read once, the bodies are only ever sent from the mapping
+		size_t pack_size = results.st_size;
+		size_t entries_size = (size_t) header.count * sizeof(PackEntry);
+		size_t index_size = sizeof(header) + entries_size + header.strings_size;
+		std::vector<char> index(index_size);
+		struct mg_shared_buf* pack = NULL;
+
+		if(index_size > pack_size || pread(fd, &index[0], index_size, 0) != (ssize_t) index_size ||
+			(pack = mg_shared_buf_map(fd, pack_size, MG_MAP_WILLNEED)) == NULL){
+			std::cout << "Couldn't map asset pack '" << pack_path << "'" << std::endl;
+			close(fd);
+			return false;
+		}
+		close(fd);
+		packs.push_back(pack);
+
+		if(prefix.empty() || prefix[prefix.size() - 1] != '/') prefix += "/";
+
+		PackEntry* entries = (PackEntry*) &index[sizeof(header)];
+		const char* strings = &index[sizeof(header) + entries_size];
+
+		for(uint32_t i = 0; i < header.count; i++){
+			PackEntry& entry = entries[i];
+			if((uint64_t) entry.path_offset + entry.path_len > header.strings_size ||
+				(uint64_t) entry.mime_offset + entry.mime_len > header.strings_size ||
+				(uint64_t) entry.etag_offset + entry.etag_len > header.strings_size ||
+				entry.body.offset > pack_size || entry.body.size > pack_size - entry.body.offset ||
+				entry.gzip_body.offset > pack_size || entry.gzip_body.size > pack_size - entry.gzip_body.offset){
+				std::cout << "Invalid asset pack entry #" << i << " in '" << pack_path << "'" << std::endl;
+				continue;
+			}
+
+			std::string path = prefix + std::string(strings + entry.path_offset, entry.path_len);
+			std::string mime(strings + entry.mime_offset, entry.mime_len);
+			std::string etag(strings + entry.etag_offset, entry.etag_len);
+
+			addPackedResource(path, pack, entry.body, entry.gzip_body.size > 0 ? &entry.gzip_body : NULL,
+				etag, entry.mtime, mime, false);
+		}
+
+		if(verbose) std::cout << "Mounted " << header.count << " packed resources from '" << pack_path << "' on " << prefix << std::endl;
+		return true;
+	}
+
 	/**
 	* Tries to add an endpoint to the server
 	* @param endpoint path
@@ -310,228 +630,1107 @@ namespace swift{
 	}
 
 	/**
-	* Serves a static resource to the client
-	* @param file path
+	* Serves a static resource hook without building Request and Response
+	* objects. Cached resources are sent as a pre-serialized response.
+	* @param mongoose connection struct
+	* @return MG_FALSE if the request is not for an allowed static resource,
+	* MG_MORE if the resource is sent once its file is read
 	*/
-	Response* Server::serveResource(std::string file_path){
-		Response* resp = new Response();
-
-		struct stat results;
-		size_t size = 0;
-    
-	    if(stat(file_path.c_str(), &results) == 0){
-	        size = results.st_size;
-
-	        std::cout << "FILE STAT SIZE = " << size << "\n";
-
-	        // Open the file in binary mode
-	        // Note: we don't use ifstreams because of a g++ bug with ios::binary
-	        std::fstream myFile;
-		    myFile.open(file_path, std::ios::in | std::ios::binary);
-
-		    if(myFile){
-
-		    	// Read file
-		    	char* buffer = new char[size];
-		    	myFile.read(buffer, size);
-		    	resp->setContent(buffer, size);
-
-		    	// Set correct MIME type
-		    	try{
-		    		std::string mime = getMIMEByFilename(file_path);
-		    		
-
-		    		// Unless it's text, set mode as binary
-		    		if(!isTextMIME(mime)){
-		    			resp->setBinaryMode(true);
-		    			resp->addHeader("Content-Type", mime);
-		    		}else{
-		    			// @TODO charset
-		    			resp->addHeader("Content-Type", mime+"; charset=utf-8");
-		    		}
-
-		    	}catch(Ex_no_mime_type& e){
-		    		std::cout << "MIME type not found for file served: '" << file_path << "'" << std::endl;
-		    	}catch(Ex_invalid_filename& e){
-		    		std::cout << "Couldn't find MIME type for invalid filename '" << file_path << "'" << std::endl;
-		    	}catch(std::exception& e){
-		    		std::cout << "Couldn't find MIME type for file '" << file_path << "', unknown error occurred" << std::endl;
-		    	}
-		    }else{
-		    	std::cout << "(404) File couldn't be opened: '" << file_path << "'" << std::endl;
-		    	// @TODO File not found (404)
-		    }
-
-	    }else{
-	    	std::cout << "(404) Resource file not found: '" << file_path << "'" << std::endl;
-	        // @TODO File not found (404)
+	int Server::serveStatic(struct mg_connection *conn){
+		std::map<std::string,Hook*>::iterator it = endpoints.find(conn->uri);
+		if(it == endpoints.end()){
+			return servePacked(conn) ? MG_TRUE : MG_FALSE;
+		}
+		if(!it->second->isResource()){
+			return MG_FALSE;
 		}
 
-		return resp;
-	}
-
-	/**
-	* Sends a response to the client
-	* @param response object
-	* @param mongoose connnection struct
-	*/
-	void Server::sendResponse(Response* resp, struct mg_connection *conn){
+		Hook* hook = it->second;
+		try{
+			if(!hook->isMethodAllowed(str_to_method(conn->request_method))) return MG_FALSE;
+		}catch(Ex_invalid_method& e){
+			return MG_FALSE;
+		}
 
-		// Content-length
-		if(!resp->hasHeader("Content-Length")){
-			resp->addHeader("Content-Length", resp->getContentByteSizeStr());
+		if(verbose){
+			std::cout << _SWIFT_SYMB_REQ << " " << conn->uri << " from " << mg_remote_ip(conn) << std::endl;
+			std::cout << "Serving static resource" << std::endl;
 		}
 
-		// Send headers
-		std::queue<Header*> headers = resp->getHeaderQueue();
+		std::string file_path = hook->getResourcePath();
+		CachedResource res;
 
-		if(headers.size() > 0){
-			while(!headers.empty()){
-				Header* h = headers.front();
-				headers.pop();
-				// Send header
-				mg_send_header(conn, h->getName().c_str(), h->getValue().c_str());
+		if(cache.get(file_path, res)){
+			// Watched resources are dropped when they change, others are checked
+			if(inotify_fd >= 0 || cache.isCurrent(res)){
+				sendResource(res, -1, conn);
+				return MG_TRUE;
 			}
+			// The file changed, map it again
+			ResourceCache::release(res);
 		}
 
-		// @TODO - Temporary header to prevent browser caching
-		resp->addHeader("Cache-Control", "max-age=0, post-check=0, pre-check=0, no-store, no-cache, must-revalidate");
+		// The file is opened and read by an offload thread, a slow disk
+		// doesn't hold up the other connections of this event loop
+		ResourceLoad* load = new ResourceLoad();
+		load->server = this;
+		load->hook = hook;
+		if(mg_offload(conn, Server::loadResource, Server::resourceLoaded, load)){
+			return MG_MORE;
+		}
 
-		if(resp->isBinary()){
-			//mg_send_data(conn, resp->getContent(), resp->getContentLen());
-			mg_write(conn, resp->getContent(), resp->getContentLen());
+		openResource(load);
+		sendLoadedResource(load, conn);
+		delete load;
+		return MG_TRUE;
+	}
+
+	/**
+	* Opens a resource file and caches it, or prepares it to be sent from
+	* the file. Runs on an offload thread.
+	* @param resource load, filled in
+	*/
+	void Server::openResource(ResourceLoad* load){
+		std::string file_path = load->hook->getResourcePath();
+		int fd = open(file_path.c_str(), O_RDONLY);
+		struct stat results;
+
+		load->found = false;
+		load->fd = -1;
+
+		if(fd >= 0 && fstat(fd, &results) == 0){
+			// Only mapped, preloaded or small resources are kept in memory
+			if((load->hook->isMapResource() || load->hook->isPreloadResource() || results.st_size <= _SWIFT_CACHE_ADMIT_SIZE) &&
+				cacheResource(load->hook, fd, results, load->res)){
+				load->found = true;
+
+			// The file never passes through user space, it is sent with sendfile()
+			}else if(prepareResource(load->hook, results, load->res)){
+				// sendfile() blocks the event loop on pages that aren't in memory
+				readahead(fd, 0, std::min((off_t) _SWIFT_READAHEAD_SIZE, results.st_size));
+				load->found = true;
+				load->fd = fd;
+				fd = -1;
+			}
 		}else{
-			mg_printf_data(conn, "%s", resp->getContent());
+			std::cout << "(404) Resource file not found: '" << file_path << "'" << std::endl;
 		}
+		if(fd >= 0) close(fd);
 	}
 
-	/* ======================================================== */
-	/* Server MISC												*/
-	/* ======================================================== */
-
 	/**
-	* Sets the server's cache size. If it is set at a smaller number than
-	* the current usage, the cached files will not be affected.
+	* Sends a resource opened by openResource()
+	* @param resource load, its resource and file are released
+	* @param mongoose connection struct
 	*/
-	void Server::setCacheSize(size_t size){
-		max_cache_size = size;
+	void Server::sendLoadedResource(ResourceLoad* load, struct mg_connection *conn){
+		if(load->found){
+			sendResource(load->res, load->fd, conn);
+			return;
+		}
+
+		// @TODO File not found (404)
+		Response* resp = new Response();
+		sendResponse(resp, conn);
+		delete resp;
 	}
 
 	/**
-	* Makes Swift verbose
+	* Offloaded part of serving a resource that isn't cached
+	* @param resource load
 	*/
-	void Server::setVerbose(bool){
-		verbose = true;
+	void Server::loadResource(void* load){
+		// Static
+
+		ResourceLoad* self = (ResourceLoad*) load;
+		self->server->openResource(self);
 	}
 
 	/**
-	* Prints welcome message
+	* Sends a resource once its offload thread is done, back on the event loop
+	* @param mongoose connection struct, NULL if it was closed meanwhile
+	* @param resource load
 	*/
-	void Server::printWelcome(){
-		std::cout << _SWIFT_WELCOME << " " << _SWIFT_VERSION << std::endl;
+	void Server::resourceLoaded(struct mg_connection *conn, void* load){
+		// Static
+
+		ResourceLoad* self = (ResourceLoad*) load;
+		if(conn != NULL){
+			self->server->sendLoadedResource(self, conn);
+		}else if(self->found){
+			ResourceCache::release(self->res);
+			if(self->fd >= 0) close(self->fd);
+		}
+		delete self;
 	}
 
 	/**
-	* Converts a string to a method enum
+	* Serves a resource compiled into the binary, generated by 'make embed'.
+	* It is sent from the read-only data segment, shared by every process
+	* running the binary, without any file I/O.
+	* @param request path
+	* @param embedded resource
+	* @return false if out of memory
 	*/
-	Method str_to_method(std::string request_method){
-		if(request_method == "GET") return Method::GET;
-		else if(request_method == "HEAD") return Method::HEAD;
-		else if(request_method == "POST") return Method::POST;
-		else if(request_method == "PUT") return Method::PUT;
-		else if(request_method == "DELETE") return Method::DELETE;
-		else if(request_method == "TRACE") return Method::TRACE;
-		else if(request_method == "OPTIONS") return Method::OPTIONS;
-		else if(request_method == "CONNECT") return Method::CONNECT;
-		else if(request_method == "PATCH") return Method::PATCH;
-		else throw ex_invalid_method;
+	bool Server::addEmbeddedResource(std::string request_path, const EmbeddedResource& resource){
+		// Static data is never freed
+		struct mg_shared_buf* data = mg_shared_buf_new(resource.data, resource.size, NULL);
+		if(data == NULL) return false;
+
+		PackBody body;
+		body.offset = 0;
+		body.size = resource.size;
+
+		bool added = addPackedResource(request_path, data, body, NULL, resource.etag, resource.mtime, resource.mime, false);
+		mg_shared_buf_unref(data);
+		return added;
 	}
-	
-	/* ======================================================== */
-	/* API Hook													*/
-	/* ======================================================== */
 
 	/**
-	* Constructs an API Hook with default settings
+	* Serves the resources of a generated embedded resources header under a
+	* request path prefix, e.g. addEmbeddedResources("/", swift_embedded::resources,
+	* swift_embedded::count)
+	* @param request path prefix
+	* @param embedded resources
+	* @param number of embedded resources
 	*/
-	Hook::Hook(){
-		is_resource = false;
-		preload_resource = false;
-		setCharset(Charset::getDefault());
+	void Server::addEmbeddedResources(std::string prefix, const EmbeddedResource* resources, size_t count){
+		if(prefix.empty() || prefix[prefix.size() - 1] != '/') prefix += "/";
+		for(size_t i = 0; i < count; i++){
+			addEmbeddedResource(prefix + resources[i].path, resources[i]);
+		}
 	}
 
 	/**
-	* Constructs an API Hook with a callback function
-	* @param request path string
-	* @param callback function pointer
+	* Registers a packed, embedded or fingerprinted resource, and its
+	* fingerprinted alias if fingerprinting is enabled
+	* @param request path
+	* @param pack mapping or data the body is in
+	* @param body in the data
+	* @param gzip body in the data, or NULL
+	* @param quoted ETag hashed from the body
+	* @param modification time
+	* @param MIME type string, empty if unknown
+	* @param only register the fingerprinted alias, the request path is a hook
+	* @return false if out of memory
 	*/
-	Hook::Hook(std::string request_path, Response* (*function)(Request*)){
-		is_resource = false;
-		preload_resource = false;
-		this->request_path = request_path;
-		this->callback_function = function;
-		setCharset(Charset::getDefault());
+	bool Server::addPackedResource(std::string request_path, struct mg_shared_buf* data, PackBody& body, PackBody* gzip_body,
+		std::string etag, time_t mtime, std::string mime, bool fingerprint_only){
+		PackedResource res;
+
+		if(!fingerprint_only){
+			if(!preparePackedResource(res, data, body, gzip_body, etag, mtime, mime, _SWIFT_RESOURCE_CACHE)) return false;
+			addPacked(request_path, res);
+		}
+
+		if(fingerprint_resources){
+			// The alias always has the same content, browsers never need to revalidate it
+			std::string alias = fingerprintPath(request_path, etag.substr(1, etag.size() - 2));
+			if(!preparePackedResource(res, data, body, gzip_body, etag, mtime, mime, _SWIFT_IMMUTABLE_CACHE)) return false;
+			addPacked(alias, res);
+
+			// Pages served just before a change may still link to the previous
+			// alias, older aliases are dropped so that changes don't pile up
+			std::lock_guard<std::mutex> guard(packed_lock);
+			std::string& current = fingerprints[request_path];
+			if(current != alias){
+				std::string& previous = previous_fingerprints[request_path];
+				if(!previous.empty() && previous != alias){
+					std::map<std::string, PackedResource>::iterator it = packed.find(previous);
+					if(it != packed.end()){
+						// Responses still sending it hold their own references
+						ResourceCache::release(it->second.identity);
+						if(it->second.gzip.content != NULL) ResourceCache::release(it->second.gzip);
+						packed.erase(it);
+					}
+				}
+				previous = current;
+				current = alias;
+			}
+		}
+		return true;
 	}
 
 	/**
-	* Constructs an API Hook that serves a static resource
-	* @param request path string
-	* @param resource path string
+	* Describes a packed resource and its gzip variant
+	* @param resource, its content references are owned by the caller
+	* @param pack mapping or data the body is in
+	* @param body in the data
+	* @param gzip body in the data, or NULL
+	* @param quoted ETag hashed from the body
+	* @param modification time
+	* @param MIME type string, empty if unknown
+	* @param Cache-Control header value
+	* @return false if out of memory
 	*/
-	Hook::Hook(std::string request_path, std::string resource_path){
-		is_resource = true;
-		preload_resource = true;
-		this->request_path = request_path;
-		this->resource_path = resource_path;
-		setCharset(Charset::getDefault());
+	bool Server::preparePackedResource(PackedResource& res, struct mg_shared_buf* data, PackBody& body, PackBody* gzip_body,
+		std::string etag, time_t mtime, std::string mime, std::string cache_control){
+		res.gzip.content = NULL;
+		if(!preparePacked(res.identity, data, body, etag, mtime, mime, cache_control, NULL, gzip_body != NULL)){
+			return false;
+		}
+
+		if(gzip_body != NULL){
+			// Variants need their own strong ETag
+			std::string gzip_etag = etag.substr(0, etag.size() - 1) + "-gzip\"";
+			if(!preparePacked(res.gzip, data, *gzip_body, gzip_etag, mtime, mime, cache_control, "gzip", true)){
+				res.gzip.content = NULL;
+			}
+		}
+		return true;
 	}
 
 	/**
-	* Sets the API Hook's request path
-	* @param path
+	* Registers a packed resource, replacing any with the same path
+	* @param request path
+	* @param resource, its content references are taken over
 	*/
-	void Hook::setRequestPath(std::string path){
-		request_path = path;
+	void Server::addPacked(std::string request_path, PackedResource& res){
+		std::lock_guard<std::mutex> guard(packed_lock);
+
+		std::map<std::string, PackedResource>::iterator it = packed.find(request_path);
+		if(it != packed.end()){
+			// Responses still sending it hold their own references
+			ResourceCache::release(it->second.identity);
+			if(it->second.gzip.content != NULL) ResourceCache::release(it->second.gzip);
+		}
+		packed[request_path] = res;
 	}
 
 	/**
-	* Returns the API Hook's request path
-	* @return path string
+	* Computes the content hash of a resource hook's file and serves the
+	* file's current content under a fingerprinted alias of the hook's path.
+	* The alias is served from a copy of the file, it never changes even if
+	* the file is rewritten in place. A copy of a file that changes while it
+	* is read is not kept, the change is fingerprinted once it is written.
+	* @param resource hook
 	*/
-	std::string Hook::getRequestPath(){
-		return request_path;
+	void Server::fingerprintResource(Hook* hook){
+		std::string file_path = hook->getResourcePath();
+		int fd = open(file_path.c_str(), O_RDONLY);
+		struct stat results, after;
+		struct mg_shared_buf* data = NULL;
+
+		if(fd >= 0 && fstat(fd, &results) == 0){
+			size_t size = results.st_size, done = 0;
+			char* copy = new char[size > 0 ? size : 1];
+			ssize_t n;
+			while(done < size && ((n = read(fd, copy + done, size - done)) > 0 || (n < 0 && errno == EINTR))){
+				if(n > 0) done += n;
+			}
+
+			if(done == size && fstat(fd, &after) == 0 && after.st_size == results.st_size && after.st_mtime == results.st_mtime){
+				data = mg_shared_buf_new(copy, size, Server::freeContent);
+			}
+			if(data == NULL) delete[] copy;
+		}
+		if(fd >= 0) close(fd);
+
+		if(data == NULL){
+			std::cout << "Couldn't fingerprint resource '" << file_path << "'" << std::endl;
+			return;
+		}
+
+		PackBody body;
+		body.offset = 0;
+		body.size = results.st_size;
+		std::string etag = contentETag((const char*) mg_shared_buf_data(data), body.size);
+
+		addPackedResource(hook->getRequestPath(), data, body, NULL, etag, results.st_mtime, getResourceMIME(file_path), true);
+		mg_shared_buf_unref(data);
 	}
 
 	/**
-	* Adds given method to the allowed list
-	* @param Method enum
+	* Returns the fingerprinted alias of a resource, to link to it from
+	* pages and templates, see setFingerprintResources(). Hook resources are
+	* fingerprinted when the server starts, and again when their file changes.
+	* @param request path
+	* @return fingerprinted path, or the request path if it has none
 	*/
-	void Hook::allowMethod(Method m){
-		allowed_methods.insert(m);
+	std::string Server::getFingerprintedPath(std::string request_path){
+		std::lock_guard<std::mutex> guard(packed_lock);
+		std::map<std::string, std::string>::iterator it = fingerprints.find(request_path);
+		return it == fingerprints.end() ? request_path : it->second;
 	}
 
 	/**
-	* Disallows the given method
-	* @param Method enum
+	* Builds the fingerprinted alias of a path: the hash goes before the
+	* extension, e.g. /js/winedex.js becomes /js/winedex.<hash>.js
+	* @param request path
+	* @param content hash
+	* @return fingerprinted path
 	*/
-	void Hook::disallowMethod(Method m){
-		allowed_methods.erase(m);
+	std::string Server::fingerprintPath(std::string request_path, std::string hash){
+		size_t slash = request_path.rfind('/');
+		size_t dot = request_path.rfind('.');
+		size_t name = slash == std::string::npos ? 0 : slash + 1;
+
+		if(dot == std::string::npos || dot <= name){
+			return request_path + "." + hash;
+		}
+		return request_path.substr(0, dot) + "." + hash + request_path.substr(dot);
 	}
 
 	/**
-	* Indicates whether the given method is allowed by this API Hook
-	* @param Method enum: POST, GET...
-	* @return boolean
+	* Serves an asset pack entry, in the best encoding the client accepts
+	* @param mongoose connection struct
+	* @return false if the request is not for a packed resource
 	*/
-	bool Hook::isMethodAllowed(Method m){
-		return allowed_methods.count(m) > 0;
+	bool Server::servePacked(struct mg_connection *conn){
+		if(strcmp(conn->request_method, "GET") != 0 && strcmp(conn->request_method, "HEAD") != 0){
+			return false;
+		}
+
+		const char* accept_encoding = mg_get_known_header(conn, MG_HEADER_ACCEPT_ENCODING);
+		CachedResource res;
+		{
+			// Fingerprinted aliases are added while the server runs
+			std::lock_guard<std::mutex> guard(packed_lock);
+			std::map<std::string, PackedResource>::iterator it = packed.find(conn->uri);
+			if(it == packed.end()) return false;
+
+			res = it->second.identity;
+			if(it->second.gzip.content != NULL && accept_encoding != NULL && acceptsEncoding(accept_encoding, "gzip")){
+				res = it->second.gzip;
+			}
+			ResourceCache::retain(res);
+		}
+
+		if(verbose){
+			std::cout << _SWIFT_SYMB_REQ << " " << conn->uri << " from " << mg_remote_ip(conn) << std::endl;
+			std::cout << "Serving packed resource" << std::endl;
+		}
+
+		sendResource(res, -1, conn);
+		return true;
 	}
 
 	/**
-	* Sets the static resource path for this API Hook and make it a static resource
-	* @param path to resource
+	* Describes a variant of an asset pack entry: its headers are serialized
+	* once and its body is a slice of the pack's mapping
+	* @param resource, its content references are owned by the caller
+	* @param pack mapping
+	* @param body in the pack
+	* @param quoted ETag
+	* @param modification time
+	* @param MIME type string, empty if unknown
+	* @param Cache-Control header value
+	* @param Content-Encoding, or NULL
+	* @param the entry has encoded variants
+	* @return false if out of memory
 	*/
-	void Hook::setResourcePath(std::string path){
+	bool Server::preparePacked(CachedResource& res, struct mg_shared_buf* pack, PackBody& body, std::string etag,
+		time_t mtime, std::string mime, std::string cache_control, const char* encoding, bool has_variants){
+		std::string headers = serializeValidators(etag, mtime, cache_control);
+		if(has_variants) headers += "Vary: Accept-Encoding\r\n";
+		res.validator_len = headers.size();
+
+		// Ranges of an encoded variant are ranges of the encoded bytes, the
+		// range responses repeat Content-Encoding along with Content-Type
+		if(encoding != NULL) headers += std::string("Content-Encoding: ") + encoding + "\r\n";
+		if(!mime.empty()){
+			headers += "Content-Type: " + getContentType(mime) + "\r\n";
+		}
+		res.type_end = headers.size();
+
+		headers += serializeHeaders(body.size);
+
+		char* data = new char[headers.size()];
+		memcpy(data, headers.data(), headers.size());
+		res.content = mg_shared_buf_new(data, headers.size(), Server::freeContent);
+		if(res.content == NULL){
+			delete[] data;
+			return false;
+		}
+
+		mg_shared_buf_ref(pack);
+		res.body = pack;
+		res.body_offset = body.offset;
+		res.header_len = headers.size();
+		res.size = body.size;
+		res.ino = 0;
+		res.mtime = mtime;
+		res.checked = 0;
+		snprintf(res.etag, sizeof(res.etag), "%s", etag.c_str());
+		return true;
+	}
+
+	/**
+	* Checks an Accept-Encoding header for a content coding, which is not
+	* accepted if its quality value is 0
+	* @param header value
+	* @param content coding
+	* @return boolean
+	*/
+	bool Server::acceptsEncoding(const char* header, const char* coding){
+		size_t len = strlen(coding);
+		const char* p = header;
+
+		while(*p != '\0'){
+			while(*p == ' ' || *p == '\t' || *p == ',') p++;
+			const char* end = p;
+			while(*end != '\0' && *end != ',' && *end != ';' && *end != ' ' && *end != '\t') end++;
+
+			bool match = (size_t) (end - p) == len && strncasecmp(p, coding, len) == 0;
+
+			// Parameters up to the next coding, only the quality value matters
+			double q = 1;
+			for(p = end; *p != '\0' && *p != ','; p++){
+				if((*p == 'q' || *p == 'Q') && p[1] == '=') q = atof(p + 2);
+			}
+
+			if(match) return q > 0;
+		}
+		return false;
+	}
+
+	/**
+	* Sends a resource as the request asks: a 304 if the client has it
+	* already, the requested byte ranges, or the whole resource
+	* @param resource, its content references are released
+	* @param file to send the body from, closed once sent, or -1 to send it from the resource
+	* @param mongoose connection struct
+	*/
+	void Server::sendResource(CachedResource& res, int fd, struct mg_connection *conn){
+		std::vector<std::pair<size_t, size_t> > ranges;
+		const char* range = mg_get_known_header(conn, MG_HEADER_RANGE);
+		int n = -1;
+
+		// Ranges only apply to GET, and only to the representation If-Range names
+		if(range != NULL && strcmp(conn->request_method, "GET") == 0 && isRangeCurrent(res, conn)){
+			n = parseRanges(range, res.size, ranges);
+		}
+
+		if(mg_is_not_modified(conn, res.etag, res.mtime)){
+			sendNotModified(res, conn);
+		}else if(n == 0){
+			sendRangeNotSatisfiable(res, conn);
+		}else if(n > 0){
+			sendRanges(res, fd, ranges, conn);
+		}else{
+			sendCachedResource(res, fd, conn);
+		}
+
+		ResourceCache::release(res);
+		if(fd >= 0) close(fd);
+	}
+
+	/**
+	* Sends a whole resource: the status line and the headers that change
+	* with each request, then the pre-serialized headers and body
+	* @param resource
+	* @param file to send the body from, or -1
+	* @param mongoose connection struct
+	*/
+	void Server::sendCachedResource(CachedResource& res, int fd, struct mg_connection *conn){
+		char head[128];
+		int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\nConnection: %s\r\n",
+			currentHTTPDate(), mg_should_keep_alive(conn) ? "keep-alive" : "close");
+
+		conn->status_code = 200;
+		mg_write(conn, head, n);
+		if(strcmp(conn->request_method, "HEAD") == 0){
+			mg_write_shared(conn, res.content, 0, res.header_len);
+		}else if(fd < 0 && res.body == NULL){
+			mg_write_shared(conn, res.content, 0, res.header_len + res.size);
+		}else{
+			mg_write_shared(conn, res.content, 0, res.header_len);
+			sendBody(res, fd, 0, res.size, conn);
+		}
+	}
+
+	/**
+	* Sends byte ranges of a resource, as a single part or as a
+	* multipart/byteranges body. The parts are slices of the cached body or
+	* of the file, the body is never copied.
+	* @param resource
+	* @param file to send the body from, or -1
+	* @param offset and length of each range
+	* @param mongoose connection struct
+	*/
+	void Server::sendRanges(CachedResource& res, int fd, std::vector<std::pair<size_t, size_t> >& ranges, struct mg_connection *conn){
+		char head[256];
+		int n = snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nDate: %s\r\nConnection: %s\r\n",
+			currentHTTPDate(), mg_should_keep_alive(conn) ? "keep-alive" : "close");
+
+		conn->status_code = 206;
+		mg_write(conn, head, n);
+
+		if(ranges.size() == 1){
+			size_t offset = ranges[0].first;
+			size_t len = ranges[0].second;
+
+			// Validators, Content-Encoding and Content-Type come from the pre-serialized headers
+			mg_write_shared(conn, res.content, 0, res.type_end);
+			n = snprintf(head, sizeof(head), "Content-Length: %zu\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+				len, offset, offset + len - 1, res.size);
+			mg_write(conn, head, n);
+			sendBody(res, fd, offset, len, conn);
+			return;
+		}
+
+		// Each part repeats the resource's Content-Encoding and Content-Type lines
+		static thread_local unsigned long boundaries = 0;
+		char boundary[32];
+		snprintf(boundary, sizeof(boundary), "%016lx%08lx", (unsigned long) time(NULL), ++boundaries);
+
+		std::vector<std::string> parts;
+		size_t type_len = res.type_end - res.validator_len;
+		size_t total = 0;
+		for(size_t i = 0; i < ranges.size(); i++){
+			n = snprintf(head, sizeof(head), "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+				ranges[i].first, ranges[i].first + ranges[i].second - 1, res.size);
+			parts.push_back(std::string("\r\n--") + boundary + "\r\n");
+			parts.push_back(std::string(head, n));
+			total += parts[2 * i].size() + type_len + parts[2 * i + 1].size() + ranges[i].second;
+		}
+		std::string end = std::string("\r\n--") + boundary + "--\r\n";
+		total += end.size();
+
+		mg_write_shared(conn, res.content, 0, res.validator_len);
+		n = snprintf(head, sizeof(head), "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %zu\r\n\r\n",
+			boundary, total);
+		mg_write(conn, head, n);
+
+		for(size_t i = 0; i < ranges.size(); i++){
+			mg_write(conn, parts[2 * i].data(), parts[2 * i].size());
+			mg_write_shared(conn, res.content, res.validator_len, type_len);
+			mg_write(conn, parts[2 * i + 1].data(), parts[2 * i + 1].size());
+			sendBody(res, fd, ranges[i].first, ranges[i].second, conn);
+		}
+		mg_write(conn, end.data(), end.size());
+	}
+
+	/**
+	* Answers a Range request that no part of the resource satisfies
+	* @param resource
+	* @param mongoose connection struct
+	*/
+	void Server::sendRangeNotSatisfiable(CachedResource& res, struct mg_connection *conn){
+		char head[256];
+		int n = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nDate: %s\r\nConnection: %s\r\n"
+			"Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n",
+			currentHTTPDate(), mg_should_keep_alive(conn) ? "keep-alive" : "close", res.size);
+
+		conn->status_code = 416;
+		mg_write(conn, head, n);
+	}
+
+	/**
+	* Queues a slice of a resource's body
+	* @param resource
+	* @param file to send the slice from, or -1 to send it from the resource
+	* @param offset in the body
+	* @param length
+	* @param mongoose connection struct
+	*/
+	void Server::sendBody(CachedResource& res, int fd, size_t offset, size_t len, struct mg_connection *conn){
+		if(fd >= 0){
+			// Mongoose closes the file it was given once it is sent
+			int dup_fd = dup(fd);
+			if(dup_fd >= 0) mg_write_file(conn, dup_fd, offset, len);
+		}else if(res.body != NULL){
+			mg_write_shared(conn, res.body, res.body_offset + offset, len);
+		}else{
+			mg_write_shared(conn, res.content, res.header_len + offset, len);
+		}
+	}
+
+	/**
+	* Indicates if a Range request applies to the current resource: an
+	* If-Range header must name its ETag or its Last-Modified date. ETags
+	* are compared strongly (RFC 7233), weak ones never match.
+	* @param resource
+	* @param mongoose connection struct
+	* @return boolean
+	*/
+	bool Server::isRangeCurrent(CachedResource& res, struct mg_connection *conn){
+		const char* if_range = mg_get_known_header(conn, MG_HEADER_IF_RANGE);
+		if(if_range == NULL) return true;
+		if(strncmp(if_range, "W/", 2) == 0) return false;
+		if(if_range[0] == '"') return res.etag[0] == '"' && strcmp(if_range, res.etag) == 0;
+		return formatHTTPDate(res.mtime) == if_range;
+	}
+
+	/**
+	* Answers a conditional request for a resource that the client already
+	* has: the status line, the headers that change with each request and
+	* the pre-serialized validators, without a body
+	* @param resource
+	* @param mongoose connection struct
+	*/
+	void Server::sendNotModified(CachedResource& res, struct mg_connection *conn){
+		char head[128];
+		int n = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nDate: %s\r\nConnection: %s\r\n",
+			currentHTTPDate(), mg_should_keep_alive(conn) ? "keep-alive" : "close");
+
+		conn->status_code = 304;
+		mg_write(conn, head, n);
+		mg_write_shared(conn, res.content, 0, res.validator_len);
+		mg_write(conn, "\r\n", 2);
+	}
+
+	/**
+	* Reads or maps a preloaded resource into the cache
+	* @param resource hook
+	*/
+	void Server::preloadResource(Hook* hook){
+		std::string file_path = hook->getResourcePath();
+		int fd = open(file_path.c_str(), O_RDONLY);
+		struct stat results;
+		CachedResource res;
+
+		if(fd >= 0 && fstat(fd, &results) == 0 && cacheResource(hook, fd, results, res)){
+			ResourceCache::release(res);
+		}else{
+			std::cout << "Couldn't preload resource '" << file_path << "'" << std::endl;
+		}
+		if(fd >= 0) close(fd);
+	}
+
+	/**
+	* Puts a resource in the cache, mapped or copied as its hook asks. Mapped
+	* resources fall back to a copy where mapping isn't supported.
+	* @param resource hook
+	* @param open resource file
+	* @param resource file stats
+	* @param resource cached, its content references are owned by the caller
+	* @return false if the resource couldn't be cached
+	*/
+	bool Server::cacheResource(Hook* hook, int fd, struct stat& file_stat, CachedResource& res){
+		std::string file_path = hook->getResourcePath();
+		size_t size = file_stat.st_size;
+		std::string headers = serializeResourceHeaders(hook, file_stat, res);
+
+		if(hook->isMapResource()){
+			int flags = 0;
+			if(hook->isPreloadResource()) flags |= MG_MAP_WILLNEED;
+			if(huge_pages && size >= _SWIFT_HUGE_PAGE_SIZE) flags |= MG_MAP_HUGEPAGE;
+			if(cache.map(file_path, fd, file_stat, headers, flags, res)) return true;
+		}
+
+		return cache.load(file_path, fd, file_stat, headers, res);
+	}
+
+	/**
+	* Describes a resource that is sent from its file without being cached,
+	* its headers are serialized for this response only
+	* @param resource hook
+	* @param resource file stats
+	* @param resource, its content reference is owned by the caller
+	* @return false if out of memory
+	*/
+	bool Server::prepareResource(Hook* hook, struct stat& file_stat, CachedResource& res){
+		std::string headers = serializeResourceHeaders(hook, file_stat, res);
+		char* data = new char[headers.size()];
+		memcpy(data, headers.data(), headers.size());
+
+		res.file_path = hook->getResourcePath();
+		res.content = mg_shared_buf_new(data, headers.size(), Server::freeContent);
+		res.body = NULL;
+		res.body_offset = 0;
+		res.header_len = headers.size();
+		ResourceCache::describe(&res, file_stat);
+
+		if(res.content == NULL){
+			delete[] data;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	* Builds the headers of a static resource that are the same for every
+	* request: the validators that a 304 repeats, then Content-Type and the
+	* rest, ending with a blank line
+	* @param resource hook
+	* @param resource file stats
+	* @param resource whose header offsets are set
+	* @return headers string
+	*/
+	std::string Server::serializeResourceHeaders(Hook* hook, struct stat& file_stat, CachedResource& res){
+		std::string headers = serializeValidators(fileETag(file_stat), file_stat.st_mtime, hook->getCacheControl());
+		res.validator_len = headers.size();
+
+		std::string mime = getResourceMIME(hook->getResourcePath());
+		if(!mime.empty()){
+			headers += "Content-Type: " + getContentType(mime) + "\r\n";
+		}
+		res.type_end = headers.size();
+
+		headers += serializeHeaders(file_stat.st_size);
+		return headers;
+	}
+
+	/**
+	* Builds the validator headers of a static resource
+	* @param quoted ETag
+	* @param modification time
+	* @param Cache-Control header value
+	* @return headers string
+	*/
+	std::string Server::serializeValidators(std::string etag, time_t mtime, std::string cache_control){
+		std::stringstream ss;
+		ss << "ETag: " << etag << "\r\n";
+		ss << "Last-Modified: " << formatHTTPDate(mtime) << "\r\n";
+		ss << "Cache-Control: " << cache_control << "\r\n";
+		return ss.str();
+	}
+
+	/**
+	* Builds the headers of a static resource that follow its Content-Type,
+	* including the blank line that ends them
+	* @param byte size of the resource
+	* @return headers string
+	*/
+	std::string Server::serializeHeaders(size_t size){
+		std::stringstream ss;
+		ss << "Accept-Ranges: bytes\r\n";
+		ss << "Content-Length: " << size << "\r\n";
+		ss << "\r\n";
+		return ss.str();
+	}
+
+	/**
+	* Finds the MIME type of a static resource
+	* @param file path
+	* @return MIME type string, empty if unknown
+	*/
+	std::string Server::getResourceMIME(std::string file_path){
+		try{
+			return getMIMEByFilename(file_path);
+		}catch(Ex_no_mime_type& e){
+			std::cout << "MIME type not found for file served: '" << file_path << "'" << std::endl;
+		}catch(Ex_invalid_filename& e){
+			std::cout << "Couldn't find MIME type for invalid filename '" << file_path << "'" << std::endl;
+		}catch(std::exception& e){
+			std::cout << "Couldn't find MIME type for file '" << file_path << "', unknown error occurred" << std::endl;
+		}
+		return "";
+	}
+
+	/**
+	* Returns the Content-Type header value for a MIME type
+	* @param MIME type string
+	* @return Content-Type string
+	*/
+	std::string Server::getContentType(std::string mime){
+		if(!isTextMIME(mime)){
+			return mime;
+		}
+		// @TODO charset
+		return mime+"; charset=utf-8";
+	}
+
+	/**
+	* Sends a response to the client
+	* @param response object
+	* @param mongoose connnection struct
+	*/
+	void Server::sendResponse(Response* resp, struct mg_connection *conn){
+		sendResponse(resp, conn, false);
+	}
+
+	/**
+	* Sends a response, or a 304 Not Modified with the response's headers
+	* but no body
+	* @param response object
+	* @param mongoose connection struct
+	* @param the client already has this response
+	*/
+	void Server::sendResponse(Response* resp, struct mg_connection *conn, bool not_modified){
+
+		// Content-length
+		if(!not_modified && !resp->hasHeader("Content-Length")){
+			resp->addHeader("Content-Length", resp->getContentByteSizeStr());
+		}
+
+		// @TODO - Temporary header to prevent browser caching
+		if(!resp->hasHeader("Cache-Control")){
+			resp->addHeader("Cache-Control", _SWIFT_NO_CACHE);
+		}
+
+		// Status line and headers go out in a single write
+		std::string head = not_modified ? "HTTP/1.1 304 Not Modified\r\n" : "HTTP/1.1 200 OK\r\n";
+		head += std::string("Date: ") + currentHTTPDate() + "\r\n";
+		head += std::string("Connection: ") + (mg_should_keep_alive(conn) ? "keep-alive" : "close") + "\r\n";
+		std::queue<Header*> headers = resp->getHeaderQueue();
+
+		while(!headers.empty()){
+			Header* h = headers.front();
+			headers.pop();
+			head += h->getName() + ": " + h->getValue() + "\r\n";
+		}
+		head += "\r\n";
+
+		conn->status_code = not_modified ? 304 : 200;
+		mg_write(conn, head.data(), head.size());
+
+		if(not_modified || resp->getContentLen() <= 0 || strcmp(conn->request_method, "HEAD") == 0){
+			return;
+		}
+
+		// File content is copied to the socket by the kernel, Mongoose closes it
+		if(resp->getContentFile() >= 0){
+			int length = resp->getContentLen();
+			mg_write_file(conn, resp->releaseContentFile(), 0, length);
+			return;
+		}
+
+		// The body is handed over to Mongoose and sent without being copied
+		struct mg_shared_buf* body = mg_shared_buf_new(resp->getContent(), resp->getContentLen(), Server::freeContent);
+		if(body != NULL){
+			mg_write_shared(conn, body, 0, resp->getContentLen());
+			resp->releaseContent();
+			mg_shared_buf_unref(body);
+		}else{
+			mg_write(conn, resp->getContent(), resp->getContentLen());
+		}
+	}
+
+	/**
+	* Frees response content once Mongoose has sent it
+	* @param content buffer
+	*/
+	void Server::freeContent(void* content){
+		delete[] (char*) content;
+	}
+
+	/* ======================================================== */
+	/* Server MISC												*/
+	/* ======================================================== */
+
+	/**
+	* Sets the server's cache size. If it is set at a smaller number than
+	* the current usage, the cached files will not be affected.
+	*/
+	void Server::setCacheSize(size_t size){
+		max_cache_size = size;
+		cache.setMaxSize(size);
+	}
+
+	/**
+	* Returns the cache of static resources, e.g. to read its counters
+	* @return resource cache
+	*/
+	ResourceCache* Server::getCache(){
+		return &cache;
+	}
+
+	/**
+	* Enables or disables the io_uring I/O engine (disabled by default, the
+	* server polls its sockets with epoll or select). Only used if the kernel
+	* supports it, otherwise the server falls back to polling.
+	* @param enable
+	*/
+	void Server::setIOUring(bool enable){
+		io_uring = enable;
+	}
+
+	/**
+	* Lets mapped resources of 2MB or more use transparent huge pages
+	* (disabled by default). Fewer TLB misses, but whole huge pages are read.
+	* @param enable
+	*/
+	void Server::setHugePages(bool enable){
+		huge_pages = enable;
+	}
+
+	/**
+	* Enables or disables watching resource directories with inotify
+	* (enabled by default). Changed resources are dropped from the cache and
+	* preloaded again, so no request has to check its file.
+	* @param enable
+	*/
+	void Server::setWatchResources(bool enable){
+		watch_resources = enable;
+	}
+
+	/**
+	* Enables or disables fingerprinted aliases of resources (disabled by
+	* default). Must be set before adding packs or embedded resources.
+	* Aliases of pack and embedded resources share their data, but the alias
+	* of a resource hook is served from a copy of its file, read when the
+	* server starts and when the file changes, even if the hook isn't
+	* preloaded or is mapped. Up to two copies per hook are kept in memory,
+	* outside the resource cache and its maximum size.
+	* @param enable
+	*/
+	void Server::setFingerprintResources(bool enable){
+		fingerprint_resources = enable;
+	}
+
+	/**
+	* Sets the maximum number of connections each event loop accepts at once
+	* @param budget
+	*/
+	void Server::setAcceptBudget(int budget){
+		accept_budget = budget;
+	}
+
+	/**
+	* Sets the maximum number of pipelined requests of a connection served at
+	* once, before the event loop moves on to other connections (16 by default)
+	* @param budget
+	*/
+	void Server::setPipelineBudget(int budget){
+		pipeline_budget = budget;
+	}
+
+	/**
+	* Serves the files of a directory for requests no hook or resource
+	* handles, like Mongoose's document_root
+	* @param directory path
+	*/
+	void Server::setDocumentRoot(std::string path){
+		document_root = path;
+	}
+
+	/**
+	* Sets the document root file cache of each event loop: stat results and
+	* descriptors of recently served paths, missing paths included, are
+	* trusted for ttl seconds (256 entries and 1 second by default)
+	* @param number of entries, 0 disables the cache
+	* @param ttl in seconds
+	*/
+	void Server::setFileCache(int entries, int ttl){
+		file_cache_size = entries;
+		file_cache_ttl = ttl;
+	}
+
+	/**
+	* Sets how many headers of a request are parsed, the rest are ignored
+	* (64 by default)
+	* @param maximum number of headers
+	*/
+	void Server::setMaxRequestHeaders(int max){
+		max_request_headers = max;
+	}
+
+	/**
+	* Makes Swift verbose
+	*/
+	void Server::setVerbose(bool verbose){
+		this->verbose = verbose;
+	}
+
+	/**
+	* Prints welcome message
+	*/
+	void Server::printWelcome(){
+		std::cout << _SWIFT_WELCOME << " " << _SWIFT_VERSION << std::endl;
+	}
+
+	/**
+	* Converts a string to a method enum
+	*/
+	Method str_to_method(std::string request_method){
+		if(request_method == "GET") return Method::GET;
+		else if(request_method == "HEAD") return Method::HEAD;
+		else if(request_method == "POST") return Method::POST;
+		else if(request_method == "PUT") return Method::PUT;
+		else if(request_method == "DELETE") return Method::DELETE;
+		else if(request_method == "TRACE") return Method::TRACE;
+		else if(request_method == "OPTIONS") return Method::OPTIONS;
+		else if(request_method == "CONNECT") return Method::CONNECT;
+		else if(request_method == "PATCH") return Method::PATCH;
+		else throw ex_invalid_method;
+	}
+	
+	/* ======================================================== */
+	/* API Hook													*/
+	/* ======================================================== */
+
+	/**
+	* Constructs an API Hook with default settings
+	*/
+	Hook::Hook(){
+		is_resource = false;
+		preload_resource = false;
+		map_resource = false;
+		cache_control = _SWIFT_NO_CACHE;
+		auto_etag = false;
+		setCharset(Charset::getDefault());
+	}
+
+	/**
+	* Constructs an API Hook with a callback function
+	* @param request path string
+	* @param callback function pointer
+	*/
+	Hook::Hook(std::string request_path, Response* (*function)(Request*)){
+		is_resource = false;
+		preload_resource = false;
+		map_resource = false;
+		cache_control = _SWIFT_NO_CACHE;
+		auto_etag = false;
+		this->request_path = request_path;
+		this->callback_function = function;
+		setCharset(Charset::getDefault());
+	}
+
+	/**
+	* Constructs an API Hook that serves a static resource
+	* @param request path string
+	* @param resource path string
+	*/
+	Hook::Hook(std::string request_path, std::string resource_path){
+		is_resource = true;
+		preload_resource = true;
+		map_resource = false;
+		cache_control = _SWIFT_RESOURCE_CACHE;
+		auto_etag = false;
+		this->request_path = request_path;
+		this->resource_path = resource_path;
+		setCharset(Charset::getDefault());
+	}
+
+	/**
+	* Sets the API Hook's request path
+	* @param path
+	*/
+	void Hook::setRequestPath(std::string path){
+		request_path = path;
+	}
+
+	/**
+	* Returns the API Hook's request path
+	* @return path string
+	*/
+	std::string Hook::getRequestPath(){
+		return request_path;
+	}
+
+	/**
+	* Adds given method to the allowed list
+	* @param Method enum
+	*/
+	void Hook::allowMethod(Method m){
+		allowed_methods.insert(m);
+	}
+
+	/**
+	* Disallows the given method
+	* @param Method enum
+	*/
+	void Hook::disallowMethod(Method m){
+		allowed_methods.erase(m);
+	}
+
+	/**
+	* Indicates whether the given method is allowed by this API Hook
+	* @param Method enum: POST, GET...
+	* @return boolean
+	*/
+	bool Hook::isMethodAllowed(Method m){
+		return allowed_methods.count(m) > 0;
+	}
+
+	/**
+	* Sets the static resource path for this API Hook and make it a static resource
+	* @param path to resource
+	*/
+	void Hook::setResourcePath(std::string path){
 		is_resource = true;
 		resource_path = path;
 	}
@@ -551,6 +1750,31 @@ namespace swift{
 		preload_resource = preload;
 	}
 
+	/**
+	* Indicates if this API Hook preloads its static resource
+	* @return boolean
+	*/
+	bool Hook::isPreloadResource(){
+		return preload_resource;
+	}
+
+	/**
+	* Sets this API Hook to serve its static resource from a file mapping,
+	* shared with other processes through the page cache, or from a copy
+	* @param map
+	*/
+	void Hook::setMapResource(bool map){
+		map_resource = map;
+	}
+
+	/**
+	* Indicates if this API Hook serves its static resource from a file mapping
+	* @return boolean
+	*/
+	bool Hook::isMapResource(){
+		return map_resource;
+	}
+
 	/**
 	* Sets this API Hook as a static resource or not
 	* @param boolean
@@ -583,6 +1807,41 @@ namespace swift{
 		this->charset = charset;
 	}
 
+	/**
+	* Returns the Cache-Control policy of this API Hook
+	* @return Cache-Control header value
+	*/
+	std::string Hook::getCacheControl(){
+		return cache_control;
+	}
+
+	/**
+	* Sets the Cache-Control policy of this API Hook, e.g. "public,
+	* max-age=31536000, immutable" for versioned resources. Callback
+	* responses that set their own Cache-Control header keep it.
+	* @param Cache-Control header value
+	*/
+	void Hook::setCacheControl(std::string cache_control){
+		this->cache_control = cache_control;
+	}
+
+	/**
+	* Sets this API Hook to add an ETag hashed from the body to callback
+	* responses, and to answer matching If-None-Match requests with a 304
+	* @param etag
+	*/
+	void Hook::setAutoETag(bool etag){
+		auto_etag = etag;
+	}
+
+	/**
+	* Indicates if this API Hook adds body hash ETags to callback responses
+	* @return boolean
+	*/
+	bool Hook::isAutoETag(){
+		return auto_etag;
+	}
+
 	/**
 	* Sets the callback associated with this API Hook
 	* @param void function
@@ -600,6 +1859,42 @@ namespace swift{
 		return resp;
 	}
 
+	/* ======================================================== */
+	/* String view												*/
+	/* ======================================================== */
+
+	/**
+	* Returns a view of part of this view
+	* @param first character
+	* @param number of characters, up to the end by default
+	* @return view
+	*/
+	StringView StringView::substr(size_t pos, size_t count) const {
+		if(pos > len) pos = len;
+		if(count > len - pos) count = len - pos;
+		return StringView(ptr + pos, count);
+	}
+
+	/**
+	* Finds a character
+	* @param character
+	* @param position to start from
+	* @return position of the character, or npos
+	*/
+	size_t StringView::find(char c, size_t pos) const {
+		if(pos >= len) return npos;
+		const char* found = (const char*) memchr(ptr + pos, c, len - pos);
+		return found == nullptr ? npos : found - ptr;
+	}
+
+	bool StringView::operator==(const StringView& other) const {
+		return len == other.len && (len == 0 || memcmp(ptr, other.ptr, len) == 0);
+	}
+
+	std::ostream& operator<<(std::ostream& out, const StringView& view){
+		return out.write(view.data(), view.size());
+	}
+
 	/* ======================================================== */
 	/* Request													*/
 	/* ======================================================== */
@@ -607,107 +1902,225 @@ namespace swift{
 	/**
 	* Constructs a blank request object
 	*/
-	Request::Request(){}
+	Request::Request(){
+		conn = nullptr;
+		request_method = Method::GET;
+		query_parsed = cookies_parsed = true;
+	}
 
 	/**
-	* Constructs a Request object from a Mongoose connection object
+	* Constructs a Request object from a Mongoose connection object, nothing
+	* is copied: headers, query parameters and cookies are parsed when asked for
 	*/
 	Request::Request(struct mg_connection* conn){
 
 		// Null pointer?
 		if(conn == nullptr) throw ex_null_request;
-		
-		// Copy all data from the Mongoose connection struct
-		if(conn->request_method != nullptr){
-			request_method_str = std::string(conn->request_method);
-			// Parse the method
-			request_method = str_to_method(request_method_str);
-		}else{
-			throw ex_invalid_method;
-		}
-		
-		if(conn->uri != nullptr){
-			uri = std::string(conn->uri);
-		}else{
-			throw ex_null_uri;
-		}
-		
-		if(conn->http_version != nullptr){
-			http_version = std::string(conn->http_version);
-		}else{
-			throw ex_null_http_version;
-		}
-		
-		if(conn->query_string != nullptr){
-			query_string = std::string(conn->query_string);
-		}else{
-			query_string = "";
-		}
+		this->conn = conn;
 
-		// IP Addresses
-		if(conn->remote_ip != nullptr) remote_ip = std::string(conn->remote_ip);
-		if(conn->local_ip != nullptr) local_ip = std::string(conn->local_ip);
-		
-		// Ports
-		remote_port = conn->remote_port;
-		local_port = conn->local_port;
+		if(conn->request_method == nullptr) throw ex_invalid_method;
+		if(conn->uri == nullptr) throw ex_null_uri;
+		if(conn->http_version == nullptr) throw ex_null_http_version;
 
-		// Headers
-		// @TODO
+		request_method = str_to_method(conn->request_method);
+		query_parsed = cookies_parsed = false;
+	}
 
-		// Contents
-		if(conn->content != nullptr) content = std::string(conn->content);
-		else content = "";
-		content_len = conn->content_len;
+	/**
+	* Decodes the query string into query_params, the first of repeated
+	* parameters wins
+	*/
+	void Request::parseQuery(){
+		query_parsed = true;
+		StringView query = getQueryString();
+
+		size_t pos = 0;
+		while(pos < query.size()){
+			size_t amp = query.find('&', pos);
+			StringView pair = query.substr(pos, amp == StringView::npos ? StringView::npos : amp - pos);
+			pos = amp == StringView::npos ? query.size() : amp + 1;
+			if(pair.empty()) continue;
+
+			size_t eq = pair.find('=');
+			StringView name = pair.substr(0, eq);
+			StringView value = eq == StringView::npos ? StringView() : pair.substr(eq + 1);
+
+			// Decoding never lengthens
+			std::string decoded_name(name.size() + 1, '\0');
+			std::string decoded_value(value.size() + 1, '\0');
+			decoded_name.resize(mg_url_decode(name.data(), name.size(), &decoded_name[0], decoded_name.size(), 1));
+			decoded_value.resize(mg_url_decode(value.data(), value.size(), &decoded_value[0], decoded_value.size(), 1));
+			query_params.insert(std::make_pair(decoded_name, decoded_value));
+		}
+	}
 
+	/**
+	* Splits the Cookie header into cookies, values are left as sent
+	*/
+	void Request::parseCookies(){
+		cookies_parsed = true;
+		StringView header = getHeader(MG_HEADER_COOKIE);
+
+		size_t pos = 0;
+		while(pos < header.size()){
+			size_t semi = header.find(';', pos);
+			StringView pair = header.substr(pos, semi == StringView::npos ? StringView::npos : semi - pos);
+			pos = semi == StringView::npos ? header.size() : semi + 1;
+
+			while(!pair.empty() && pair[0] == ' ') pair = pair.substr(1);
+			size_t eq = pair.find('=');
+			if(eq == 0 || eq == StringView::npos) continue;
+
+			StringView value = pair.substr(eq + 1);
+			while(!value.empty() && value[value.size() - 1] == ' ') value = value.substr(0, value.size() - 1);
+			if(value.size() >= 2 && value[0] == '"' && value[value.size() - 1] == '"'){
+				value = value.substr(1, value.size() - 2);
+			}
+			cookies.insert(std::make_pair(pair.substr(0, eq).str(), value));
+		}
 	}
 
 	Method Request::getMethod(){
 		return request_method;
 	}
 
-	std::string Request::getMethodStr(){
-		return request_method_str;
+	StringView Request::getMethodStr(){
+		return conn == nullptr ? StringView() : StringView(conn->request_method);
+	}
+
+	/**
+	* Returns the URL-decoded URI
+	*/
+	StringView Request::getURI(){
+		return conn == nullptr ? StringView() : StringView(conn->uri);
+	}
+
+	/**
+	* Returns the HTTP version, e.g. "1.1"
+	*/
+	StringView Request::getHTTPVersion(){
+		return conn == nullptr ? StringView() : StringView(conn->http_version);
 	}
 
-	std::string Request::getURI(){
-		return uri;
+	/**
+	* Returns the URL part after '?', still encoded
+	*/
+	StringView Request::getQueryString(){
+		return conn == nullptr ? StringView() : StringView(conn->query_string);
 	}
 
-	std::string Request::getHTTPVersion(){
-		return http_version;
+	bool Request::hasQueryParam(const std::string& name){
+		if(!query_parsed) parseQuery();
+		return query_params.find(name) != query_params.end();
 	}
 
-	std::string Request::getQueryString(){
-		return query_string;
+	/**
+	* Returns a URL-decoded query string parameter
+	* @param parameter name
+	* @return value, empty if missing
+	*/
+	StringView Request::getQueryParam(const std::string& name){
+		if(!query_parsed) parseQuery();
+		std::map<std::string, std::string>::iterator it = query_params.find(name);
+		return it == query_params.end() ? StringView() : StringView(it->second);
 	}
 
-	std::string Request::getRemoteIP(){
-		return remote_ip;
+	/**
+	* Returns the client's IP address, formatted on first use
+	*/
+	StringView Request::getRemoteIP(){
+		return conn == nullptr ? StringView() : StringView(mg_remote_ip(conn));
 	}
 
-	std::string Request::getLocalIP(){
-		return local_ip;
+	/**
+	* Returns the IP address the request came in on, formatted on first use
+	*/
+	StringView Request::getLocalIP(){
+		return conn == nullptr ? StringView() : StringView(mg_local_ip(conn));
 	}
 
 	unsigned short Request::getRemotePort(){
-		return remote_port;
+		return conn == nullptr ? 0 : conn->remote_port;
 	}
 
 	unsigned short Request::getLocalPort(){
-		return local_port;
+		if(conn == nullptr) return 0;
+		mg_local_ip(conn);
+		return conn->local_port;
 	}
 
-	std::string Request::getContent(){
-		return content;
+	/**
+	* Returns the body (or websocket message), binary data included
+	*/
+	StringView Request::getContent(){
+		if(conn == nullptr || conn->content == nullptr) return StringView();
+		return StringView(conn->content, conn->content_len);
 	}
 
 	size_t Request::getContentLen(){
-		return content_len;
+		return conn == nullptr ? 0 : conn->content_len;
 	}
 
 	int Request::getHeaderCount(){
-		return headers.size();
+		return conn == nullptr ? 0 : conn->num_headers;
+	}
+
+	/**
+	* Returns the name of a header, in the order they were sent
+	* @param index, from 0 to getHeaderCount() - 1
+	* @return name, empty if out of range
+	*/
+	StringView Request::getHeaderName(int index){
+		if(index < 0 || index >= getHeaderCount()) return StringView();
+		return StringView(conn->http_headers[index].name);
+	}
+
+	/**
+	* Returns the value of a header, in the order they were sent
+	* @param index, from 0 to getHeaderCount() - 1
+	* @return value, empty if out of range
+	*/
+	StringView Request::getHeaderValue(int index){
+		if(index < 0 || index >= getHeaderCount()) return StringView();
+		return StringView(conn->http_headers[index].value);
+	}
+
+	bool Request::hasHeader(const char* name){
+		return conn != nullptr && mg_get_header(conn, name) != nullptr;
+	}
+
+	/**
+	* Returns the value of a header, the first one if repeated
+	* @param case-insensitive name
+	* @return value, empty if missing
+	*/
+	StringView Request::getHeader(const char* name){
+		return conn == nullptr ? StringView() : StringView(mg_get_header(conn, name));
+	}
+
+	/**
+	* Returns the value of a well-known header without comparing names
+	* @param header id
+	* @return value, empty if missing
+	*/
+	StringView Request::getHeader(enum mg_header_id id){
+		return conn == nullptr ? StringView() : StringView(mg_get_known_header(conn, id));
+	}
+
+	bool Request::hasCookie(const std::string& name){
+		if(!cookies_parsed) parseCookies();
+		return cookies.find(name) != cookies.end();
+	}
+
+	/**
+	* Returns the value of a cookie
+	* @param cookie name
+	* @return value, empty if missing
+	*/
+	StringView Request::getCookie(const std::string& name){
+		if(!cookies_parsed) parseCookies();
+		std::map<std::string, StringView>::iterator it = cookies.find(name);
+		return it == cookies.end() ? StringView() : it->second;
 	}
 
 	/* ======================================================== */
@@ -717,7 +2130,24 @@ namespace swift{
 	/**
 	* Constructs a blank Response object
 	*/
-	Response::Response(){}
+	Response::Response(){
+		content = nullptr;
+		content_len = 0;
+		content_fd = -1;
+		binary_mode = false;
+	}
+
+	/**
+	* Destroys the Response along with its content and headers
+	*/
+	Response::~Response(){
+		delete[] content;
+		if(content_fd >= 0) close(content_fd);
+		while(!headers.empty()){
+			delete headers.front();
+			headers.pop();
+		}
+	}
 
 	/**
 	* Adds a new header object to the response
@@ -752,6 +2182,8 @@ namespace swift{
 	* @return boolean
 	*/
 	bool Response::hasHeader(std::string name){
+		// Header names are case-insensitive
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
 		return header_names.count(name) > 0;
 	}
 
@@ -769,9 +2201,41 @@ namespace swift{
 	* @param char length of content
 	*/
 	void Response::setContent(char* content, int length){
+		delete[] this->content;
 		this->content_len = length;
 		this->content = new char[length];
-		strcpy(this->content, content);
+		memcpy(this->content, content, length);
+	}
+
+	/**
+	* Makes an open file the content of the response, it is sent without
+	* being read into memory. The response takes ownership of the file.
+	* @param file descriptor
+	* @param byte length of the file
+	*/
+	void Response::setContentFile(int fd, int length){
+		if(content_fd >= 0) close(content_fd);
+		this->content_len = length;
+		this->content_fd = fd;
+	}
+
+	/**
+	* Returns the file sent as content, or -1
+	* @return file descriptor
+	*/
+	int Response::getContentFile(){
+		return content_fd;
+	}
+
+	/**
+	* Detaches the content file from the response, the caller becomes its owner
+	* @return file descriptor
+	*/
+	int Response::releaseContentFile(){
+		int released = content_fd;
+		content_fd = -1;
+		content_len = 0;
+		return released;
 	}
 
 	/**
@@ -782,6 +2246,17 @@ namespace swift{
 		return content;
 	}
 
+	/**
+	* Detaches the content from the response, the caller becomes its owner
+	* @return char*
+	*/
+	char* Response::releaseContent(){
+		char* released = content;
+		content = nullptr;
+		content_len = 0;
+		return released;
+	}
+
 	/**
 	* Returns the lenght of the content
 	* @return size_t
@@ -851,6 +2326,373 @@ namespace swift{
 		return headers;
 	}
 
+	/* ======================================================== */
+	/* Resource Cache											*/
+	/* ======================================================== */
+
+	/**
+	* Constructs an empty cache
+	*/
+	ResourceCache::ResourceCache(){
+		max_size = 0;
+		size = 0;
+		generation = 0;
+		hits = 0;
+		misses = 0;
+		evictions = 0;
+	}
+
+	/**
+	* Destroys the cache, responses being sent keep their content
+	*/
+	ResourceCache::~ResourceCache(){
+		while(!lru.empty()){
+			release(*lru.back());
+			delete lru.back();
+			lru.pop_back();
+		}
+	}
+
+	/**
+	* Looks up a resource and marks it as recently used
+	* @param file path
+	* @param resource found, its content reference is owned by the caller
+	* @return true on a hit
+	*/
+	bool ResourceCache::get(std::string file_path, CachedResource& out){
+		std::lock_guard<std::mutex> guard(lock);
+
+		std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(file_path);
+		if(it == entries.end()){
+			misses++;
+			return false;
+		}
+
+		lru.splice(lru.begin(), lru, it->second);
+		hits++;
+		out = *lru.front();
+		mg_shared_buf_ref(out.content);
+		if(out.body != NULL) mg_shared_buf_ref(out.body);
+		return true;
+	}
+
+	/**
+	* Reads a file into the cache behind its serialized headers, evicting
+	* the least recently used resources to stay within the maximum size
+	* @param file path
+	* @param open file
+	* @param file stats
+	* @param headers sent before the file
+	* @param resource loaded, with its header offsets set by the caller. Its
+	* content reference is owned by the caller.
+	* @return false if the file couldn't be read or is larger than the cache
+	*/
+	bool ResourceCache::load(std::string file_path, int fd, struct stat& file_stat, std::string headers, CachedResource& out){
+		size_t file_size = file_stat.st_size;
+		size_t total = headers.size() + file_size;
+		unsigned long loaded_generation;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(total > max_size) return false;
+			loaded_generation = generation;
+		}
+
+		// Read outside the lock, other threads keep serving hits
+		char* data = new char[total];
+		memcpy(data, headers.data(), headers.size());
+
+		size_t done = 0;
+		ssize_t n;
+		while(done < file_size && (n = pread(fd, data + headers.size() + done, file_size - done, done)) > 0){
+			done += n;
+		}
+
+		struct mg_shared_buf* content;
+		if(done < file_size || (content = mg_shared_buf_new(data, total, Server::freeContent)) == NULL){
+			delete[] data;
+			return false;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		// Another thread may have loaded it meanwhile
+		std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(file_path);
+		if(it != entries.end()){
+			mg_shared_buf_unref(content);
+			out = **it->second;
+			mg_shared_buf_ref(out.content);
+			if(out.body != NULL) mg_shared_buf_ref(out.body);
+			return true;
+		}
+
+		CachedResource* res = new CachedResource();
+		res->file_path = file_path;
+		res->content = content;
+		res->body = NULL;
+		res->body_offset = 0;
+		res->validator_len = out.validator_len;
+		res->type_end = out.type_end;
+		res->header_len = headers.size();
+		describe(res, file_stat);
+
+		// A file that changed while it was read is sent but not kept
+		if(generation != loaded_generation){
+			out = *res;
+			delete res;
+			return true;
+		}
+
+		while(!lru.empty() && size + total > max_size){
+			evict();
+		}
+
+		lru.push_front(res);
+		entries[file_path] = lru.begin();
+		size += total;
+
+		out = *res;
+		mg_shared_buf_ref(out.content);
+		return true;
+	}
+
+	/**
+	* Drops the least recently used resource, must hold the lock
+	*/
+	void ResourceCache::evict(){
+		remove(--lru.end());
+		evictions++;
+	}
+
+	/**
+	* Drops a resource, must hold the lock
+	* @param resource position in the LRU list
+	*/
+	void ResourceCache::remove(std::list<CachedResource*>::iterator it){
+		CachedResource* res = *it;
+		lru.erase(it);
+		entries.erase(res->file_path);
+
+		// Mapped bodies live in the page cache, only their headers count
+		size -= res->header_len + (res->body == NULL ? res->size : 0);
+
+		// Responses still sending it hold their own reference
+		release(*res);
+		delete res;
+	}
+
+	/**
+	* Maps a file into the cache behind its serialized headers. The file is
+	* not read, its pages are shared through the page cache and the kernel
+	* reclaims them under memory pressure.
+	* @param file path
+	* @param open file
+	* @param file stats
+	* @param headers sent before the file
+	* @param mongoose mapping flags, MG_MAP_WILLNEED and MG_MAP_HUGEPAGE
+	* @param resource mapped, with its header offsets set by the caller. Its
+	* content references are owned by the caller.
+	* @return false if the file couldn't be mapped
+	*/
+	bool ResourceCache::map(std::string file_path, int fd, struct stat& file_stat, std::string headers, int flags, CachedResource& out){
+		unsigned long mapped_generation;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(headers.size() > max_size) return false;
+			mapped_generation = generation;
+		}
+
+		struct mg_shared_buf* body = mg_shared_buf_map(fd, file_stat.st_size, flags);
+		if(body == NULL) return false;
+
+		char* data = new char[headers.size()];
+		memcpy(data, headers.data(), headers.size());
+
+		struct mg_shared_buf* content = mg_shared_buf_new(data, headers.size(), Server::freeContent);
+		if(content == NULL){
+			delete[] data;
+			mg_shared_buf_unref(body);
+			return false;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		// Another thread may have mapped it meanwhile
+		std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(file_path);
+		if(it != entries.end()){
+			mg_shared_buf_unref(content);
+			mg_shared_buf_unref(body);
+			out = **it->second;
+			mg_shared_buf_ref(out.content);
+			if(out.body != NULL) mg_shared_buf_ref(out.body);
+			return true;
+		}
+
+		CachedResource* res = new CachedResource();
+		res->file_path = file_path;
+		res->content = content;
+		res->body = body;
+		res->body_offset = 0;
+		res->validator_len = out.validator_len;
+		res->type_end = out.type_end;
+		res->header_len = headers.size();
+		describe(res, file_stat);
+
+		// A file that changed while it was mapped is sent but not kept
+		if(generation != mapped_generation){
+			out = *res;
+			delete res;
+			return true;
+		}
+
+		while(!lru.empty() && size + headers.size() > max_size){
+			evict();
+		}
+
+		lru.push_front(res);
+		entries[file_path] = lru.begin();
+		size += headers.size();
+
+		out = *res;
+		mg_shared_buf_ref(out.content);
+		mg_shared_buf_ref(out.body);
+		return true;
+	}
+
+	/**
+	* Checks, at most once a second, that a mapped resource still matches its
+	* file. A changed file is dropped from the cache to be mapped again, the
+	* old mapping stays valid for the responses still sending it.
+	* @param resource returned by the cache
+	* @return false if the resource is out of date
+	*/
+	bool ResourceCache::isCurrent(CachedResource& res){
+		// Copies don't change with their file
+		if(res.body == NULL) return true;
+
+		time_t now = time(NULL);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(res.file_path);
+			if(it == entries.end() || (*it->second)->content != res.content) return true;
+			if((*it->second)->checked == now) return true;
+			(*it->second)->checked = now;
+		}
+
+		struct stat file_stat;
+		if(stat(res.file_path.c_str(), &file_stat) == 0 && file_stat.st_ino == res.ino &&
+			file_stat.st_mtime == res.mtime && (size_t) file_stat.st_size == res.size){
+			return true;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(res.file_path);
+		if(it != entries.end() && (*it->second)->content == res.content){
+			remove(it->second);
+		}
+		return false;
+	}
+
+	/**
+	* Drops a resource whose file changed. Responses still sending it keep
+	* their content, and loads that started before are not kept.
+	* @param file path
+	*/
+	void ResourceCache::invalidate(std::string file_path){
+		std::lock_guard<std::mutex> guard(lock);
+		generation++;
+
+		std::map<std::string, std::list<CachedResource*>::iterator>::iterator it = entries.find(file_path);
+		if(it != entries.end()){
+			remove(it->second);
+		}
+	}
+
+	/**
+	* Copies the size, identity and ETag of a resource's file
+	* @param resource
+	* @param file stats
+	*/
+	void ResourceCache::describe(CachedResource* res, struct stat& file_stat){
+		res->size = file_stat.st_size;
+		res->ino = file_stat.st_ino;
+		res->mtime = file_stat.st_mtime;
+		res->checked = time(NULL);
+		snprintf(res->etag, sizeof(res->etag), "%s", fileETag(file_stat).c_str());
+	}
+
+	/**
+	* Takes new content references on a resource
+	* @param resource
+	*/
+	void ResourceCache::retain(CachedResource& res){
+		mg_shared_buf_ref(res.content);
+		if(res.body != NULL) mg_shared_buf_ref(res.body);
+	}
+
+	/**
+	* Releases the content references of a resource returned by the cache
+	* @param resource
+	*/
+	void ResourceCache::release(CachedResource& res){
+		mg_shared_buf_unref(res.content);
+		if(res.body != NULL) mg_shared_buf_unref(res.body);
+	}
+
+	/**
+	* Sets the maximum total size of cached resources. Resources already in
+	* the cache are only evicted to make room for new ones.
+	* @param size in bytes
+	*/
+	void ResourceCache::setMaxSize(size_t max_size){
+		std::lock_guard<std::mutex> guard(lock);
+		this->max_size = max_size;
+	}
+
+	/**
+	* Returns the maximum total size of cached resources
+	* @return size in bytes
+	*/
+	size_t ResourceCache::getMaxSize(){
+		std::lock_guard<std::mutex> guard(lock);
+		return max_size;
+	}
+
+	/**
+	* Returns the total size of cached resources
+	* @return size in bytes
+	*/
+	size_t ResourceCache::getSize(){
+		std::lock_guard<std::mutex> guard(lock);
+		return size;
+	}
+
+	/**
+	* Returns the number of lookups that found their resource
+	* @return hit count
+	*/
+	unsigned long ResourceCache::getHits(){
+		std::lock_guard<std::mutex> guard(lock);
+		return hits;
+	}
+
+	/**
+	* Returns the number of lookups that didn't find their resource
+	* @return miss count
+	*/
+	unsigned long ResourceCache::getMisses(){
+		std::lock_guard<std::mutex> guard(lock);
+		return misses;
+	}
+
+	/**
+	* Returns the number of resources dropped to make room for others
+	* @return eviction count
+	*/
+	unsigned long ResourceCache::getEvictions(){
+		std::lock_guard<std::mutex> guard(lock);
+		return evictions;
+	}
+
 	/* ======================================================== */
 	/* Header													*/
 	/* ======================================================== */
@@ -907,6 +2749,128 @@ namespace swift{
 		return ltrim(rtrim(s));
 	}
 
+	/**
+	* Returns the current time formatted for the Date header. It is only
+	* formatted again when the second changes.
+	* @return date string
+	*/
+	const char* currentHTTPDate(){
+		static thread_local time_t date_time = 0;
+		static thread_local char date[64];
+
+		time_t now = time(NULL);
+		if(now != date_time){
+			struct tm tm;
+			gmtime_r(&now, &tm);
+			strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+			date_time = now;
+		}
+		return date;
+	}
+
+	/**
+	* Formats a time for HTTP headers such as Last-Modified
+	* @param time
+	* @return date string
+	*/
+	std::string formatHTTPDate(time_t t){
+		char date[64];
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		return date;
+	}
+
+	/**
+	* Builds the ETag of a file from its modification time and size. It is
+	* weak: two writes of the same size within a second get the same tag.
+	* @param file stats
+	* @return ETag, W/"..."
+	*/
+	std::string fileETag(struct stat& file_stat){
+		char etag[48];
+		snprintf(etag, sizeof(etag), "W/\"%lx.%lld\"", (unsigned long) file_stat.st_mtime, (long long) file_stat.st_size);
+		return etag;
+	}
+
+	/**
+	* Parses a Range header (RFC 7233) into the byte ranges of a resource
+	* @param header value
+	* @param byte size of the resource
+	* @param offset and length of each satisfiable range
+	* @return number of ranges, 0 if none is satisfiable, or -1 if the
+	* header is invalid or asks for too many ranges and must be ignored
+	*/
+	int parseRanges(const char* header, size_t size, std::vector<std::pair<size_t, size_t> >& ranges){
+		if(strncasecmp(header, "bytes=", 6) != 0) return -1;
+
+		const char* p = header + 6;
+		int count = 0;
+		ranges.clear();
+
+		while(*p != '\0'){
+			while(*p == ' ' || *p == '\t' || *p == ',') p++;
+			if(*p == '\0') break;
+			if(++count > _SWIFT_MAX_RANGES) return -1;
+
+			char* end;
+			unsigned long long first = 0, last = 0;
+			bool suffix = *p == '-';
+
+			if(!suffix){
+				if(!isdigit((unsigned char) *p)) return -1;
+				first = strtoull(p, &end, 10);
+				p = end;
+				if(*p != '-') return -1;
+			}
+			p++;
+
+			bool open_ended = !isdigit((unsigned char) *p);
+			if(!open_ended){
+				last = strtoull(p, &end, 10);
+				p = end;
+			}else if(suffix){
+				return -1;
+			}
+
+			while(*p == ' ' || *p == '\t') p++;
+			if(*p != ',' && *p != '\0') return -1;
+
+			if(suffix){
+				// Last bytes of the resource
+				if(last == 0 || size == 0) continue;
+				if(last > size) last = size;
+				ranges.push_back(std::make_pair(size - (size_t) last, (size_t) last));
+			}else{
+				if(!open_ended && last < first) return -1;
+				if(first >= size) continue;
+				if(open_ended || last >= size) last = size - 1;
+				ranges.push_back(std::make_pair((size_t) first, (size_t) (last - first + 1)));
+			}
+		}
+
+		if(count == 0) return -1;
+		return ranges.size();
+	}
+
+	/**
+	* Builds a strong ETag from a 64-bit FNV-1a hash of some content
+	* @param content
+	* @param content length
+	* @return quoted ETag
+	*/
+	std::string contentETag(const char* data, size_t len){
+		unsigned long long hash = 14695981039346656037ULL;
+		for(size_t i = 0; i < len; i++){
+			hash ^= (unsigned char) data[i];
+			hash *= 1099511628211ULL;
+		}
+
+		char etag[24];
+		snprintf(etag, sizeof(etag), "\"%016llx\"", hash);
+		return etag;
+	}
+
 	/* ======================================================== */
 	/* MIME														*/
 	/* ======================================================== */
@@ -4,6 +4,9 @@
 * All rights reserved
 */
 
+#ifndef SWIFT_HEADER_INCLUDED
+#define SWIFT_HEADER_INCLUDED
+
 #include <string.h>
 #include <exception>
 #include <map>
@@ -21,6 +24,14 @@
 #include <cctype>
 #include <locale>
 #include <iterator>
+#include <unistd.h> // dup()
+#include <fcntl.h> // open()
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/inotify.h> // resource change notifications
+#endif
 
 #include "mongoose.h"
 
@@ -31,6 +42,15 @@
 #define _SWIFT_MAX_SERVER_THREADS 255
 #define _SWIFT_DEFAULT_PORT 277
 #define _SWIFT_DEFAULT_CACHE_SIZE 2147483648 // 2GB
+#define _SWIFT_CACHE_ADMIT_SIZE 65536 // Larger resources are only cached if preloaded
+#define _SWIFT_HUGE_PAGE_SIZE 2097152 // Mapped resources this large may use huge pages
+#define _SWIFT_READAHEAD_SIZE 1048576 // Read into the page cache before sendfile() by offload threads
+#define _SWIFT_MAX_RANGES 16 // Range requests with more ranges get the whole resource
+#define _SWIFT_PACK_MAGIC "SWPACK1" // Asset pack format, built by packer.cpp
+#define _SWIFT_PACK_ALIGN 4096 // Asset pack bodies start on page boundaries
+#define _SWIFT_NO_CACHE "max-age=0, post-check=0, pre-check=0, no-store, no-cache, must-revalidate"
+#define _SWIFT_RESOURCE_CACHE "no-cache" // Kept by browsers, revalidated with ETag/Last-Modified
+#define _SWIFT_IMMUTABLE_CACHE "public, max-age=31536000, immutable" // Fingerprinted aliases
 
 namespace swift{
 
@@ -51,24 +71,52 @@ namespace swift{
 			std::string getValue();
 	};
 
-	// Swift Request class
+	// Non-owning view of characters, like C++17's std::string_view
+	class StringView {
+			const char* ptr;
+			size_t len;
+		public:
+			static const size_t npos = (size_t) -1;
+
+			StringView() : ptr(""), len(0) {}
+			StringView(const char* str) : ptr(str == nullptr ? "" : str), len(str == nullptr ? 0 : strlen(str)) {}
+			StringView(const char* data, size_t size) : ptr(data), len(size) {}
+			StringView(const std::string& str) : ptr(str.data()), len(str.size()) {}
+
+			const char* data() const { return ptr; }
+			size_t size() const { return len; }
+			bool empty() const { return len == 0; }
+			const char* begin() const { return ptr; }
+			const char* end() const { return ptr + len; }
+			char operator[](size_t i) const { return ptr[i]; }
+
+			// Copies, the only allocating members
+			std::string str() const { return std::string(ptr, len); }
+			operator std::string() const { return str(); }
+
+			StringView substr(size_t pos, size_t count = npos) const;
+			size_t find(char c, size_t pos = 0) const;
+			bool operator==(const StringView& other) const;
+			bool operator!=(const StringView& other) const { return !(*this == other); }
+	};
+
+	std::ostream& operator<<(std::ostream& out, const StringView& view);
+
+	// Swift Request class, a view of the request parsed by Mongoose: strings
+	// point into the connection's buffers and are valid until the callback returns
 	class Request {
-			Method request_method;				// "GET", "POST", etc
-			std::string request_method_str; 	// "GET", "POST", etc
-			std::string uri;            		// URL-decoded URI
-			std::string http_version;   		// E.g. "1.0", "1.1"
-			std::string query_string;   		// URL part after '?', not including '?', or NULL
+			struct mg_connection* conn;		// Mongoose connection
+			Method request_method;
 
-			std::string remote_ip;			// Max IPv6 string length is 45 characters
-			std::string local_ip;			// Local IP address
-			unsigned short remote_port; 	// Client's port
-			unsigned short local_port;		// Local port number
+			// Parsed on first use
+			bool query_parsed;
+			bool cookies_parsed;
+			std::map<std::string, std::string> query_params;	// URL-decoded
+			std::map<std::string, StringView> cookies;
 
-			std::queue<Header*> headers;
+			void parseQuery();
+			void parseCookies();
 
-			std::string content;        // POST (or websocket message) data, or NULL
-			size_t content_len;         // Data length
-		
 		public:
 			// Constructor/destructor
 			Request();
@@ -76,23 +124,37 @@ namespace swift{
 
 			// Getters/setters
 			Method getMethod();
-			std::string getMethodStr();
-			std::string getURI();
-			std::string getHTTPVersion();
-			std::string getQueryString();
-			std::string getRemoteIP();
-			std::string getLocalIP();
+			StringView getMethodStr();
+			StringView getURI();
+			StringView getHTTPVersion();
+			StringView getQueryString();
+			bool hasQueryParam(const std::string& name);
+			StringView getQueryParam(const std::string& name);
+			StringView getRemoteIP();
+			StringView getLocalIP();
 			unsigned short getRemotePort();
 			unsigned short getLocalPort();
-			std::string getContent();
+			StringView getContent();
 			size_t getContentLen();
+
+			// Headers
 			int getHeaderCount();
+			StringView getHeaderName(int index);
+			StringView getHeaderValue(int index);
+			bool hasHeader(const char* name);
+			StringView getHeader(const char* name);
+			StringView getHeader(enum mg_header_id id);
+
+			// Cookies
+			bool hasCookie(const std::string& name);
+			StringView getCookie(const std::string& name);
 	};
 
 	// Swift response class
 	class Response {
 			char* content;
 			int content_len;
+			int content_fd;		// File sent as content, or -1
 			bool binary_mode;
 
 			std::set<std::string> header_names;
@@ -103,6 +165,7 @@ namespace swift{
 		public:
 			// Constructor/destructor
 			Response();
+			~Response();
 
 			void addHeader(Header* header);
 			void addHeader(std::string name, std::string value);
@@ -111,6 +174,10 @@ namespace swift{
 
 			void setContent(char* content, int length);
 			char* getContent();
+			char* releaseContent();
+			void setContentFile(int fd, int length);
+			int getContentFile();
+			int releaseContentFile();
 			int getContentLen();
 
 			std::string getCharset();
@@ -125,6 +192,105 @@ namespace swift{
 			std::queue<Header*> getHeaderQueue();
 	};
 
+	// Static resource held in memory as a pre-serialized response, or
+	// described for a single response when it is sent from its file
+	struct CachedResource {
+		std::string file_path;
+		struct mg_shared_buf* content;	// Headers then body, shared with the responses sending it
+		struct mg_shared_buf* body;		// File mapping sent after the headers, or NULL
+		size_t body_offset;				// Where the body starts in the mapping
+		size_t validator_len;			// ETag, Last-Modified and Cache-Control, first in content
+		size_t type_end;				// End of the Content-Encoding and Content-Type lines that follow them
+		size_t header_len;
+		size_t size;					// Body size
+		char etag[48];
+
+		// File identity, checked to re-map mapped files when they change
+		ino_t ino;
+		time_t mtime;
+		time_t checked;
+	};
+
+	// Asset pack or embedded resource, its variants are sent from the
+	// pack's mapping or from the binary's read-only data
+	struct PackedResource {
+		CachedResource identity;
+		CachedResource gzip;			// content is NULL if there is no gzip variant
+	};
+
+	// Asset pack layout: a PackHeader, count PackEntry records, the string
+	// table, then the bodies. Integers are in the byte order of the host.
+	struct PackHeader {
+		char magic[8];
+		uint32_t count;
+		uint32_t strings_size;			// String table, after the entries
+	};
+
+	struct PackBody {
+		uint64_t offset;				// From the start of the pack, aligned to _SWIFT_PACK_ALIGN
+		uint64_t size;
+	};
+
+	struct PackEntry {
+		uint32_t path_offset;			// Path inside the packed directory, in the string table
+		uint32_t path_len;
+		uint32_t mime_offset;			// MIME type, empty if unknown
+		uint32_t mime_len;
+		uint32_t etag_offset;			// Quoted ETag hashed from the body
+		uint32_t etag_len;
+		int64_t mtime;
+		PackBody body;
+		PackBody gzip_body;				// Size 0 if there is no gzip variant
+	};
+
+	// Resource compiled into the binary, generated by 'make embed'
+	struct EmbeddedResource {
+		const char* path;				// Inside the embedded directory
+		const char* mime;				// MIME type, empty if unknown
+		const char* etag;				// Quoted ETag hashed from the data
+		int64_t mtime;
+		const unsigned char* data;
+		size_t size;
+	};
+
+	// Static resources in memory, bounded in size with LRU eviction
+	class ResourceCache {
+			std::list<CachedResource*> lru;		// Most recently used first
+			std::map<std::string, std::list<CachedResource*>::iterator> entries;
+			std::mutex lock;					// Shared by all event loops
+
+			size_t max_size;
+			size_t size;
+			unsigned long generation;			// Incremented by each invalidation
+			unsigned long hits;
+			unsigned long misses;
+			unsigned long evictions;
+
+			void evict();
+			void remove(std::list<CachedResource*>::iterator it);
+
+		public:
+			// Constructor/destructor
+			ResourceCache();
+			~ResourceCache();
+
+			bool get(std::string file_path, CachedResource& out);
+			bool load(std::string file_path, int fd, struct stat& file_stat, std::string headers, CachedResource& out);
+			bool map(std::string file_path, int fd, struct stat& file_stat, std::string headers, int flags, CachedResource& out);
+			bool isCurrent(CachedResource& res);
+			void invalidate(std::string file_path);
+			static void describe(CachedResource* res, struct stat& file_stat);
+			static void retain(CachedResource& res);
+			static void release(CachedResource& res);
+
+			void setMaxSize(size_t max_size);
+			size_t getMaxSize();
+			size_t getSize();
+			unsigned long getHits();
+			unsigned long getMisses();
+			unsigned long getEvictions();
+	};
+
 	// API Hook
 	class Hook {
 			std::string request_path;			// request path
@@ -132,7 +298,10 @@ namespace swift{
 			bool is_resource;					// is this a resource?
 			std::string resource_path; 			// path to resource file
 			bool preload_resource;				// preload the resource?
+			bool map_resource;					// serve the resource from a file mapping?
 			std::string charset;				// charset (if resource is text)
+			std::string cache_control;			// Cache-Control header value
+			bool auto_etag;						// add a body hash ETag to callback responses?
 
 			std::set<Method> allowed_methods;	// POST, GET... (overrides server settings)
 			Response* (*callback_function)(Request*); 	// pointer to function
@@ -155,10 +324,17 @@ namespace swift{
 			void setResourcePath(std::string path);
 			std::string getResourcePath();
 			void setPreloadResource(bool preload);
+			bool isPreloadResource();
+			void setMapResource(bool map);
+			bool isMapResource();
 			void setIsResource(bool resource);
 			bool isResource();
 			std::string getCharset();
 			void setCharset(std::string charset);
+			std::string getCacheControl();
+			void setCacheControl(std::string cache_control);
+			void setAutoETag(bool etag);
+			bool isAutoETag();
 
 			void setCallback(Response* (*function)(Request*));
 			Response* getCallbackResponse(Request* req);
@@ -170,12 +346,39 @@ namespace swift{
 			// Mongoose server
 			struct mg_server* mgserver;
 
+			// Additional Mongoose servers, each polled by its own thread
+			std::vector<struct mg_server*> reactors;
+
 			// Request paths
 			std::map<std::string,Hook*> endpoints;
 
+			// Static resources in memory
+			ResourceCache cache;
+
+			// Asset pack, embedded and fingerprinted resources by request path, and the pack mappings
+			std::map<std::string, PackedResource> packed;
+			std::map<std::string, std::string> fingerprints;	// Request path to fingerprinted alias
+			std::map<std::string, std::string> previous_fingerprints;	// Alias before the current one, still served
+			std::mutex packed_lock;
+			std::vector<struct mg_shared_buf*> packs;
+
 			// Various settings
 			size_t max_cache_size;
 			bool verbose;
+			bool io_uring;
+			bool huge_pages;
+			bool watch_resources;
+			bool fingerprint_resources;
+			int accept_budget;
+			int pipeline_budget;
+			std::string document_root;
+			int file_cache_size;
+			int file_cache_ttl;
+			int max_request_headers;
+
+			// Resource directories watched for changes
+			int inotify_fd;
+			std::map<int, std::string> watched_dirs;	// Watch descriptor to path prefix
 
 			// Global server restrictions - default settings, overridden by each API hook
 			std::set<Method> allowed_methods;
@@ -190,31 +393,94 @@ namespace swift{
 			static Server* newServer(); 	// factory
 			void Start();
 			void Start(int port);
+			void Start(int port, int num_threads);
 
 			// API
 			void addResource(std::string request_path, std::string file_path);
 			void addResource(std::string request_path, std::string file_path, bool preload);
+			void addResource(std::string request_path, std::string file_path, bool preload, bool map);
 			void addHook(Hook* hook);
+			bool mountPack(std::string prefix, std::string pack_path);
+			bool addEmbeddedResource(std::string request_path, const EmbeddedResource& resource);
+			void addEmbeddedResources(std::string prefix, const EmbeddedResource* resources, size_t count);
 
 			// MISC
 			void setCacheSize(size_t size);
 			void setVerbose(bool);
+			void setIOUring(bool enable);
+			void setHugePages(bool enable);
+			void setWatchResources(bool enable);
+			void setFingerprintResources(bool enable);
+			std::string getFingerprintedPath(std::string request_path);
+			void setAcceptBudget(int budget);
+			void setPipelineBudget(int budget);
+			void setDocumentRoot(std::string path);
+			void setFileCache(int entries, int ttl);
+			void setMaxRequestHeaders(int max);
+			ResourceCache* getCache();
+
+			static void freeContent(void* content);
 
 		private:
 
+			// Resource file opened and read by an offload thread
+			struct ResourceLoad {
+				Server* server;
+				Hook* hook;
+				bool found;
+				int fd;						// File to send the body from, or -1
+				CachedResource res;
+			};
+
 			static int requestHandler(struct mg_connection *conn, enum mg_event ev);
-			static void processRequest(Request* req, struct mg_connection *conn);
+			static bool processRequest(Request* req, struct mg_connection *conn);
+			static void* pollReactor(void* reactor);
+			static void* watchResources(void* server);
 
 			static bool hasServer(int server_id);
 			static bool addServer(Server* server, int server_id);
 			static Server* getServer(int server_id);
 
+			struct mg_server* createReactor();
 			bool addEndpoint(std::string path, Hook* hook);
 			bool hasEndpointWithPath(std::string path);
 			Hook* getEndpoint(std::string path);
-			Response* serveResource(std::string file_path);
+			int serveStatic(struct mg_connection *conn);
+			void openResource(ResourceLoad* load);
+			void sendLoadedResource(ResourceLoad* load, struct mg_connection *conn);
+			static void loadResource(void* load);
+			static void resourceLoaded(struct mg_connection *conn, void* load);
+			bool servePacked(struct mg_connection *conn);
+			bool addPackedResource(std::string request_path, struct mg_shared_buf* data, PackBody& body, PackBody* gzip_body,
+				std::string etag, time_t mtime, std::string mime, bool fingerprint_only);
+			bool preparePackedResource(PackedResource& res, struct mg_shared_buf* data, PackBody& body, PackBody* gzip_body,
+				std::string etag, time_t mtime, std::string mime, std::string cache_control);
+			void addPacked(std::string request_path, PackedResource& res);
+			bool preparePacked(CachedResource& res, struct mg_shared_buf* pack, PackBody& body, std::string etag,
+				time_t mtime, std::string mime, std::string cache_control, const char* encoding, bool has_variants);
+			void fingerprintResource(Hook* hook);
+			static std::string fingerprintPath(std::string request_path, std::string hash);
+			static bool acceptsEncoding(const char* header, const char* coding);
+			void sendResource(CachedResource& res, int fd, struct mg_connection *conn);
+			void sendCachedResource(CachedResource& res, int fd, struct mg_connection *conn);
+			void sendRanges(CachedResource& res, int fd, std::vector<std::pair<size_t, size_t> >& ranges, struct mg_connection *conn);
+			void sendRangeNotSatisfiable(CachedResource& res, struct mg_connection *conn);
+			void sendBody(CachedResource& res, int fd, size_t offset, size_t len, struct mg_connection *conn);
+			bool isRangeCurrent(CachedResource& res, struct mg_connection *conn);
+			void sendNotModified(CachedResource& res, struct mg_connection *conn);
+			void preloadResource(Hook* hook);
+			bool startWatching();
+			void resourceChanged(std::string file_path, bool reload);
+			bool cacheResource(Hook* hook, int fd, struct stat& file_stat, CachedResource& res);
+			bool prepareResource(Hook* hook, struct stat& file_stat, CachedResource& res);
+			static std::string serializeResourceHeaders(Hook* hook, struct stat& file_stat, CachedResource& res);
+			static std::string serializeValidators(std::string etag, time_t mtime, std::string cache_control);
+			static std::string serializeHeaders(size_t size);
+			static std::string getResourceMIME(std::string file_path);
+			static std::string getContentType(std::string mime);
 
 			void sendResponse(Response* resp, struct mg_connection *conn);
+			void sendResponse(Response* resp, struct mg_connection *conn, bool not_modified);
 
 			// MISC
 			void printWelcome();
@@ -236,6 +502,12 @@ namespace swift{
 	std::string getMIMEByFilename(std::string filename);
 	bool isTextMIME(std::string MIME);
 
+	const char* currentHTTPDate();
+	std::string formatHTTPDate(time_t t);
+	std::string fileETag(struct stat& file_stat);
+	std::string contentETag(const char* data, size_t len);
+	int parseRanges(const char* header, size_t size, std::vector<std::pair<size_t, size_t> >& ranges);
+
 	class Charset {
 		public:
 			static std::string getDefault(){return utf_8();}
@@ -331,3 +603,5 @@ namespace swift{
 	};
 
 }
+
+#endif // SWIFT_HEADER_INCLUDED
@@ -0,0 +1,408 @@
+/**
+* SWIFT
+* Copyright (c) 2014 Thomas Lextrait <thomas.lextrait@gmail.com>
+* All rights reserved
+*/
+
+/**
+* HTTP request parser: a differential check of the scanner based parser
+* against the strcspn() based parser it replaced, on fuzzed requests, and a
+* microbenchmark of both on a typical browser GET.
+*
+* 'make test' runs the check with every scanner the CPU supports, 'make
+* bench' runs the benchmark too. It is built with MONGOOSE_ENABLE_AVX2, so
+* that the AVX2 scanners the server doesn't use by default are compared.
+*/
+
+// The parser and its scanners are static. First, it sets feature macros.
+#include "../mongoose.c"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define FUZZ_REQUESTS 300000
+#define BENCH_REQUESTS 1000000
+#define MAX_HEADERS 30	// As many as the previous parser had room for
+
+static int failures = 0;
+
+/**
+* Previous parser, kept as the reference
+*/
+struct old_request {
+	const char *request_method, *uri, *http_version, *query_string;
+	int num_headers;
+	struct {
+		const char *name, *value;
+	} http_headers[MAX_HEADERS];
+};
+
+static int old_get_request_len(const char *s, int buf_len) {
+	const unsigned char *buf = (unsigned char *) s;
+	int i;
+
+	for (i = 0; i < buf_len; i++) {
+		if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
+			return -1;
+		} else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
+			return i + 2;
+		} else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+			return i + 3;
+		}
+	}
+
+	return 0;
+}
+
+static char *old_skip(char **buf, const char *delimiters) {
+	char *p, *begin_word, *end_word, *end_delimiters;
+
+	begin_word = *buf;
+	end_word = begin_word + strcspn(begin_word, delimiters);
+	end_delimiters = end_word + strspn(end_word, delimiters);
+
+	for (p = end_word; p < end_delimiters; p++) {
+		*p = '\0';
+	}
+
+	*buf = end_delimiters;
+
+	return begin_word;
+}
+
+static int old_parse_http_message(char *buf, int len, struct old_request *ri) {
+	int is_request, n, i;
+
+	ri->request_method = ri->uri = ri->http_version = ri->query_string = NULL;
+	ri->num_headers = 0;
+
+	buf[len - 1] = '\0';
+
+	while (*buf != '\0' && isspace(* (unsigned char *) buf)) {
+		buf++;
+	}
+	ri->request_method = old_skip(&buf, " ");
+	ri->uri = old_skip(&buf, " ");
+	ri->http_version = old_skip(&buf, "\r\n");
+
+	is_request = is_valid_http_method(ri->request_method);
+	if ((is_request && memcmp(ri->http_version, "HTTP/", 5) != 0) ||
+			(!is_request && memcmp(ri->request_method, "HTTP/", 5) != 0)) {
+		len = -1;
+	} else {
+		if (is_request) {
+			ri->http_version += 5;
+		}
+		for (i = 0; i < MAX_HEADERS; i++) {
+			ri->http_headers[i].name = old_skip(&buf, ": ");
+			ri->http_headers[i].value = old_skip(&buf, "\r\n");
+			if (ri->http_headers[i].name[0] == '\0')
+				break;
+			ri->num_headers = i + 1;
+		}
+
+		if ((ri->query_string = strchr(ri->uri, '?')) != NULL) {
+			*(char *) ri->query_string++ = '\0';
+		}
+		n = (int) strlen(ri->uri);
+		mg_url_decode(ri->uri, n, (char *) ri->uri, n + 1, 0);
+		if (*ri->uri == '/' || *ri->uri == '.') {
+			remove_double_dots_and_double_slashes((char *) ri->uri);
+		}
+	}
+
+	return len;
+}
+
+/**
+* A pair of scanners the parser can use
+*/
+struct scanner {
+	const char* name;
+	const char *(*ctl)(const char *, const char *);
+	const char *(*delim)(const char *, const char *, char, char);
+};
+
+/**
+* Lists the scanners this CPU supports, narrowest first
+* @return scanners
+*/
+std::vector<scanner> supportedScanners(){
+	std::vector<scanner> scanners;
+	scanner scalar = {"scalar", find_ctl_scalar, find_delim_scalar};
+	scanners.push_back(scalar);
+#ifdef MONGOOSE_USE_SIMD
+	scanner sse2 = {"SSE2", find_ctl_sse2, find_delim_sse2};
+	scanners.push_back(sse2);
+#ifdef MONGOOSE_ENABLE_AVX2
+	if(__builtin_cpu_supports("avx2")){
+		scanner avx2 = {"AVX2", find_ctl_avx2, find_delim_avx2};
+		scanners.push_back(avx2);
+	}
+#endif
+#endif
+	return scanners;
+}
+
+/**
+* Small deterministic generator, runs are reproducible
+* @param bound
+* @return number below the bound
+*/
+static unsigned int seed = 12345;
+unsigned int rnd(unsigned int n){
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+/**
+* Picks a string
+* @param choices
+* @param number of choices
+* @return one of them
+*/
+std::string pick(const char** choices, size_t count){
+	return choices[rnd(count)];
+}
+
+/**
+* Builds a random word, mostly of the given characters
+* @param characters
+* @param maximum length
+* @return word
+*/
+std::string word(std::string chars, unsigned int max){
+	std::string s;
+	for(unsigned int n = rnd(max + 1); n > 0; n--){
+		if(rnd(30) == 0){
+			// Delimiters and bytes >= 128 where they don't belong
+			const char odd[] = {' ', ':', '\r', '\n', (char) 0x80, (char) 0xe9, '?', '%', '/', '.'};
+			s += odd[rnd(sizeof(odd))];
+		}else if(rnd(30000) == 0){
+			// Control characters, the request is malformed
+			const char ctl[] = {'\t', '\0', 0x01, 0x1f, 0x7f};
+			s += ctl[rnd(sizeof(ctl))];
+		}else{
+			s += chars[rnd(chars.size())];
+		}
+	}
+	return s;
+}
+
+/**
+* Builds a random HTTP request, most are well formed
+* @return request
+*/
+std::string fuzzRequest(){
+	static const char* methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS", "PROPFIND", "HTTP/1.1", "get", "FOO", ""};
+	static const char* versions[] = {"HTTP/1.1", "HTTP/1.0", "HTTP/", "HTTX/1.1", "1.1", ""};
+	static const char* eols[] = {"\r\n", "\r\n", "\r\n", "\r\n", "\n", "\r"};
+	static const char* spaces[] = {" ", " ", " ", "  ", "\t", ""};
+	static const char* seps[] = {": ", ": ", ":", " : ", ":  ", " ", ""};
+	static const char* names[] = {"Host", "Accept", "accept-encoding", "Cookie", "Content-Length", "Range", "If-None-Match", "User-Agent", "X-Forwarded-For", "Connection"};
+	const std::string text = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_=&;,/.";
+
+	std::string eol = pick(eols, 6);
+	std::string s;
+	for(unsigned int n = rnd(8) == 0 ? rnd(3) : 0; n > 0; n--) s += rnd(2) ? " " : "\r\n";
+	s += pick(methods, 11) + pick(spaces, 6);
+	s += "/" + word(text + "%?/..", 60) + pick(spaces, 6);
+	s += pick(versions, 6) + eol;
+
+	for(unsigned int n = rnd(40); n > 0; n--){
+		std::string name = rnd(3) ? pick(names, 10) : word(text, 20);
+		s += name + pick(seps, 7) + word(text + " :", rnd(10) == 0 ? 300 : 40);
+		s += rnd(50) ? eol : pick(eols, 6);
+	}
+	if(rnd(20)) s += eol;
+
+	// Some requests have a body, or are cut short
+	if(rnd(10) == 0) s += word(text, 50);
+	if(rnd(10) == 0) s.resize(rnd(s.size() + 1));
+	return s;
+}
+
+/**
+* Compares two parsed strings
+* @param string or NULL
+* @param string or NULL
+* @return true if both are NULL or equal
+*/
+bool same(const char* a, const char* b){
+	return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+/**
+* Parses a request with the previous parser and the current one, and
+* reports any difference
+* @param request
+* @return false if they differ
+*/
+bool compare(const std::string& request){
+	int old_len = old_get_request_len(request.data(), (int) request.size());
+	int len = get_request_len(request.data(), (int) request.size());
+	if(old_len != len) return false;
+	if(len <= 0) return true;
+
+	std::string old_buf = request.substr(0, len), buf = request.substr(0, len);
+	struct old_request old_ri;
+	struct mg_connection ri;
+	struct mg_header headers[MAX_HEADERS];
+	memset(&ri, 0, sizeof(ri));
+	ri.http_headers = headers;
+
+	old_len = old_parse_http_message(&old_buf[0], len, &old_ri);
+	len = parse_http_message(&buf[0], len, &ri, MAX_HEADERS);
+	if(old_len != len || !same(old_ri.request_method, ri.request_method) || !same(old_ri.uri, ri.uri) ||
+		!same(old_ri.http_version, ri.http_version) || !same(old_ri.query_string, ri.query_string)){
+		return false;
+	}
+	if(len < 0) return true;
+
+	if(old_ri.num_headers != ri.num_headers) return false;
+	for(int i = 0; i < ri.num_headers; i++){
+		if(!same(old_ri.http_headers[i].name, ri.http_headers[i].name) ||
+			!same(old_ri.http_headers[i].value, ri.http_headers[i].value) ||
+			ri.http_headers[i].hash != header_hash(ri.http_headers[i].name)){
+			return false;
+		}
+	}
+
+	// Well-known headers are indexed at their first occurrence
+	for(int id = 0; id < MG_NUM_KNOWN_HEADERS; id++){
+		int first = 0;
+		for(int i = 0; i < ri.num_headers && first == 0; i++){
+			if(mg_strcasecmp(ri.http_headers[i].name, known_header_names[id]) == 0) first = i + 1;
+		}
+		if(ri.header_index[id] != first) return false;
+	}
+	return true;
+}
+
+/**
+* Escapes a request to print it
+* @param request
+* @return printable request
+*/
+std::string printable(const std::string& request){
+	std::string s;
+	char hex[8];
+	for(size_t i = 0; i < request.size(); i++){
+		unsigned char c = request[i];
+		if(c >= 0x20 && c < 0x7f && c != '\\'){
+			s += c;
+		}else{
+			snprintf(hex, sizeof(hex), "\\x%02x", c);
+			s += hex;
+		}
+	}
+	return s;
+}
+
+/**
+* Parses fuzzed requests with each scanner and the previous parser
+* @param scanners
+*/
+void differentialCheck(const std::vector<scanner>& scanners){
+	for(size_t i = 0; i < scanners.size(); i++){
+		find_ctl = scanners[i].ctl;
+		find_delim = scanners[i].delim;
+		seed = 12345;
+
+		int differences = 0, parsed = 0;
+		for(int n = 0; n < FUZZ_REQUESTS; n++){
+			std::string request = fuzzRequest();
+			if(get_request_len(request.data(), (int) request.size()) > 0) parsed++;
+			if(!compare(request)){
+				if(differences++ < 3){
+					std::cout << "     " << scanners[i].name << " differs on \"" << printable(request) << "\"" << std::endl;
+				}
+			}
+		}
+
+		std::cout << (differences == 0 ? "ok   " : "FAIL ") << scanners[i].name << ": " << FUZZ_REQUESTS
+			<< " fuzzed requests, " << parsed << " complete, " << differences << " parsed differently" << std::endl;
+		if(differences != 0) failures++;
+	}
+}
+
+// A browser GET of about 560 bytes with nine headers
+static const char bench_request[] =
+	"GET /js/winedex.js?v=3&lang=en HTTP/1.1\r\n"
+	"Host: www.winedex.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Accept: text/javascript, application/javascript, */*; q=0.01\r\n"
+	"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_9_4) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/37.0.2062.94 Safari/537.36\r\n"
+	"Referer: http://www.winedex.com/wines/bordeaux/margaux\r\n"
+	"Accept-Encoding: gzip,deflate,sdch\r\n"
+	"Accept-Language: en-US,en;q=0.8,fr;q=0.6\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; region=eu; seen=1\r\n"
+	"If-None-Match: \"1408917562.29331\"\r\n"
+	"\r\n";
+
+/**
+* Times a parser on the benchmark request, copied first like try_parse()
+* detaches it
+* @param parser name
+* @param parser, returns the request length
+*/
+template <typename Parser>
+void bench(const char* name, Parser parse){
+	const int size = sizeof(bench_request) - 1;
+	char buf[sizeof(bench_request)];
+	long check = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int i = 0; i < BENCH_REQUESTS; i++){
+		memcpy(buf, bench_request, size);
+		check += parse(buf, size);
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "     " << name << ": " << (int) (ns / BENCH_REQUESTS) << " ns/request" << std::endl;
+	if(check != (long) size * BENCH_REQUESTS){
+		std::cout << "FAIL " << name << " didn't parse the benchmark request" << std::endl;
+		failures++;
+	}
+}
+
+/**
+* Benchmarks the previous parser and the current one with each scanner
+* @param scanners
+*/
+void benchmark(const std::vector<scanner>& scanners){
+	std::cout << "     " << sizeof(bench_request) - 1 << " byte GET, " << BENCH_REQUESTS << " times" << std::endl;
+
+	bench("previous parser", [](char* buf, int size){
+		struct old_request ri;
+		int len = old_get_request_len(buf, size);
+		return len > 0 ? old_parse_http_message(buf, len, &ri) : len;
+	});
+
+	for(size_t i = 0; i < scanners.size(); i++){
+		find_ctl = scanners[i].ctl;
+		find_delim = scanners[i].delim;
+		bench(scanners[i].name, [](char* buf, int size){
+			struct mg_connection ri;
+			struct mg_header headers[MAX_HEADERS];
+			ri.http_headers = headers;
+			int len = get_request_len(buf, size);
+			return len > 0 ? parse_http_message(buf, len, &ri, MAX_HEADERS) : len;
+		});
+	}
+}
+
+int main(int argc, char** argv){
+	init_header_ids();
+	std::vector<scanner> scanners = supportedScanners();
+
+	differentialCheck(scanners);
+	if(argc > 1 && strcmp(argv[1], "--bench") == 0){
+		benchmark(scanners);
+	}
+
+	std::cout << (failures == 0 ? "PASS" : "FAIL") << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/**
+* SWIFT
+* Copyright (c) 2014 Thomas Lextrait <thomas.lextrait@gmail.com>
+* All rights reserved
+*/
+
+/**
+* Range requests for the gzip variant of a packed resource: the parts are
+* slices of the gzip body, so every 206 must carry Content-Encoding: gzip.
+*
+* Run from the repository root with 'make test', it needs the packer and
+* mime.types.
+*/
+
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../swift.h"
+
+using namespace swift;
+
+#define TEST_PORT 18277
+
+static int failures = 0;
+
+/**
+* Reports a failed check
+* @param condition
+* @param description
+*/
+void check(bool ok, std::string what){
+	std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+	if(!ok) failures++;
+}
+
+/**
+* Sends a GET request on a new connection and reads the whole response
+* @param path
+* @param extra request headers, each ending with \r\n
+* @param response headers
+* @param response body
+* @return false if the server couldn't be reached
+*/
+bool get(std::string path, std::string extra, std::string& headers, std::string& body){
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(TEST_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(sock < 0 || connect(sock, (struct sockaddr*) &sin, sizeof(sin)) != 0){
+		if(sock >= 0) close(sock);
+		return false;
+	}
+
+	std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n" + extra + "Connection: close\r\n\r\n";
+	send(sock, request.data(), request.size(), 0);
+
+	std::string response;
+	char buf[65536];
+	ssize_t n;
+	while((n = recv(sock, buf, sizeof(buf), 0)) > 0) response.append(buf, n);
+	close(sock);
+
+	size_t end = response.find("\r\n\r\n");
+	headers = response.substr(0, end);
+	body = end == std::string::npos ? "" : response.substr(end + 4);
+	return true;
+}
+
+/**
+* Counts the lines of some headers that start with a prefix
+* @param headers
+* @param line prefix
+* @return count
+*/
+int countLines(std::string headers, std::string prefix){
+	int count = 0;
+	for(size_t pos = 0; (pos = headers.find(prefix, pos)) != std::string::npos; pos += prefix.size()){
+		if(pos == 0 || headers[pos - 1] == '\n') count++;
+	}
+	return count;
+}
+
+int main(){
+	// A resource that compresses well, so that the pack has a gzip variant
+	char dir[] = "/tmp/swift_test.XXXXXX";
+	if(mkdtemp(dir) == NULL){
+		std::cout << "Couldn't create a temporary directory" << std::endl;
+		return 1;
+	}
+	std::string resources = std::string(dir) + "/resources";
+	std::string pack = std::string(dir) + "/test.pack";
+	mkdir(resources.c_str(), 0755);
+	std::ofstream js((resources + "/app.js").c_str());
+	for(int i = 0; i < 500; i++) js << "console.log('line " << i << "');" << std::endl;
+	js.close();
+
+	if(system(("./packer " + resources + " " + pack + " > /dev/null").c_str()) != 0){
+		std::cout << "Couldn't run the packer" << std::endl;
+		return 1;
+	}
+
+	Server* server = Server::newServer();
+	if(!server->mountPack("/p", pack)){
+		std::cout << "Couldn't mount the pack" << std::endl;
+		return 1;
+	}
+	std::thread([server](){ server->Start(TEST_PORT, 1); }).detach();
+
+	std::string headers, gzip, body;
+	bool up = false;
+	for(int i = 0; i < 50 && !(up = get("/p/app.js", "Accept-Encoding: gzip\r\n", headers, gzip)); i++){
+		usleep(100000);
+	}
+	check(up, "server is up");
+	if(!up) _exit(1);
+
+	check(countLines(headers, "Content-Encoding: gzip") == 1, "200 of the gzip variant is gzip encoded");
+	check(gzip.size() > 30, "gzip variant has a body");
+
+	get("/p/app.js", "Accept-Encoding: gzip\r\nRange: bytes=10-29\r\n", headers, body);
+	check(headers.compare(0, 12, "HTTP/1.1 206") == 0, "single range is answered with a 206");
+	check(countLines(headers, "Content-Encoding: gzip") == 1, "single range is gzip encoded");
+	check(body == gzip.substr(10, 20), "single range is a slice of the gzip body");
+
+	get("/p/app.js", "Accept-Encoding: gzip\r\nRange: bytes=0-4,20-24\r\n", headers, body);
+	check(headers.compare(0, 12, "HTTP/1.1 206") == 0, "multiple ranges are answered with a 206");
+	check(countLines(body, "Content-Encoding: gzip") == 2, "each part is gzip encoded");
+	check(body.find(gzip.substr(20, 5)) != std::string::npos, "parts are slices of the gzip body");
+
+	get("/p/app.js", "Range: bytes=10-29\r\n", headers, body);
+	check(countLines(headers, "Content-Encoding:") == 0, "range of the identity variant isn't encoded");
+
+	unlink((resources + "/app.js").c_str());
+	rmdir(resources.c_str());
+	unlink(pack.c_str());
+	rmdir(dir);
+
+	std::cout << (failures == 0 ? "PASS" : "FAIL") << std::endl;
+	std::cout.flush();
+
+	// The server thread never returns
+	_exit(failures == 0 ? 0 : 1);
+}